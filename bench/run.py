@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+# compile-time and run-time numbers for the bench/*.1c workloads.
+#
+#   python bench/run.py [--cc PATH] [--flags=-O] [--runs N] [--lines N]
+#
+# compile phases come from the compiler's own --time output, run time is the
+# best of N wall-clock runs of the produced binary (skipped where it cant run).
+# the peephole line is what it took out, code size without it is the sum
+
+import argparse
+import os
+import platform
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+
+
+def default_cc():
+    for name in ("1cotlinc.exe", "1cotlinc"):
+        p = os.path.join(ROOT, name)
+        if os.path.exists(p):
+            return p
+    return os.path.join(ROOT, "1cotlinc")
+
+
+def gen_big(path, lines):
+    # lots of variables, straight-line arithmetic, ifs and small loops.
+    # deterministic so numbers are comparable between runs
+    rnd = random.Random(1)
+    nvars = 2000
+    out = []
+    for i in range(nvars):
+        out.append("пусть v%d = %d" % (i, i % 97))
+    n = nvars
+    while n < lines:
+        kind = rnd.randrange(10)
+        a = rnd.randrange(nvars)
+        b = rnd.randrange(nvars)
+        c = rnd.randrange(nvars)
+        if kind < 6:
+            out.append("v%d = v%d + v%d * %d - v%d / %d" % (a, b, c, rnd.randrange(1, 9), a, rnd.randrange(1, 17)))
+            n += 1
+        elif kind < 8:
+            out.append("в таком случае v%d > v%d {" % (a, b))
+            out.append("    v%d = v%d - 1" % (c, c))
+            out.append("} иначе.если {")
+            out.append("    v%d = v%d + 1" % (c, c))
+            out.append("}")
+            n += 5
+        elif kind < 9:
+            out.append("повторять.раз %d {" % rnd.randrange(1, 4))
+            out.append("    v%d = v%d + v%d" % (a, a, b))
+            out.append("}")
+            n += 3
+        else:
+            out.append("исп.команду.print(v%d)" % a)
+            n += 1
+    with open(path, "w", encoding="utf-8", newline="\n") as f:
+        f.write("\n".join(out) + "\n")
+
+
+def compile_one(cc, flags, src, exe):
+    cmd = [cc] + flags + ["--time", src, exe]
+    t0 = time.perf_counter()
+    r = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    wall = (time.perf_counter() - t0) * 1000.0
+    if r.returncode != 0:
+        sys.stderr.write(r.stderr.decode("utf-8", "replace"))
+        return None
+    phases = []
+    size = 0
+    frame = 0
+    peep = {}
+    for line in r.stderr.decode("utf-8", "replace").splitlines():
+        parts = line.split()
+        if len(parts) >= 3 and parts[0] == "time":
+            phases.append((parts[1], float(parts[2])))
+        elif len(parts) >= 3 and parts[0] == "size" and parts[1] == "code":
+            size = int(parts[2])
+        elif len(parts) >= 3 and parts[0] == "size" and parts[1] == "frame":
+            frame = int(parts[2])
+        elif len(parts) >= 4 and parts[0] == "peep":
+            peep[parts[3]] = int(parts[2])
+    return phases, size, frame, peep, wall
+
+
+def run_one(cmd, runs):
+    best = None
+    for _ in range(runs):
+        t0 = time.perf_counter()
+        r = subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        dt = (time.perf_counter() - t0) * 1000.0
+        if r.returncode != 0:
+            return None
+        best = dt if best is None else min(best, dt)
+    return best
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--cc", default=default_cc())
+    ap.add_argument("--flags", default="")
+    ap.add_argument("--runs", type=int, default=5)
+    ap.add_argument("--lines", type=int, default=100000)
+    args = ap.parse_args()
+
+    flags = args.flags.split()
+    host = platform.system()
+    can_run = platform.machine().lower() in ("x86_64", "amd64")
+    if host == "Linux" and not any(f.startswith("--target=") for f in flags):
+        flags.append("--target=linux-x86_64")
+    native = host == "Windows" or "--target=linux-x86_64" in flags
+
+    work = tempfile.mkdtemp(prefix="1cotlin-bench-")
+    srcs = sorted(os.path.join(HERE, f) for f in os.listdir(HERE) if f.endswith(".1c"))
+    big = os.path.join(work, "big.1c")
+    gen_big(big, args.lines)
+    srcs.append(big)
+
+    print("compiler: %s %s" % (args.cc, " ".join(flags)))
+    for src in srcs:
+        name = os.path.splitext(os.path.basename(src))[0]
+        exe = os.path.join(work, name + (".exe" if host == "Windows" else ""))
+        res = compile_one(args.cc, flags, src, exe)
+        print()
+        if res is None:
+            print("%-12s compile failed" % name)
+            continue
+        phases, size, frame, peep, wall = res
+        total = sum(t for _, t in phases)
+        print("%-12s code %d bytes, frame %d bytes, compile %.2f ms (%.2f ms wall)" % (name, size, frame, total, wall))
+        if peep:
+            saved = peep.get("bytes", 0)
+            pct = 100.0 * saved / max(1, size + saved)
+            print("    %-14s -%d bytes (%.1f%%), -%d insns" % ("peephole", saved, pct, peep.get("insns", 0)))
+        for ph, t in phases:
+            print("    %-14s %10.3f ms" % (ph, t))
+        if can_run and native:
+            rt = run_one([exe], args.runs)
+            print("    %-14s %10s" % ("run", "failed" if rt is None else "%.2f ms" % rt))
+        if can_run and name != "big":
+            rt = run_one([args.cc, "--run"] + [f for f in flags if f == "-O"] + [src], args.runs)
+            print("    %-14s %10s" % ("--run", "failed" if rt is None else "%.2f ms" % rt))
+
+
+if __name__ == "__main__":
+    main()
@@ -5,8 +5,7 @@ static void gen_expr(CodeGen *cg, Expr *e);
 static void emit8(CodeBuf *c, uint8_t v) {
     if (c->len == c->cap) {
         size_t nc = c->cap ? c->cap * 2 : 1024;
-        c->data = (uint8_t *)realloc(c->data, nc);
-        if (!c->data) die("out of memory");
+        c->data = (uint8_t *)region_grow(c->rg, c->data, c->cap, nc);
         c->cap = nc;
     }
     c->data[c->len++] = v;
@@ -30,50 +29,159 @@ static void emit64(CodeBuf *c, uint64_t v) {
 static void fixups_push(CodeGen *cg, Fixup f) {
     if (cg->fixup_count == cg->fixup_cap) {
         size_t nc = cg->fixup_cap ? cg->fixup_cap * 2 : 64;
-        cg->fixups = (Fixup *)realloc(cg->fixups, nc * sizeof(Fixup));
-        if (!cg->fixups) die("out of memory");
+        cg->fixups = (Fixup *)region_grow(cg->rg, cg->fixups, cg->fixup_cap * sizeof(Fixup), nc * sizeof(Fixup));
         cg->fixup_cap = nc;
     }
     cg->fixups[cg->fixup_count++] = f;
+    cg->peep.fence = cg->code.len;
 }
 
 
 static int new_label(CodeGen *cg) {
     if (cg->label_count == cg->label_cap) {
         size_t nc = cg->label_cap ? cg->label_cap * 2 : 64;
-        cg->labels = (Label *)realloc(cg->labels, nc * sizeof(Label));
-        if (!cg->labels) die("out of memory");
+        cg->labels = (Label *)region_grow(cg->rg, cg->labels, cg->label_cap * sizeof(Label), nc * sizeof(Label));
         cg->label_cap = nc;
     }
-    int id = (int)cg->label_count++;
-    cg->labels[id].pos = -1;
-    return id;
+    cg->labels[cg->label_count].pos = -1;
+    return cg->label_base + (int)cg->label_count++;
 }
 
 
 static void place_label(CodeGen *cg, int id) {
-    cg->labels[id].pos = (int)cg->code.len;
+    cg->labels[id - cg->label_base].pos = (int)cg->code.len;
+    cg->peep.fence = cg->code.len;
 }
 
 
 static void emit_rel32_label(CodeGen *cg, int label_id) {
-    Fixup f = {FIX_LABEL, cg->code.len, label_id, 0};
+    Fixup f = {FIX_LABEL, cg->code.len, label_id, 0, 0};
     emit32(&cg->code, 0);
     fixups_push(cg, f);
 }
 
 
 static void emit_rel32_rip(CodeGen *cg, uint32_t target_rva) {
-    Fixup f = {FIX_RIP, cg->code.len, 0, target_rva};
+    Fixup f = {FIX_RIP, cg->code.len, 0, target_rva, 0};
     emit32(&cg->code, 0);
     fixups_push(cg, f);
 }
 
 
+// the disp32/imm32 that ends the instruction just emitted gets its real
+// value from patch_fixups, once the frame layout is final
+static void fix_last32(CodeGen *cg, FixKind kind, int slot) {
+    Fixup f = {kind, cg->code.len - 4, slot, 0, 0};
+    fixups_push(cg, f);
+}
+
+
+// variable slots are everywhere, fencing on each would leave the peephole
+// nothing to do. instead it moves these along itself when it cuts code, see peep_cut
+static void fix_var(CodeGen *cg, int idx) {
+    size_t fence = cg->peep.fence;
+    fix_last32(cg, FIX_VAR, idx);
+    cg->peep.fence = fence;
+}
+
+
+// emit-time peephole. the ast path moves everything through rax, the vstack
+// and the frame, so the same few sequences come out over and over: a store
+// and a reload of the same slot, a push popped right back, a load that is
+// overwritten before anyone reads it. a handful of emitters below remember
+// the last instruction or two and drop or rewrite them on the spot, every
+// other emitter leaves peep.end stale and that forgets it all.
+// nothing moves across a label or a fixup, and gen_stmts fences every
+// top-level statement so -jN output stays byte-identical
+enum { PEEP_NONE, PEEP_DEF, PEEP_PUSH };
+
+static int peep_live(CodeGen *cg) {
+    return cg->peephole && cg->peep.end == cg->code.len && cg->peep.fence < cg->code.len;
+}
+
+
+static void peep_fence(CodeGen *cg) {
+    cg->peep.fence = cg->code.len;
+}
+
+
+// n bytes at at are gone and the rest moved down. nothing past the fence has
+// a fixup but a variable slot, and those are all at the end of the list
+static void peep_cut(CodeGen *cg, size_t at, size_t n) {
+    size_t i = cg->fixup_count;
+    while (i > 0 && cg->fixups[i - 1].offset >= at) i--;
+    size_t k = i;
+    for (; i < cg->fixup_count; i++) {
+        if (cg->fixups[i].offset < at + n) continue;
+        cg->fixups[k] = cg->fixups[i];
+        cg->fixups[k++].offset -= n;
+    }
+    cg->fixup_count = k;
+}
+
+
+// before an instruction that sets rax without reading anything but rbp.
+// if the last one did nothing but set rax too it is dead, drop it
+static size_t peep_begin_def(CodeGen *cg) {
+    Peephole *p = &cg->peep;
+    if (!peep_live(cg)) {
+        p->push = (size_t)-1;
+    } else if (p->last == PEEP_DEF && p->fence <= p->start) {
+        p->insns++;
+        p->bytes += cg->code.len - p->start;
+        peep_cut(cg, p->start, cg->code.len - p->start);
+        cg->code.len = p->start;
+    } else {
+        p->push = p->last == PEEP_PUSH ? p->start : (size_t)-1;
+    }
+    return cg->code.len;
+}
+
+
+static void peep_def(CodeGen *cg, size_t start, int has_slot, int32_t slot) {
+    Peephole *p = &cg->peep;
+    p->last = PEEP_DEF;
+    p->start = start;
+    p->end = cg->code.len;
+    p->has_slot = has_slot;
+    p->slot = slot;
+}
+
+
+// the instruction just emitted from start left rax and the frame alone
+static void peep_keep(CodeGen *cg, size_t start) {
+    Peephole *p = &cg->peep;
+    if (p->end != start || p->fence >= start) return;
+    p->last = PEEP_NONE;
+    p->end = cg->code.len;
+}
+
+
+// nothing keeps flags live across a constant load, so 0 is xor eax, eax
 static void emit_mov_rax_imm64(CodeGen *cg, uint64_t v) {
-    emit8(&cg->code, 0x48);
-    emit8(&cg->code, 0xB8);
-    emit64(&cg->code, v);
+    size_t at = peep_begin_def(cg);
+    if (!cg->peephole) {
+        emit8(&cg->code, 0x48);
+        emit8(&cg->code, 0xB8);
+        emit64(&cg->code, v);
+    } else if (v == 0) {
+        emit8(&cg->code, 0x31);
+        emit8(&cg->code, 0xC0);
+    } else if (v <= 0xFFFFFFFFu) {
+        emit8(&cg->code, 0xB8);
+        emit32(&cg->code, (uint32_t)v);
+    } else if ((int64_t)v >= INT32_MIN && (int64_t)v < 0) {
+        emit8(&cg->code, 0x48);
+        emit8(&cg->code, 0xC7);
+        emit8(&cg->code, 0xC0);
+        emit32(&cg->code, (uint32_t)v);
+    } else {
+        emit8(&cg->code, 0x48);
+        emit8(&cg->code, 0xB8);
+        emit64(&cg->code, v);
+    }
+    if (cg->peephole) cg->peep.bytes += 10 - (cg->code.len - at);
+    peep_def(cg, at, 0, 0);
 }
 
 
@@ -90,13 +198,6 @@ static void emit_mov_r8d_imm32(CodeGen *cg, uint32_t v) {
 }
 
 
-static void emit_mov_r9_imm32(CodeGen *cg, uint32_t v) {
-    emit8(&cg->code, 0x49);
-    emit8(&cg->code, 0xC7);
-    emit8(&cg->code, 0xC1);
-    emit32(&cg->code, v);
-}
-
 static void emit_mov_rdx_imm32(CodeGen *cg, uint32_t v) {
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0xC7);
@@ -113,11 +214,20 @@ static void emit_mov_rcx_from_rbp(CodeGen *cg, int32_t disp) {
 }
 
 
-static void emit_mov_rax_from_rbp(CodeGen *cg, int32_t disp) {
+// this and the store say whether they emitted anything, a variable slot needs its fixup
+static int emit_mov_rax_from_rbp(CodeGen *cg, int32_t disp) {
+    if (peep_live(cg) && cg->peep.has_slot && cg->peep.slot == disp) {
+        cg->peep.insns++;
+        cg->peep.bytes += 7;
+        return 0;
+    }
+    size_t at = peep_begin_def(cg);
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x8B);
     emit8(&cg->code, 0x85);
     emit32(&cg->code, (uint32_t)disp);
+    peep_def(cg, at, 1, disp);
+    return 1;
 }
 
 static void emit_mov_rax_from_rcx_disp8(CodeGen *cg, uint8_t disp) {
@@ -215,12 +325,6 @@ static void emit_cmp_r8_rax(CodeGen *cg) {
     emit8(&cg->code, 0xC0);
 }
 
-static void emit_cmp_r9_rax(CodeGen *cg) {
-    emit8(&cg->code, 0x49);
-    emit8(&cg->code, 0x39);
-    emit8(&cg->code, 0xC1);
-}
-
 static void emit_cmp_rdx_rax(CodeGen *cg) {
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x39);
@@ -260,11 +364,14 @@ static void emit_mov_r9_from_rdx_disp8(CodeGen *cg, uint8_t disp) {
     emit8(&cg->code, disp);
 }
 
+// rdx is always a list header or its data here, never the frame
 static void emit_mov_mem_rdx_from_rax(CodeGen *cg, uint8_t disp) {
+    size_t at = cg->code.len;
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x89);
     emit8(&cg->code, 0x42);
     emit8(&cg->code, disp);
+    peep_keep(cg, at);
 }
 
 static void emit_mov_mem_rdx_from_rcx(CodeGen *cg, uint8_t disp) {
@@ -298,13 +405,6 @@ static void emit_mov_r9_from_rcx(CodeGen *cg) {
     emit8(&cg->code, 0xC9);
 }
 
-static void emit_lea_r8_rdx_rax(CodeGen *cg) {
-    emit8(&cg->code, 0x4C);
-    emit8(&cg->code, 0x8D);
-    emit8(&cg->code, 0x04);
-    emit8(&cg->code, 0xC2);
-}
-
 static void emit_mov_r8_from_rbp(CodeGen *cg, int32_t disp) {
     emit8(&cg->code, 0x4C);
     emit8(&cg->code, 0x8B);
@@ -312,13 +412,6 @@ static void emit_mov_r8_from_rbp(CodeGen *cg, int32_t disp) {
     emit32(&cg->code, (uint32_t)disp);
 }
 
-static void emit_mov_r9_from_rbp(CodeGen *cg, int32_t disp) {
-    emit8(&cg->code, 0x4C);
-    emit8(&cg->code, 0x8B);
-    emit8(&cg->code, 0x8D);
-    emit32(&cg->code, (uint32_t)disp);
-}
-
 static void emit_mov_mem_rax_from_rcx(CodeGen *cg) {
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x89);
@@ -389,12 +482,6 @@ static void emit_lea_r8_rcx_rdx(CodeGen *cg) {
     emit8(&cg->code, 0x10);
 }
 
-static void emit_mov_mem_r8_from_rax(CodeGen *cg) {
-    emit8(&cg->code, 0x49);
-    emit8(&cg->code, 0x89);
-    emit8(&cg->code, 0x00);
-}
-
 static void emit_mov_mem_r8_from_r9(CodeGen *cg) {
     emit8(&cg->code, 0x4D);
     emit8(&cg->code, 0x89);
@@ -422,11 +509,140 @@ static void emit_add_rax_imm8(CodeGen *cg, uint8_t v) {
 }
 
 
-static void emit_mov_rbp_from_rax(CodeGen *cg, int32_t disp) {
+static int emit_mov_rbp_from_rax(CodeGen *cg, int32_t disp) {
+    Peephole *p = &cg->peep;
+    if (peep_live(cg) && p->has_slot && p->slot == disp) {
+        p->insns++;
+        p->bytes += 7;
+        return 0;
+    }
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x89);
     emit8(&cg->code, 0x85);
     emit32(&cg->code, (uint32_t)disp);
+    p->last = PEEP_NONE;
+    p->end = cg->code.len;
+    p->has_slot = 1;
+    p->slot = disp;
+    return 1;
+}
+
+
+static void emit_rex_w(CodeGen *cg, int reg, int rm) {
+    emit8(&cg->code, (uint8_t)(0x48 | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0)));
+}
+
+
+static void emit_mov_reg_reg(CodeGen *cg, Reg dst, Reg src) {
+    // a pop into rcx may move this in front of itself, so not from rcx or rbx
+    int def = dst == REG_RAX && src != REG_RCX && src != REG_RBX;
+    size_t at = def ? peep_begin_def(cg) : cg->code.len;
+    emit_rex_w(cg, src, dst);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, (uint8_t)(0xC0 | ((src & 7) << 3) | (dst & 7)));
+    if (def) peep_def(cg, at, 0, 0);
+}
+
+
+static int emit_mov_reg_from_rbp(CodeGen *cg, Reg dst, int32_t disp) {
+    if (dst == REG_RAX) return emit_mov_rax_from_rbp(cg, disp);
+    size_t at = cg->code.len;
+    emit_rex_w(cg, dst, REG_RBP);
+    emit8(&cg->code, 0x8B);
+    emit8(&cg->code, (uint8_t)(0x85 | ((dst & 7) << 3)));
+    emit32(&cg->code, (uint32_t)disp);
+    if (dst != REG_RBX) peep_keep(cg, at);
+    return 1;
+}
+
+
+static void emit_mov_rbp_from_reg(CodeGen *cg, int32_t disp, Reg src) {
+    emit_rex_w(cg, src, REG_RBP);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, (uint8_t)(0x85 | ((src & 7) << 3)));
+    emit32(&cg->code, (uint32_t)disp);
+}
+
+
+// mov r32, imm32 zero-extends, a byte or two shorter when the value isnt negative
+static void emit_mov_reg_imm32(CodeGen *cg, Reg dst, int32_t v) {
+    size_t at = dst == REG_RAX ? peep_begin_def(cg) : cg->code.len;
+    if (cg->peephole && v >= 0) {
+        if (dst & 8) emit8(&cg->code, 0x41);
+        emit8(&cg->code, (uint8_t)(0xB8 | (dst & 7)));
+        cg->peep.bytes += (dst & 8) ? 1 : 2;
+    } else {
+        emit_rex_w(cg, 0, dst);
+        emit8(&cg->code, 0xC7);
+        emit8(&cg->code, (uint8_t)(0xC0 | (dst & 7)));
+    }
+    emit32(&cg->code, (uint32_t)v);
+    if (dst == REG_RAX) peep_def(cg, at, 0, 0);
+}
+
+
+// shl/shr/sar reg, imm8: ext is 4/5/7
+static void emit_shift_reg(CodeGen *cg, int ext, Reg reg, int count) {
+    emit_rex_w(cg, 0, reg);
+    emit8(&cg->code, 0xC1);
+    emit8(&cg->code, (uint8_t)(0xC0 | (ext << 3) | (reg & 7)));
+    emit8(&cg->code, (uint8_t)count);
+}
+
+
+// rax / 2^k with idiv rounding: negatives get 2^k-1 added before the sar
+static void emit_div_pow2_rax(CodeGen *cg, int k) {
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0xC2);
+    if (k > 1) emit_shift_reg(cg, 7, REG_RDX, 63);
+    emit_shift_reg(cg, 5, REG_RDX, 64 - k);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x01);
+    emit8(&cg->code, 0xD0);
+    emit_shift_reg(cg, 7, REG_RAX, k);
+}
+
+
+// rax / d without idiv, see div_magic(). clobbers rcx and rdx
+static void emit_div_const_rax(CodeGen *cg, int64_t d) {
+    int64_t mul;
+    int shift;
+    div_magic(d, &mul, &shift);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0xC1);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0xB8);
+    emit64(&cg->code, (uint64_t)mul);
+    // imul rcx: rdx = high half of x * mul
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0xF7);
+    emit8(&cg->code, 0xE9);
+    if (d > 0 && mul < 0) {
+        emit8(&cg->code, 0x48);
+        emit8(&cg->code, 0x01);
+        emit8(&cg->code, 0xCA);
+    } else if (d < 0 && mul > 0) {
+        emit8(&cg->code, 0x48);
+        emit8(&cg->code, 0x29);
+        emit8(&cg->code, 0xCA);
+    }
+    if (shift > 0) emit_shift_reg(cg, 7, REG_RDX, shift);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0xD0);
+    emit_shift_reg(cg, 5, REG_RAX, 63);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x01);
+    emit8(&cg->code, 0xD0);
+}
+
+
+static void emit_const_op_rax(CodeGen *cg, OpKind op, int64_t n) {
+    if (op == OP_SHL) emit_shift_reg(cg, 4, REG_RAX, (int)n);
+    else if (op == OP_DIV_POW2) emit_div_pow2_rax(cg, (int)n);
+    else emit_div_const_rax(cg, n);
 }
 
 
@@ -454,11 +670,14 @@ static void emit_lea_r9_rbp(CodeGen *cg, int32_t disp) {
 }
 
 
-static void emit_lea_rdx_rip(CodeGen *cg, uint32_t target_rva) {
+// string rvas are only handed out when the image is laid out
+static void emit_lea_rdx_str(CodeGen *cg, StringLit *str) {
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x8D);
     emit8(&cg->code, 0x15);
-    emit_rel32_rip(cg, target_rva);
+    Fixup f = {FIX_STR, cg->code.len, 0, 0, str};
+    emit32(&cg->code, 0);
+    fixups_push(cg, f);
 }
 
 
@@ -469,7 +688,16 @@ static void emit_call_iat(CodeGen *cg, uint32_t iat_rva) {
 }
 
 
+static void emit_call_label(CodeGen *cg, int label_id) {
+    emit8(&cg->code, 0xE8);
+    emit_rel32_label(cg, label_id);
+}
+
+
 static void emit_push_rax(CodeGen *cg) {
+    Peephole *p = &cg->peep;
+    size_t at = cg->code.len;
+    if (!peep_live(cg)) p->has_slot = 0;
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x89);
     emit8(&cg->code, 0x03);
@@ -477,10 +705,35 @@ static void emit_push_rax(CodeGen *cg) {
     emit8(&cg->code, 0x83);
     emit8(&cg->code, 0xC3);
     emit8(&cg->code, 0x08);
+    cg->vdepth++;
+    p->last = PEEP_PUSH;
+    p->start = at;
+    p->end = cg->code.len;
 }
 
 
+// a push with nothing in between, or one load of rax, turns into mov rcx, rax
+// in front of that load
 static void emit_pop_rcx(CodeGen *cg) {
+    Peephole *p = &cg->peep;
+    size_t push = (size_t)-1;
+    cg->vdepth--;
+    if (peep_live(cg) && p->last == PEEP_PUSH) push = p->start;
+    else if (peep_live(cg) && p->last == PEEP_DEF) push = p->push;
+    if (push != (size_t)-1 && p->fence <= push) {
+        size_t n = cg->code.len - (push + 7);
+        peep_cut(cg, push + 3, 4);
+        memmove(cg->code.data + push + 3, cg->code.data + push + 7, n);
+        cg->code.data[push] = 0x48;
+        cg->code.data[push + 1] = 0x89;
+        cg->code.data[push + 2] = 0xC1;
+        cg->code.len = push + 3 + n;
+        p->insns += 3;
+        p->bytes += 11;
+        p->last = PEEP_NONE;
+        p->end = cg->code.len;
+        return;
+    }
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x83);
     emit8(&cg->code, 0xEB);
@@ -520,67 +773,1081 @@ static void emit_pop_r9(CodeGen *cg) {
     emit8(&cg->code, 0x0B);
 }
 
+// -O spill slots for IR temporaries reuse the vstack area, rbx is not a stack pointer there
+static int32_t temp_slot(CodeGen *cg, int slot) {
+    return (int32_t)(cg->vstack_base_offset + slot * 8);
+}
+
+// linux syscalls take their args in rdi/rsi, which -O uses for variables,
+// so those two are saved around every syscall
+static void emit_push_rdi_rsi(CodeGen *cg) {
+    emit8(&cg->code, 0x57);
+    emit8(&cg->code, 0x56);
+}
+
+
+static void emit_pop_rsi_rdi(CodeGen *cg) {
+    emit8(&cg->code, 0x5E);
+    emit8(&cg->code, 0x5F);
+}
+
+
+static void emit_syscall(CodeGen *cg, uint32_t nr) {
+    emit8(&cg->code, 0xB8);
+    emit32(&cg->code, nr);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x05);
+}
+
 static void emit_heap_alloc(CodeGen *cg, uint32_t flags) {
+    if (cg->target == TARGET_LINUX) {
+        // mmap(0, rax, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0), pages come zeroed
+        emit_push_rdi_rsi(cg);
+        emit_mov_reg_reg(cg, REG_RSI, REG_RAX);
+        emit8(&cg->code, 0x31);
+        emit8(&cg->code, 0xFF);
+        emit_mov_rdx_imm32(cg, 3);
+        emit_mov_reg_imm32(cg, REG_R10, 0x22);
+        emit_mov_reg_imm32(cg, REG_R8, -1);
+        emit8(&cg->code, 0x45);
+        emit8(&cg->code, 0x31);
+        emit8(&cg->code, 0xC9);
+        emit_syscall(cg, 9);
+        emit_pop_rsi_rdi(cg);
+        return;
+    }
     emit_mov_rcx_from_rbp(cg, (int32_t)cg->heap_offset);
     emit_mov_rdx_imm32(cg, flags);
     emit_mov_r8_from_rax(cg);
     emit_call_iat(cg, cg->iat_heapalloc_rva);
 }
 
-void gen_prolog(CodeGen *cg) {
-    emit8(&cg->code, 0x55);
+// list memory: a bump arena refilled in ARENA_CHUNK pieces, with the os heap for
+// anything over ARENA_SMALL_MAX. arena memory is never handed out twice, so it stays
+// zeroed like HEAP_ZERO_MEMORY. size in rax, pointer back in rax, clobbers rcx/rdx
+// on the fast path and what HeapAlloc clobbers on the slow one
+static void emit_alloc(CodeGen *cg) {
+    int l_slow = new_label(cg);
+    int l_done = new_label(cg);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x3D);
+    emit32(&cg->code, ARENA_SMALL_MAX);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x87);
+    emit_rel32_label(cg, l_slow);
+    emit_mov_rcx_from_rbp(cg, (int32_t)cg->arena_ptr_offset);
+    // lea rdx, [rcx+rax]
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x8D);
+    emit8(&cg->code, 0x14);
+    emit8(&cg->code, 0x01);
+    // cmp rdx, [arena_end]
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x3B);
+    emit8(&cg->code, 0x95);
+    emit32(&cg->code, (uint32_t)cg->arena_end_offset);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x87);
+    emit_rel32_label(cg, l_slow);
+    emit_mov_rbp_from_reg(cg, (int32_t)cg->arena_ptr_offset, REG_RDX);
+    emit_mov_rax_from_rcx(cg);
+    emit8(&cg->code, 0xE9);
+    emit_rel32_label(cg, l_done);
+    place_label(cg, l_slow);
+    emit_call_label(cg, cg->alloc_label);
+    place_label(cg, l_done);
+}
+
+// slow path of emit_alloc: big requests go to the heap, small ones start a fresh arena chunk
+static void emit_alloc_routine(CodeGen *cg) {
+    int l_big = new_label(cg);
+    int l_out = new_label(cg);
+    place_label(cg, cg->alloc_label);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xEC);
+    emit8(&cg->code, 0x28);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x3D);
+    emit32(&cg->code, ARENA_SMALL_MAX);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x87);
+    emit_rel32_label(cg, l_big);
+    // the 5th-arg slot is free, HeapAlloc only takes three
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x89);
-    emit8(&cg->code, 0xE5);
+    emit8(&cg->code, 0x44);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x20);
+    emit_mov_rax_imm64(cg, ARENA_CHUNK);
+    emit_heap_alloc(cg, 8);
     emit8(&cg->code, 0x48);
-    emit8(&cg->code, 0x81);
+    emit8(&cg->code, 0x8B);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x20);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x8D);
+    emit8(&cg->code, 0x14);
+    emit8(&cg->code, 0x08);
+    emit_mov_rbp_from_reg(cg, (int32_t)cg->arena_ptr_offset, REG_RDX);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x8D);
+    emit8(&cg->code, 0x90);
+    emit32(&cg->code, ARENA_CHUNK);
+    emit_mov_rbp_from_reg(cg, (int32_t)cg->arena_end_offset, REG_RDX);
+    emit8(&cg->code, 0xE9);
+    emit_rel32_label(cg, l_out);
+    place_label(cg, l_big);
+    emit_heap_alloc(cg, 8);
+    place_label(cg, l_out);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xC4);
+    emit8(&cg->code, 0x28);
+    emit8(&cg->code, 0xC3);
+}
+
+// list header in rdx, minimum capacity in rax. new cap is max(2*cap, rax, 4),
+// elements get copied over and the old block is just left behind. keeps rdx
+static void emit_grow_routine(CodeGen *cg) {
+    place_label(cg, cg->grow_label);
+    emit8(&cg->code, 0x56);
+    emit8(&cg->code, 0x57);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
     emit8(&cg->code, 0xEC);
-    emit32(&cg->code, (uint32_t)cg->frame_size);
-    emit_lea_rbx_rbp(cg, (int32_t)cg->vstack_base_offset);
+    emit8(&cg->code, 0x38);
+    // mov [rsp+0x28], rdx
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0x54);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x28);
+    emit_mov_rcx_from_rdx_disp8(cg, 0x08);
+    // add rcx, rcx / cmp rcx, rax / cmovl rcx, rax
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x01);
+    emit8(&cg->code, 0xC9);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x39);
+    emit8(&cg->code, 0xC1);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0xC8);
+    emit_mov_rax_imm64(cg, 4);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x39);
+    emit8(&cg->code, 0xC1);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0xC8);
+    // mov [rsp+0x30], rcx
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x30);
+    emit_mov_rax_from_rcx(cg);
+    emit_shl_rax_3(cg);
+    emit_alloc(cg);
+    // mov rdx, [rsp+0x28]
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x8B);
+    emit8(&cg->code, 0x54);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x28);
+    // rdi = new data, rsi = old data, rcx = len, rep movsq
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0xC7);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x8B);
+    emit8(&cg->code, 0x72);
+    emit8(&cg->code, 0x10);
+    emit_mov_rcx_from_rdx_disp8(cg, 0x00);
+    emit8(&cg->code, 0xF3);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0xA5);
+    emit_mov_mem_rdx_from_rax(cg, 0x10);
+    // mov rcx, [rsp+0x30]
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x8B);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x30);
+    emit_mov_rax_from_rcx(cg);
+    emit_mov_mem_rdx_from_rax(cg, 0x08);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xC4);
+    emit8(&cg->code, 0x38);
+    emit8(&cg->code, 0x5F);
+    emit8(&cg->code, 0x5E);
+    emit8(&cg->code, 0xC3);
+}
+
+// a stand-in for the variable until sym_pack has given out the slots, distinct
+// per variable so the peephole can still tell them apart
+static int32_t var_disp(CodeGen *cg, int idx) {
+    return (int32_t)(cg->locals_offset - idx * 8);
+}
 
-    emit_mov_rcx_imm32(cg, 65001);
-    emit_call_iat(cg, cg->iat_setconcp_rva);
+// op reg, [rbx+disp]. the state of a lambda call sits on the vstack under rbx
+static void emit_rbx_op(CodeGen *cg, uint8_t op, int reg, int32_t disp) {
+    emit_rex_w(cg, reg, REG_RBX);
+    emit8(&cg->code, op);
+    if (disp >= -128) {
+        emit8(&cg->code, (uint8_t)(0x43 | ((reg & 7) << 3)));
+        emit8(&cg->code, (uint8_t)disp);
+    } else {
+        emit8(&cg->code, (uint8_t)(0x83 | ((reg & 7) << 3)));
+        emit32(&cg->code, (uint32_t)disp);
+    }
+}
 
-    emit_call_iat(cg, cg->iat_getprocheap_rva);
-    emit_mov_rbp_from_rax(cg, (int32_t)cg->heap_offset);
 
-    emit_mov_rcx_imm32(cg, 0xFFFFFFF5);
-    emit_call_iat(cg, cg->iat_getstd_rva);
-    emit_mov_rbp_from_rax(cg, (int32_t)cg->stdout_offset);
+// where vstack slot n (counted from the bottom) is right now
+static int32_t vslot_disp(CodeGen *cg, int n) {
+    return -8 * (cg->vdepth - n);
 }
 
-void gen_epilog(CodeGen *cg) {
-    emit_mov_rcx_imm32(cg, 0);
-    emit_call_iat(cg, cg->iat_exit_rva);
+
+// a lambda parameter, a slot is -1 - n
+static void emit_load_param(CodeGen *cg, Reg dst, int at) {
+    if (at >= 0) emit_mov_reg_reg(cg, dst, (Reg)at);
+    else emit_rbx_op(cg, 0x8B, dst, vslot_disp(cg, -1 - at));
 }
 
-static void gen_expr(CodeGen *cg, Expr *e);
 
+static void emit_store_param(CodeGen *cg, int at, Reg src) {
+    if (at >= 0) emit_mov_reg_reg(cg, (Reg)at, src);
+    else emit_rbx_op(cg, 0x89, src, vslot_disp(cg, -1 - at));
+}
 
-static void gen_expr(CodeGen *cg, Expr *e) {
-    switch (e->kind) {
-        case EX_NUM:
-            emit_mov_rax_imm64(cg, (uint64_t)e->v.num);
-            return;
-        case EX_BOOL:
-            emit_mov_rax_imm64(cg, (uint64_t)(e->v.boolv ? 1 : 0));
-            return;
-        case EX_VAR: {
-            if (cg->lambda_param_name && strcmp(e->v.var, cg->lambda_param_name) == 0) {
-                emit_mov_rax_from_rbp(cg, (int32_t)cg->lambda_param_offset);
-                return;
-            }
-            int idx = sym_find(&cg->sym, e->v.var);
-            if (idx < 0) die("unknown variable");
-            int32_t disp = (int32_t)(-16 - idx * 8);
-            emit_mov_rax_from_rbp(cg, disp);
-            return;
-        }
-        case EX_STR:
-            die("string in expression");
-            return;
-        case EX_UNARY:
-            gen_expr(cg, e->v.un.expr);
+
+static void emit_load_var(CodeGen *cg, Reg dst, const char *name) {
+    int k = param_find(&cg->params, name);
+    if (k >= 0) {
+        emit_load_param(cg, dst, cg->params.at[k]);
+        return;
+    }
+    int idx = sym_find(&cg->sym, name);
+    if (idx < 0) die("unknown variable");
+    Reg r = cg->sym.items[idx].reg;
+    if (r != REG_NONE) emit_mov_reg_reg(cg, dst, r);
+    else if (emit_mov_reg_from_rbp(cg, dst, var_disp(cg, idx))) fix_var(cg, idx);
+}
+
+static void emit_store_var(CodeGen *cg, const char *name) {
+    int idx = sym_find(&cg->sym, name);
+    Reg r = cg->sym.items[idx].reg;
+    if (r != REG_NONE) emit_mov_reg_reg(cg, r, REG_RAX);
+    else if (emit_mov_rbp_from_rax(cg, var_disp(cg, idx))) fix_var(cg, idx);
+}
+
+static void emit_out_routines(CodeGen *cg);
+static void emit_print_int_routine(CodeGen *cg);
+
+// frame, top down from rbp: the fixed temps, the variable slots, the repeat
+// counters, then the vstack (or the -O spill slots, which the variables in
+// memory share) growing up from its base. only the temps never move, the
+// plain build generates everything else against stand-ins patched afterwards
+void layout_frame(CodeGen *cg, size_t nlocals, int nloops, int nvstack) {
+    cg->stdout_offset = -24;
+    cg->bytes_written_offset = cg->stdout_offset - 8;
+    cg->intbuf_offset = cg->bytes_written_offset - 32;
+    cg->heap_offset = cg->intbuf_offset - 8;
+    cg->temp_offset = cg->heap_offset - 8;
+    cg->temp2_offset = cg->temp_offset - 8;
+    cg->outbuf_offset = cg->temp2_offset - 8;
+    cg->outpos_offset = cg->outbuf_offset - 8;
+    cg->arena_ptr_offset = cg->outpos_offset - 8;
+    cg->arena_end_offset = cg->arena_ptr_offset - 8;
+    cg->locals_offset = cg->arena_end_offset - 8;
+    cg->loop_slots_offset = cg->locals_offset - (int64_t)nlocals * 8;
+    cg->loop_slots = nloops;
+    cg->vstack_base_offset = cg->loop_slots_offset - (int64_t)nloops * 8 - (int64_t)nvstack * 8 + 8;
+    // the outgoing area needs shadow space + 5th arg
+    cg->frame_size = align_up((size_t)(-cg->vstack_base_offset) + 40, 16);
+}
+
+void gen_prolog(CodeGen *cg) {
+    emit8(&cg->code, 0x55);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0xE5);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x81);
+    emit8(&cg->code, 0xEC);
+    emit32(&cg->code, (uint32_t)cg->frame_size);
+    fix_last32(cg, FIX_FRAME, 0);
+    if (!cg->opt) {
+        emit_lea_rbx_rbp(cg, (int32_t)cg->vstack_base_offset);
+        fix_last32(cg, FIX_VSTACK, 0);
+    }
+    cg->flush_label = new_label(cg);
+    cg->append_label = new_label(cg);
+    cg->alloc_label = new_label(cg);
+    cg->grow_label = new_label(cg);
+    cg->print_int_label = new_label(cg);
+
+    // nothing to look up on linux, stdout is fd 1 and memory comes from mmap
+    if (cg->target != TARGET_LINUX) {
+        emit_mov_rcx_imm32(cg, 65001);
+        emit_call_iat(cg, cg->iat_setconcp_rva);
+
+        emit_call_iat(cg, cg->iat_getprocheap_rva);
+        emit_mov_rbp_from_rax(cg, (int32_t)cg->heap_offset);
+
+        emit_mov_rcx_imm32(cg, 0xFFFFFFF5);
+        emit_call_iat(cg, cg->iat_getstd_rva);
+        emit_mov_rbp_from_rax(cg, (int32_t)cg->stdout_offset);
+    }
+
+    emit_mov_rax_imm64(cg, OUTBUF_SIZE);
+    emit_heap_alloc(cg, 0);
+    emit_mov_rbp_from_rax(cg, (int32_t)cg->outbuf_offset);
+    emit_mov_rax_imm64(cg, 0);
+    emit_mov_rbp_from_rax(cg, (int32_t)cg->outpos_offset);
+    // empty arena, the first list allocation takes the slow path and fills it
+    emit_mov_rbp_from_rax(cg, (int32_t)cg->arena_ptr_offset);
+    emit_mov_rbp_from_rax(cg, (int32_t)cg->arena_end_offset);
+
+    // a variable declared in a block that never ran reads as 0, the way its
+    // untouched stack slot does without -O, so its register starts out 0 too
+    if (cg->opt) {
+        uint32_t done = 0;
+        for (size_t i = 0; i < cg->sym.count; i++) {
+            Reg r = cg->sym.items[i].reg;
+            if (r == REG_NONE || ((done >> r) & 1)) continue;
+            done |= 1u << r;
+            emit_mov_reg_imm32(cg, r, 0);
+        }
+    }
+}
+
+void gen_epilog(CodeGen *cg) {
+    emit_call_label(cg, cg->flush_label);
+    if (cg->target == TARGET_LINUX) {
+        // exit_group(0)
+        emit8(&cg->code, 0x31);
+        emit8(&cg->code, 0xFF);
+        emit_syscall(cg, 231);
+    } else {
+        emit_mov_rcx_imm32(cg, 0);
+        emit_call_iat(cg, cg->iat_exit_rva);
+    }
+    // nothing returns past the exit, so the runtime routines live here
+    emit_out_routines(cg);
+    emit_print_int_routine(cg);
+    emit_alloc_routine(cg);
+    emit_grow_routine(cg);
+}
+
+// list builtins, shared by the ast and ir paths.
+// one-arg ones take it in rax, everything returns in rax
+
+// ok list header is [len, cap, data], dont ask
+static void emit_list_new(CodeGen *cg) {
+    int32_t cap_disp = (int32_t)cg->temp_offset;
+    int l_zero = new_label(cg);
+    int l_done = new_label(cg);
+    emit_mov_rbp_from_rax(cg, cap_disp);
+    emit_mov_rax_imm64(cg, 24);
+    emit_alloc(cg);
+    emit_mov_rdx_from_rax(cg);
+    emit_mov_r12_from_rax(cg);
+    emit_mov_rax_imm64(cg, 0);
+    emit_mov_mem_rdx_from_rax(cg, 0x00);
+    emit_mov_rax_from_rbp(cg, cap_disp);
+    emit_mov_mem_rdx_from_rax(cg, 0x08);
+    emit_mov_rax_from_rbp(cg, cap_disp);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x85);
+    emit8(&cg->code, 0xC0);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x84);
+    emit_rel32_label(cg, l_zero);
+    emit_mov_rax_from_rbp(cg, cap_disp);
+    emit_shl_rax_3(cg);
+    emit_alloc(cg);
+    emit_mov_r8_from_rax(cg);
+    emit_mov_rdx_from_r12(cg);
+    emit_mov_rax_from_r8(cg);
+    emit_mov_mem_rdx_from_rax(cg, 0x10);
+    emit8(&cg->code, 0xE9);
+    emit_rel32_label(cg, l_done);
+    place_label(cg, l_zero);
+    emit_mov_rax_imm64(cg, 0);
+    emit_mov_mem_rdx_from_rax(cg, 0x10);
+    place_label(cg, l_done);
+    emit_mov_rax_from_r12(cg);
+}
+
+static void emit_array_new(CodeGen *cg) {
+    int32_t len_disp = (int32_t)cg->temp_offset;
+    int l_zero = new_label(cg);
+    int l_done = new_label(cg);
+    emit_mov_rbp_from_rax(cg, len_disp);
+    emit_mov_rax_imm64(cg, 24);
+    emit_alloc(cg);
+    emit_mov_rdx_from_rax(cg);
+    emit_mov_r12_from_rax(cg);
+    emit_mov_rax_from_rbp(cg, len_disp);
+    emit_mov_mem_rdx_from_rax(cg, 0x00);
+    emit_mov_rax_from_rbp(cg, len_disp);
+    emit_mov_mem_rdx_from_rax(cg, 0x08);
+    emit_mov_rax_from_rbp(cg, len_disp);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x85);
+    emit8(&cg->code, 0xC0);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x84);
+    emit_rel32_label(cg, l_zero);
+    emit_mov_rax_from_rbp(cg, len_disp);
+    emit_shl_rax_3(cg);
+    emit_alloc(cg);
+    emit_mov_r8_from_rax(cg);
+    emit_mov_rdx_from_r12(cg);
+    emit_mov_rax_from_r8(cg);
+    emit_mov_mem_rdx_from_rax(cg, 0x10);
+    emit8(&cg->code, 0xE9);
+    emit_rel32_label(cg, l_done);
+    place_label(cg, l_zero);
+    emit_mov_rax_imm64(cg, 0);
+    emit_mov_mem_rdx_from_rax(cg, 0x10);
+    place_label(cg, l_done);
+    emit_mov_rax_from_r12(cg);
+}
+
+static void emit_list_len(CodeGen *cg) {
+    emit_mov_rcx_from_rax(cg);
+    emit_mov_rax_from_rcx_disp8(cg, 0x00);
+}
+
+// list in rcx, index in rax
+static void emit_list_addr(CodeGen *cg) {
+    emit_mov_rdx_from_rcx_disp8(cg, 0x10);
+    emit_shl_rax_3(cg);
+    emit_add_rax_rdx(cg);
+}
+
+
+static void emit_list_get(CodeGen *cg) {
+    emit_list_addr(cg);
+    emit_mov_rax_from_mem_rax(cg);
+}
+
+// list and index in the two temp slots, value in rax
+static void emit_list_set(CodeGen *cg) {
+    emit_mov_r8_from_rax(cg);
+    emit_mov_rax_from_rbp(cg, (int32_t)cg->temp_offset);
+    emit_mov_rdx_from_rax(cg);
+    emit_mov_rax_from_rbp(cg, (int32_t)cg->temp2_offset);
+    emit_mov_rcx_from_rax(cg);
+    emit_mov_rax_from_rcx(cg);
+    emit_shl_rax_3(cg);
+    emit_mov_r9_from_rdx_disp8(cg, 0x10);
+    emit_add_rax_r9(cg);
+    emit_mov_mem_rax_from_r8(cg);
+    emit_mov_rax_from_r8(cg);
+}
+
+// list and value in the two temp slots
+static void emit_list_push(CodeGen *cg) {
+    int l_fits = new_label(cg);
+    emit_mov_rax_from_rbp(cg, (int32_t)cg->temp_offset);
+    emit_mov_rdx_from_rax(cg);
+    emit_mov_rcx_from_rdx_disp8(cg, 0x00);
+    emit_mov_r8_from_rdx_disp8(cg, 0x08);
+    emit_mov_rax_from_rcx(cg);
+    emit_cmp_r8_rax(cg);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x87);
+    emit_rel32_label(cg, l_fits);
+    // full, grow to at least len+1 and reload len
+    emit_add_rax_imm8(cg, 1);
+    emit_call_label(cg, cg->grow_label);
+    emit_mov_rcx_from_rdx_disp8(cg, 0x00);
+    place_label(cg, l_fits);
+    emit_mov_r9_from_rdx_disp8(cg, 0x10);
+    emit_mov_rax_from_rbp(cg, (int32_t)cg->temp2_offset);
+    emit_mov_r8_from_rax(cg);
+    emit_mov_rax_from_rcx(cg);
+    emit_shl_rax_3(cg);
+    emit_add_rax_r9(cg);
+    emit_mov_mem_rax_from_r8(cg);
+    emit_mov_rax_from_rcx(cg);
+    emit_add_rax_imm8(cg, 1);
+    emit_mov_mem_rdx_from_rax(cg, 0x00);
+    emit_mov_rax_from_rdx(cg);
+}
+
+// list in temp, wanted capacity in temp2
+static void emit_list_reserve(CodeGen *cg) {
+    int l_done = new_label(cg);
+    emit_mov_reg_from_rbp(cg, REG_RDX, (int32_t)cg->temp_offset);
+    emit_mov_rax_from_rbp(cg, (int32_t)cg->temp2_offset);
+    // cmp rax, [rdx+8]
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x3B);
+    emit8(&cg->code, 0x42);
+    emit8(&cg->code, 0x08);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x8E);
+    emit_rel32_label(cg, l_done);
+    emit_call_label(cg, cg->grow_label);
+    place_label(cg, l_done);
+    emit_mov_rax_from_rdx(cg);
+}
+
+static void emit_list_pop(CodeGen *cg) {
+    int l_empty = new_label(cg);
+    int l_done = new_label(cg);
+    emit_mov_rcx_from_rax(cg);
+    emit_mov_rdx_from_rax(cg);
+    emit_mov_rax_from_rcx_disp8(cg, 0x00);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x85);
+    emit8(&cg->code, 0xC0);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x84);
+    emit_rel32_label(cg, l_empty);
+    emit_dec_rax(cg);
+    emit_mov_mem_rdx_from_rax(cg, 0x00);
+    emit_mov_r9_from_rdx_disp8(cg, 0x10);
+    emit_shl_rax_3(cg);
+    emit_add_rax_r9(cg);
+    emit_mov_rax_from_mem_rax(cg);
+    emit8(&cg->code, 0xE9);
+    emit_rel32_label(cg, l_done);
+    place_label(cg, l_empty);
+    emit_mov_rax_imm64(cg, 0);
+    place_label(cg, l_done);
+}
+
+static void emit_test_rax(CodeGen *cg) {
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x85);
+    emit8(&cg->code, 0xC0);
+}
+
+
+static uint8_t cond_code(OpKind op) {
+    switch (op) {
+        case OP_EQ: return 0x4;
+        case OP_NE: return 0x5;
+        case OP_LT: return 0xC;
+        case OP_GE: return 0xD;
+        case OP_LE: return 0xE;
+        default: return 0xF;
+    }
+}
+
+
+static void emit_jcc_label(CodeGen *cg, uint8_t cc, int label_id) {
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, (uint8_t)(0x80 | cc));
+    emit_rel32_label(cg, label_id);
+}
+
+
+static void emit_jmp_label(CodeGen *cg, int label_id) {
+    emit8(&cg->code, 0xE9);
+    emit_rel32_label(cg, label_id);
+}
+
+
+/* ---- sse2 loops over list data ---- */
+// sse2 is in every x86-64 cpu, so no dispatch is needed in the generated program.
+// all of them take the element count in rcx, do two elements per round on xmm0-xmm3
+// and finish an odd count with one scalar element. r9 and r10 are scratch
+
+// prefix 0f op, xmm x in reg and xmm y (or [y] when mem) in rm
+static void emit_sse(CodeGen *cg, uint8_t prefix, uint8_t op, int x, int y, int mem) {
+    emit8(&cg->code, prefix);
+    if (y & 8) emit8(&cg->code, 0x41);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, op);
+    emit8(&cg->code, (uint8_t)((mem ? 0x00 : 0xC0) | ((x & 7) << 3) | (y & 7)));
+}
+
+
+// movq xmm, r64 (0x6E) or movq r64, xmm (0x7E)
+static void emit_movq(CodeGen *cg, uint8_t op, int x, Reg r) {
+    emit8(&cg->code, 0x66);
+    emit_rex_w(cg, 0, r);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, op);
+    emit8(&cg->code, (uint8_t)(0xC0 | ((x & 7) << 3) | (r & 7)));
+}
+
+
+// psrlq (2) / psllq (6) xmm, imm8
+static void emit_sse_shift(CodeGen *cg, int ext, int x, uint8_t n) {
+    emit8(&cg->code, 0x66);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x73);
+    emit8(&cg->code, (uint8_t)(0xC0 | (ext << 3) | (x & 7)));
+    emit8(&cg->code, n);
+}
+
+
+static void emit_add_reg_imm8(CodeGen *cg, Reg r, uint8_t v) {
+    emit_rex_w(cg, 0, r);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, (uint8_t)(0xC0 | (r & 7)));
+    emit8(&cg->code, v);
+}
+
+
+// r9 = rcx / 2 rounds, straight to l_tail when there are none
+static void emit_vec_head(CodeGen *cg, int l_loop, int l_tail) {
+    emit_mov_reg_reg(cg, REG_R9, REG_RCX);
+    emit8(&cg->code, 0x49);
+    emit8(&cg->code, 0xD1);
+    emit8(&cg->code, 0xE9);
+    emit_jcc_label(cg, 0x4, l_tail);
+    place_label(cg, l_loop);
+}
+
+
+static void emit_vec_next(CodeGen *cg, int l_loop, int l_tail) {
+    emit8(&cg->code, 0x49);
+    emit8(&cg->code, 0xFF);
+    emit8(&cg->code, 0xC9);
+    emit_jcc_label(cg, 0x5, l_loop);
+    place_label(cg, l_tail);
+}
+
+
+// jumps to l_done unless the count in rcx is odd
+static void emit_vec_odd(CodeGen *cg, int l_done) {
+    emit8(&cg->code, 0xF6);
+    emit8(&cg->code, 0xC1);
+    emit8(&cg->code, 0x01);
+    emit_jcc_label(cg, 0x4, l_done);
+}
+
+
+// [rdx..] = r8
+static void emit_vec_fill(CodeGen *cg) {
+    int l_loop = new_label(cg);
+    int l_tail = new_label(cg);
+    int l_done = new_label(cg);
+    emit_movq(cg, 0x6E, 0, REG_R8);
+    emit_sse(cg, 0x66, 0x6C, 0, 0, 0);
+    emit_vec_head(cg, l_loop, l_tail);
+    emit_sse(cg, 0xF3, 0x7F, 0, REG_RDX, 1);
+    emit_add_reg_imm8(cg, REG_RDX, 16);
+    emit_vec_next(cg, l_loop, l_tail);
+    emit_vec_odd(cg, l_done);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0x02);
+    place_label(cg, l_done);
+}
+
+
+// [rdx..] = r8, r8 + 1, ...
+static void emit_vec_iota(CodeGen *cg) {
+    int l_loop = new_label(cg);
+    int l_tail = new_label(cg);
+    int l_done = new_label(cg);
+    emit_movq(cg, 0x6E, 0, REG_R8);
+    emit_mov_reg_reg(cg, REG_R10, REG_R8);
+    emit_add_reg_imm8(cg, REG_R10, 1);
+    emit_movq(cg, 0x6E, 1, REG_R10);
+    emit_sse(cg, 0x66, 0x6C, 0, 1, 0);
+    emit_mov_reg_imm32(cg, REG_R10, 2);
+    emit_movq(cg, 0x6E, 1, REG_R10);
+    emit_sse(cg, 0x66, 0x6C, 1, 1, 0);
+    emit_vec_head(cg, l_loop, l_tail);
+    emit_sse(cg, 0xF3, 0x7F, 0, REG_RDX, 1);
+    emit_sse(cg, 0x66, 0xD4, 0, 1, 0);
+    emit_add_reg_imm8(cg, REG_RDX, 16);
+    emit_vec_next(cg, l_loop, l_tail);
+    emit_vec_odd(cg, l_done);
+    emit_movq(cg, 0x7E, 0, REG_R10);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0x12);
+    place_label(cg, l_done);
+}
+
+
+// [rdx..] = [rax..] op [r8..]. sse2 has no 64-bit multiply, the low half of the
+// product is lo*lo + ((hi*lo + lo*hi) << 32) out of three pmuludq
+static void emit_vec_map(CodeGen *cg, OpKind op) {
+    int l_loop = new_label(cg);
+    int l_tail = new_label(cg);
+    int l_done = new_label(cg);
+    emit_vec_head(cg, l_loop, l_tail);
+    emit_sse(cg, 0xF3, 0x6F, 0, REG_RAX, 1);
+    emit_sse(cg, 0xF3, 0x6F, 1, REG_R8, 1);
+    if (op == OP_MUL) {
+        emit_sse(cg, 0x66, 0x6F, 2, 0, 0);
+        emit_sse_shift(cg, 2, 2, 32);
+        emit_sse(cg, 0x66, 0xF4, 2, 1, 0);
+        emit_sse(cg, 0x66, 0x6F, 3, 1, 0);
+        emit_sse_shift(cg, 2, 3, 32);
+        emit_sse(cg, 0x66, 0xF4, 3, 0, 0);
+        emit_sse(cg, 0x66, 0xD4, 2, 3, 0);
+        emit_sse_shift(cg, 6, 2, 32);
+        emit_sse(cg, 0x66, 0xF4, 0, 1, 0);
+        emit_sse(cg, 0x66, 0xD4, 0, 2, 0);
+    } else {
+        emit_sse(cg, 0x66, op == OP_ADD ? 0xD4 : 0xFB, 0, 1, 0);
+    }
+    emit_sse(cg, 0xF3, 0x7F, 0, REG_RDX, 1);
+    emit_add_reg_imm8(cg, REG_RAX, 16);
+    emit_add_reg_imm8(cg, REG_R8, 16);
+    emit_add_reg_imm8(cg, REG_RDX, 16);
+    emit_vec_next(cg, l_loop, l_tail);
+    emit_vec_odd(cg, l_done);
+    // mov r10, [rax]; op r10, [r8]; mov [rdx], r10
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x8B);
+    emit8(&cg->code, 0x10);
+    emit8(&cg->code, 0x4D);
+    if (op == OP_MUL) {
+        emit8(&cg->code, 0x0F);
+        emit8(&cg->code, 0xAF);
+    } else {
+        emit8(&cg->code, op == OP_ADD ? 0x03 : 0x2B);
+    }
+    emit8(&cg->code, 0x10);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0x12);
+    place_label(cg, l_done);
+}
+
+
+// rax = sum of [rdx..]
+static void emit_vec_sum(CodeGen *cg) {
+    int l_loop = new_label(cg);
+    int l_tail = new_label(cg);
+    int l_done = new_label(cg);
+    emit_sse(cg, 0x66, 0xEF, 0, 0, 0);
+    emit_vec_head(cg, l_loop, l_tail);
+    emit_sse(cg, 0xF3, 0x6F, 1, REG_RDX, 1);
+    emit_sse(cg, 0x66, 0xD4, 0, 1, 0);
+    emit_add_reg_imm8(cg, REG_RDX, 16);
+    emit_vec_next(cg, l_loop, l_tail);
+    // pshufd xmm1, xmm0, 0x4e swaps the halves
+    emit_sse(cg, 0x66, 0x70, 1, 0, 0);
+    emit8(&cg->code, 0x4E);
+    emit_sse(cg, 0x66, 0xD4, 0, 1, 0);
+    emit_movq(cg, 0x7E, 0, REG_RAX);
+    emit_vec_odd(cg, l_done);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x03);
+    emit8(&cg->code, 0x02);
+    place_label(cg, l_done);
+}
+
+static void emit_range(CodeGen *cg) {
+    int32_t len_disp = (int32_t)cg->temp_offset;
+    int32_t list_disp = (int32_t)cg->temp2_offset;
+    int l_zero = new_label(cg);
+    int l_done = new_label(cg);
+    emit_mov_rbp_from_rax(cg, len_disp);
+    emit_mov_rax_imm64(cg, 24);
+    emit_alloc(cg);
+    emit_mov_rbp_from_rax(cg, list_disp);
+    emit_mov_rdx_from_rax(cg);
+    emit_mov_r12_from_rax(cg);
+    emit_mov_rax_from_rbp(cg, len_disp);
+    emit_mov_mem_rdx_from_rax(cg, 0x00);
+    emit_mov_rax_from_rbp(cg, len_disp);
+    emit_mov_mem_rdx_from_rax(cg, 0x08);
+    emit_mov_rax_from_rbp(cg, len_disp);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x85);
+    emit8(&cg->code, 0xC0);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x84);
+    emit_rel32_label(cg, l_zero);
+    emit_mov_rax_from_rbp(cg, len_disp);
+    emit_shl_rax_3(cg);
+    emit_alloc(cg);
+    emit_mov_r8_from_rax(cg);
+    emit_mov_rdx_from_r12(cg);
+    emit_mov_rax_from_r8(cg);
+    emit_mov_mem_rdx_from_rax(cg, 0x10);
+    emit_mov_rdx_from_rax(cg);
+    emit_mov_reg_from_rbp(cg, REG_RCX, len_disp);
+    emit_mov_reg_imm32(cg, REG_R8, 0);
+    emit_vec_iota(cg);
+    emit8(&cg->code, 0xE9);
+    emit_rel32_label(cg, l_done);
+    place_label(cg, l_zero);
+    emit_mov_rax_imm64(cg, 0);
+    emit_mov_mem_rdx_from_rax(cg, 0x10);
+    place_label(cg, l_done);
+    emit_mov_rax_from_rbp(cg, list_disp);
+}
+
+
+static void gen_expr(CodeGen *cg, Expr *e);
+
+
+// evaluates a then b, leaving a in rcx and b in rax
+static void gen_pair(CodeGen *cg, Expr *a, Expr *b) {
+    gen_expr(cg, a);
+    emit_push_rax(cg);
+    gen_expr(cg, b);
+    emit_pop_rcx(cg);
+}
+
+
+static int expr_calls(Expr *e) {
+    if (!e) return 0;
+    switch (e->kind) {
+        case EX_UNARY:
+            return expr_calls(e->v.un.expr);
+        case EX_BIN:
+            return expr_calls(e->v.bin.left) || expr_calls(e->v.bin.right);
+        case EX_CALL:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// args of set/push/reserve go to temp/temp2 with the last one left in rax.
+// a call in a later arg can make a list and reuse those slots itself, so then
+// the earlier ones wait on the vstack instead
+static void gen_temp_args(CodeGen *cg, Expr **args, size_t argc) {
+    int deep = 0;
+    for (size_t i = 1; i < argc; i++) deep |= expr_calls(args[i]);
+    if (!deep) {
+        int32_t slot[2] = {(int32_t)cg->temp_offset, (int32_t)cg->temp2_offset};
+        for (size_t i = 0; i < argc; i++) {
+            gen_expr(cg, args[i]);
+            if (i < 2) emit_mov_rbp_from_rax(cg, slot[i]);
+        }
+        return;
+    }
+    for (size_t i = 0; i + 1 < argc; i++) {
+        gen_expr(cg, args[i]);
+        emit_push_rax(cg);
+    }
+    gen_expr(cg, args[argc - 1]);
+    if (argc == 2) emit_mov_rbp_from_rax(cg, (int32_t)cg->temp2_offset);
+    if (argc == 3) {
+        emit_pop_rcx(cg);
+        emit_mov_rbp_from_reg(cg, (int32_t)cg->temp2_offset, REG_RCX);
+    }
+    emit_pop_rcx(cg);
+    emit_mov_rbp_from_reg(cg, (int32_t)cg->temp_offset, REG_RCX);
+}
+
+
+static int is_compare(OpKind op) {
+    return op == OP_EQ || op == OP_NE || op == OP_LT || op == OP_GT || op == OP_LE || op == OP_GE;
+}
+
+
+// jumps to label when e comes out true (when = 1) or false (when = 0), falls
+// through otherwise. comparisons are cmp + jcc, && / || / не are chains of
+// those, nothing is turned into 0/1 on the way
+static void gen_branch(CodeGen *cg, Expr *e, int label, int when) {
+    if (e->kind == EX_BOOL) {
+        if ((e->v.boolv != 0) == when) emit_jmp_label(cg, label);
+        return;
+    }
+    if (e->kind == EX_UNARY && e->v.un.op == OP_NOT) {
+        gen_branch(cg, e->v.un.expr, label, !when);
+        return;
+    }
+    if (e->kind == EX_BIN && (e->v.bin.op == OP_AND || e->v.bin.op == OP_OR)) {
+        // false decides an && on its own, true an ||
+        int decides = e->v.bin.op == OP_OR;
+        if (decides == when) {
+            gen_branch(cg, e->v.bin.left, label, when);
+            gen_branch(cg, e->v.bin.right, label, when);
+            return;
+        }
+        int l_skip = new_label(cg);
+        gen_branch(cg, e->v.bin.left, l_skip, !when);
+        gen_branch(cg, e->v.bin.right, label, when);
+        place_label(cg, l_skip);
+        return;
+    }
+    if (e->kind == EX_BIN && is_compare(e->v.bin.op)) {
+        Expr *r = e->v.bin.right;
+        if (r->kind == EX_NUM && r->v.num >= INT32_MIN && r->v.num <= INT32_MAX) {
+            // cmp rax, imm8 / imm32
+            gen_expr(cg, e->v.bin.left);
+            emit8(&cg->code, 0x48);
+            if (r->v.num >= -128 && r->v.num <= 127) {
+                emit8(&cg->code, 0x83);
+                emit8(&cg->code, 0xF8);
+                emit8(&cg->code, (uint8_t)r->v.num);
+            } else {
+                emit8(&cg->code, 0x3D);
+                emit32(&cg->code, (uint32_t)r->v.num);
+            }
+        } else {
+            gen_pair(cg, e->v.bin.left, r);
+            emit8(&cg->code, 0x48);
+            emit8(&cg->code, 0x39);
+            emit8(&cg->code, 0xC1);
+        }
+        uint8_t cc = cond_code(e->v.bin.op);
+        emit_jcc_label(cg, when ? cc : (uint8_t)(cc ^ 1), label);
+        return;
+    }
+    gen_expr(cg, e);
+    emit_test_rax(cg);
+    emit_jcc_label(cg, when ? 0x5 : 0x4, label);
+}
+
+
+// saved registers, the runtime routines and the linux syscall stubs keep all of them
+static const Reg lambda_regs[] = {REG_R13, REG_R14, REG_R15, REG_RSI, REG_RDI};
+
+// op reg, [base+index*8]. base is never rbp/r13
+static void emit_index_op(CodeGen *cg, uint8_t op, Reg reg, Reg base, Reg index) {
+    emit8(&cg->code, (uint8_t)(0x48 | ((reg & 8) ? 0x04 : 0) | ((index & 8) ? 0x02 : 0) | ((base & 8) ? 0x01 : 0)));
+    emit8(&cg->code, op);
+    emit8(&cg->code, (uint8_t)(0x04 | ((reg & 7) << 3)));
+    emit8(&cg->code, (uint8_t)(0xC0 | ((index & 7) << 3) | (base & 7)));
+}
+
+
+// a parameter or an index: the next free saved register, a vstack slot once
+// they run out (nesting that deep is rare)
+static int lambda_take(CodeGen *cg, const char *name) {
+    Params *ps = &cg->params;
+    int used = 0;
+    for (int k = 0; k < ps->count; k++) used += ps->at[k] >= 0;
+    int at;
+    if (used < (int)(sizeof(lambda_regs) / sizeof(lambda_regs[0]))) {
+        at = lambda_regs[used];
+    } else {
+        emit_push_rax(cg);
+        at = -1 - (cg->vdepth - 1);
+    }
+    ps->name[ps->count] = name;
+    ps->at[ps->count++] = at;
+    return at;
+}
+
+
+// map / filter / reduce / for-each: one loop with the lambda body inlined.
+// the list, its length and the result sit on the vstack, the parameters and the
+// index in saved registers, so calls in the body dont touch them.
+// the length is read once up front and the data pointer every round, a body
+// that pushes onto the same list only moves it
+static void gen_lambda_loop(CodeGen *cg, Expr *e, Builtin fn) {
+    Expr *lam = e->v.call.args[e->v.call.argc - 1];
+    Params outer = cg->params;
+    int base = cg->vdepth;
+    int acc = 0;
+    gen_expr(cg, e->v.call.args[0]);
+    emit_push_rax(cg);
+    int src = cg->vdepth - 1;
+    if (fn == BI_REDUCE) {
+        gen_expr(cg, e->v.call.args[1]);
+        acc = lambda_take(cg, lam->v.lambda.params[0]);
+        if (acc >= 0) emit_mov_reg_reg(cg, (Reg)acc, REG_RAX);
+    }
+    emit_rbx_op(cg, 0x8B, REG_RAX, vslot_disp(cg, src));
+    emit_mov_rax_from_mem_rax(cg);
+    emit_push_rax(cg);
+    int len = cg->vdepth - 1;
+    int out = src;
+    if (fn == BI_MAP) emit_array_new(cg);
+    if (fn == BI_FILTER) emit_list_new(cg);
+    if (fn == BI_MAP || fn == BI_FILTER) {
+        emit_push_rax(cg);
+        out = cg->vdepth - 1;
+    }
+    int x = lambda_take(cg, lam->v.lambda.params[lam->v.lambda.nparams - 1]);
+    int i = lambda_take(cg, 0);
+    // a spilled index is read into rax, a spilled x goes through rcx
+    Reg ri = i >= 0 ? (Reg)i : REG_RAX;
+    Reg rx = x >= 0 ? (Reg)x : REG_RCX;
+
+    int l_top = new_label(cg);
+    int l_test = new_label(cg);
+    emit_mov_reg_imm32(cg, ri, 0);
+    if (i < 0) emit_store_param(cg, i, ri);
+    emit_jmp_label(cg, l_test);
+    place_label(cg, l_top);
+    if (i < 0) emit_load_param(cg, ri, i);
+    emit_rbx_op(cg, 0x8B, REG_RCX, vslot_disp(cg, src));
+    emit_mov_rdx_from_rcx_disp8(cg, 0x10);
+    emit_index_op(cg, 0x8B, rx, REG_RDX, ri);
+    if (x < 0) emit_store_param(cg, x, rx);
+    if (fn == BI_FILTER) {
+        // out has room for all of them, so a kept one goes straight in
+        int l_skip = new_label(cg);
+        gen_branch(cg, lam->v.lambda.body, l_skip, 0);
+        if (x < 0) emit_load_param(cg, REG_R8, x);
+        emit_rbx_op(cg, 0x8B, REG_RCX, vslot_disp(cg, out));
+        emit_mov_rax_from_rcx_disp8(cg, 0x00);
+        emit_mov_rdx_from_rcx_disp8(cg, 0x10);
+        emit_index_op(cg, 0x89, x >= 0 ? (Reg)x : REG_R8, REG_RDX, REG_RAX);
+        emit8(&cg->code, 0x48);
+        emit8(&cg->code, 0xFF);
+        emit8(&cg->code, 0x01);
+        place_label(cg, l_skip);
+    } else {
+        gen_expr(cg, lam->v.lambda.body);
+        if (fn == BI_MAP) {
+            if (i < 0) emit_load_param(cg, REG_R8, i);
+            emit_rbx_op(cg, 0x8B, REG_RCX, vslot_disp(cg, out));
+            emit_mov_rdx_from_rcx_disp8(cg, 0x10);
+            emit_index_op(cg, 0x89, REG_RAX, REG_RDX, i >= 0 ? (Reg)i : REG_R8);
+        } else if (fn == BI_REDUCE) {
+            emit_store_param(cg, acc, REG_RAX);
+        }
+    }
+    if (i >= 0) {
+        emit_add_reg_imm8(cg, ri, 1);
+    } else {
+        emit_rbx_op(cg, 0x83, 0, vslot_disp(cg, -1 - i));
+        emit8(&cg->code, 1);
+    }
+    place_label(cg, l_test);
+    if (i < 0) emit_load_param(cg, ri, i);
+    emit_rbx_op(cg, 0x3B, ri, vslot_disp(cg, len));
+    emit_jcc_label(cg, 0xC, l_top);
+
+    if (fn == BI_REDUCE) emit_load_param(cg, REG_RAX, acc);
+    else emit_rbx_op(cg, 0x8B, REG_RAX, vslot_disp(cg, out));
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xEB);
+    emit8(&cg->code, (uint8_t)(8 * (cg->vdepth - base)));
+    cg->vdepth = base;
+    cg->params = outer;
+}
+
+
+static void gen_expr(CodeGen *cg, Expr *e) {
+    switch (e->kind) {
+        case EX_NUM:
+            emit_mov_rax_imm64(cg, (uint64_t)e->v.num);
+            return;
+        case EX_BOOL:
+            emit_mov_rax_imm64(cg, (uint64_t)(e->v.boolv ? 1 : 0));
+            return;
+        case EX_VAR:
+            emit_load_var(cg, REG_RAX, e->v.var);
+            return;
+        case EX_STR:
+            die("string in expression");
+            return;
+        case EX_UNARY:
+            gen_expr(cg, e->v.un.expr);
             if (e->v.un.op == OP_NEG) {
                 emit8(&cg->code, 0x48);
                 emit8(&cg->code, 0xF7);
@@ -602,280 +1869,78 @@ static void gen_expr(CodeGen *cg, Expr *e) {
             die("lambda in expression");
             return;
         case EX_CALL: {
-            const char *name = e->v.call.name;
             size_t argc = e->v.call.argc;
             Expr **args = e->v.call.args;
-            if (strcmp(name, "создать.лист.цифр") == 0) {
-                int32_t cap_disp = (int32_t)cg->temp_offset;
-                int l_zero = new_label(cg);
-                int l_done = new_label(cg);
-                // ok list header is [len, cap, data], dont ask
-                if (argc == 0) {
-                    emit_mov_rax_imm64(cg, 8);
-                } else {
+            switch (builtin_find(e->v.call.name)) {
+                case BI_LIST_NEW:
+                    if (argc == 0) {
+                        emit_mov_rax_imm64(cg, 8);
+                    } else {
+                        gen_expr(cg, args[0]);
+                    }
+                    emit_list_new(cg);
+                    return;
+                case BI_ARRAY_NEW:
                     gen_expr(cg, args[0]);
-                }
-                emit_mov_rbp_from_rax(cg, cap_disp);
-                emit_mov_rax_imm64(cg, 24);
-                emit_heap_alloc(cg, 8);
-                emit_mov_rdx_from_rax(cg);
-                emit_mov_r12_from_rax(cg);
-                emit_mov_rax_imm64(cg, 0);
-                emit_mov_mem_rdx_from_rax(cg, 0x00);
-                emit_mov_rax_from_rbp(cg, cap_disp);
-                emit_mov_mem_rdx_from_rax(cg, 0x08);
-                emit_mov_rax_from_rbp(cg, cap_disp);
-                emit8(&cg->code, 0x48);
-                emit8(&cg->code, 0x85);
-                emit8(&cg->code, 0xC0);
-                emit8(&cg->code, 0x0F);
-                emit8(&cg->code, 0x84);
-                emit_rel32_label(cg, l_zero);
-                emit_mov_rax_from_rbp(cg, cap_disp);
-                emit_shl_rax_3(cg);
-                emit_heap_alloc(cg, 8);
-                emit_mov_r8_from_rax(cg);
-                emit_mov_rdx_from_r12(cg);
-                emit_mov_rax_from_r8(cg);
-                emit_mov_mem_rdx_from_rax(cg, 0x10);
-                emit8(&cg->code, 0xE9);
-                emit_rel32_label(cg, l_done);
-                place_label(cg, l_zero);
-                emit_mov_rax_imm64(cg, 0);
-                emit_mov_mem_rdx_from_rax(cg, 0x10);
-                place_label(cg, l_done);
-                emit_mov_rax_from_r12(cg);
-                return;
-            }
-            if (strcmp(name, "создать.массив.цифр") == 0) {
-                int32_t len_disp = (int32_t)cg->temp_offset;
-                int l_zero = new_label(cg);
-                int l_done = new_label(cg);
-                gen_expr(cg, args[0]);
-                emit_mov_rbp_from_rax(cg, len_disp);
-                emit_mov_rax_imm64(cg, 24);
-                emit_heap_alloc(cg, 8);
-                emit_mov_rdx_from_rax(cg);
-                emit_mov_r12_from_rax(cg);
-                emit_mov_rax_from_rbp(cg, len_disp);
-                emit_mov_mem_rdx_from_rax(cg, 0x00);
-                emit_mov_rax_from_rbp(cg, len_disp);
-                emit_mov_mem_rdx_from_rax(cg, 0x08);
-                emit_mov_rax_from_rbp(cg, len_disp);
-                emit8(&cg->code, 0x48);
-                emit8(&cg->code, 0x85);
-                emit8(&cg->code, 0xC0);
-                emit8(&cg->code, 0x0F);
-                emit8(&cg->code, 0x84);
-                emit_rel32_label(cg, l_zero);
-                emit_mov_rax_from_rbp(cg, len_disp);
-                emit_shl_rax_3(cg);
-                emit_heap_alloc(cg, 8);
-                emit_mov_r8_from_rax(cg);
-                emit_mov_rdx_from_r12(cg);
-                emit_mov_rax_from_r8(cg);
-                emit_mov_mem_rdx_from_rax(cg, 0x10);
-                emit8(&cg->code, 0xE9);
-                emit_rel32_label(cg, l_done);
-                place_label(cg, l_zero);
-                emit_mov_rax_imm64(cg, 0);
-                emit_mov_mem_rdx_from_rax(cg, 0x10);
-                place_label(cg, l_done);
-                emit_mov_rax_from_r12(cg);
-                return;
-            }
-            if (strcmp(name, "сколько.внутри") == 0) {
-                gen_expr(cg, args[0]);
-                emit_mov_rcx_from_rax(cg);
-                emit_mov_rax_from_rcx_disp8(cg, 0x00);
-                return;
-            }
-            if (strcmp(name, "дай.по.индексу") == 0) {
-                gen_expr(cg, args[0]);
-                emit_mov_rcx_from_rax(cg);
-                gen_expr(cg, args[1]);
-                emit_mov_rdx_from_rcx_disp8(cg, 0x10);
-                emit_shl_rax_3(cg);
-                emit_add_rax_rdx(cg);
-                emit_mov_rax_from_mem_rax(cg);
-                return;
-            }
-            if (strcmp(name, "сунь.по.индексу") == 0) {
-                int32_t list_disp = (int32_t)cg->temp_offset;
-                int32_t idx_disp = (int32_t)cg->temp2_offset;
-                gen_expr(cg, args[0]);
-                emit_mov_rbp_from_rax(cg, list_disp);
-                gen_expr(cg, args[1]);
-                emit_mov_rbp_from_rax(cg, idx_disp);
-                gen_expr(cg, args[2]);
-                emit_mov_r8_from_rax(cg);
-                emit_mov_rax_from_rbp(cg, list_disp);
-                emit_mov_rdx_from_rax(cg);
-                emit_mov_rax_from_rbp(cg, idx_disp);
-                emit_mov_rcx_from_rax(cg);
-                emit_mov_rax_from_rcx(cg);
-                emit_shl_rax_3(cg);
-                emit_mov_r9_from_rdx_disp8(cg, 0x10);
-                emit_add_rax_r9(cg);
-                emit_mov_mem_rax_from_r8(cg);
-                emit_mov_rax_from_r8(cg);
-                return;
-            }
-            if (strcmp(name, "впихни.в.лист") == 0) {
-                int32_t list_disp = (int32_t)cg->temp_offset;
-                int32_t val_disp = (int32_t)cg->temp2_offset;
-                int l_done = new_label(cg);
-                gen_expr(cg, args[0]);
-                emit_mov_rbp_from_rax(cg, list_disp);
-                gen_expr(cg, args[1]);
-                emit_mov_rbp_from_rax(cg, val_disp);
-                emit_mov_rax_from_rbp(cg, list_disp);
-                emit_mov_rdx_from_rax(cg);
-                emit_mov_rcx_from_rdx_disp8(cg, 0x00);
-                emit_mov_r8_from_rdx_disp8(cg, 0x08);
-                emit_mov_rax_from_rcx(cg);
-                emit_cmp_r8_rax(cg);
-                emit_jbe_label(cg, l_done);
-                emit_mov_r9_from_rdx_disp8(cg, 0x10);
-                emit_mov_rax_from_rbp(cg, val_disp);
-                emit_mov_r8_from_rax(cg);
-                emit_mov_rax_from_rcx(cg);
-                emit_shl_rax_3(cg);
-                emit_add_rax_r9(cg);
-                emit_mov_mem_rax_from_r8(cg);
-                emit_mov_rax_from_rcx(cg);
-                emit_add_rax_imm8(cg, 1);
-                emit_mov_mem_rdx_from_rax(cg, 0x00);
-                place_label(cg, l_done);
-                emit_mov_rax_from_rdx(cg);
-                return;
-            }
-            if (strcmp(name, "достань.последний") == 0) {
-                int l_empty = new_label(cg);
-                int l_done = new_label(cg);
-                gen_expr(cg, args[0]);
-                emit_mov_rcx_from_rax(cg);
-                emit_mov_rdx_from_rax(cg);
-                emit_mov_rax_from_rcx_disp8(cg, 0x00);
-                emit8(&cg->code, 0x48);
-                emit8(&cg->code, 0x85);
-                emit8(&cg->code, 0xC0);
-                emit8(&cg->code, 0x0F);
-                emit8(&cg->code, 0x84);
-                emit_rel32_label(cg, l_empty);
-                emit_dec_rax(cg);
-                emit_mov_mem_rdx_from_rax(cg, 0x00);
-                emit_mov_r9_from_rdx_disp8(cg, 0x10);
-                emit_shl_rax_3(cg);
-                emit_add_rax_r9(cg);
-                emit_mov_rax_from_mem_rax(cg);
-                emit8(&cg->code, 0xE9);
-                emit_rel32_label(cg, l_done);
-                place_label(cg, l_empty);
-                emit_mov_rax_imm64(cg, 0);
-                place_label(cg, l_done);
-                return;
+                    emit_array_new(cg);
+                    return;
+                case BI_LEN:
+                    gen_expr(cg, args[0]);
+                    emit_list_len(cg);
+                    return;
+                case BI_GET:
+                    gen_pair(cg, args[0], args[1]);
+                    emit_list_get(cg);
+                    return;
+                case BI_SET:
+                    gen_temp_args(cg, args, 3);
+                    emit_list_set(cg);
+                    return;
+                case BI_PUSH:
+                    gen_temp_args(cg, args, 2);
+                    emit_list_push(cg);
+                    return;
+                case BI_RESERVE:
+                    gen_temp_args(cg, args, 2);
+                    emit_list_reserve(cg);
+                    return;
+                case BI_POP:
+                    gen_expr(cg, args[0]);
+                    emit_list_pop(cg);
+                    return;
+                case BI_RANGE:
+                    gen_expr(cg, args[0]);
+                    emit_range(cg);
+                    return;
+                case BI_MAP:
+                case BI_FILTER:
+                case BI_REDUCE:
+                case BI_EACH:
+                    gen_lambda_loop(cg, e, builtin_find(e->v.call.name));
+                    return;
+                default:
+                    die("unknown call");
+                    return;
             }
-            if (strcmp(name, "диапазон.от.0.до") == 0) {
-                int32_t len_disp = (int32_t)cg->temp_offset;
-                int32_t list_disp = (int32_t)cg->temp2_offset;
-                int l_zero = new_label(cg);
-                int l_loop = new_label(cg);
-                int l_loop_done = new_label(cg);
+        }
+        case EX_BIN:
+            if (e->v.bin.op == OP_AND || e->v.bin.op == OP_OR) {
+                int l_false = new_label(cg);
                 int l_done = new_label(cg);
-                // boring loop, just fills 0..n-1
-                gen_expr(cg, args[0]);
-                emit_mov_rbp_from_rax(cg, len_disp);
-                emit_mov_rax_imm64(cg, 24);
-                emit_heap_alloc(cg, 8);
-                emit_mov_rbp_from_rax(cg, list_disp);
-                emit_mov_rdx_from_rax(cg);
-                emit_mov_r12_from_rax(cg);
-                emit_mov_rax_from_rbp(cg, len_disp);
-                emit_mov_mem_rdx_from_rax(cg, 0x00);
-                emit_mov_rax_from_rbp(cg, len_disp);
-                emit_mov_mem_rdx_from_rax(cg, 0x08);
-                emit_mov_rax_from_rbp(cg, len_disp);
-                emit8(&cg->code, 0x48);
-                emit8(&cg->code, 0x85);
-                emit8(&cg->code, 0xC0);
-                emit8(&cg->code, 0x0F);
-                emit8(&cg->code, 0x84);
-                emit_rel32_label(cg, l_zero);
-                emit_mov_rax_from_rbp(cg, len_disp);
-                emit_shl_rax_3(cg);
-                emit_heap_alloc(cg, 8);
-                emit_mov_r8_from_rax(cg);
-                emit_mov_rdx_from_r12(cg);
-                emit_mov_rax_from_r8(cg);
-                emit_mov_mem_rdx_from_rax(cg, 0x10);
-                emit_mov_rdx_from_rax(cg);
+                gen_branch(cg, e, l_false, 0);
+                emit_mov_rax_imm64(cg, 1);
+                emit_jmp_label(cg, l_done);
+                place_label(cg, l_false);
                 emit_mov_rax_imm64(cg, 0);
-                place_label(cg, l_loop);
-                emit_mov_r9_from_rbp(cg, len_disp);
-                emit_cmp_r9_rax(cg);
-                emit_jbe_label(cg, l_loop_done);
-                emit_lea_r8_rdx_rax(cg);
-                emit_mov_mem_r8_from_rax(cg);
-                emit_add_rax_imm8(cg, 1);
-                emit8(&cg->code, 0xE9);
-                emit_rel32_label(cg, l_loop);
-                place_label(cg, l_loop_done);
-                emit8(&cg->code, 0xE9);
-                emit_rel32_label(cg, l_done);
-                place_label(cg, l_zero);
-                emit_mov_rax_imm64(cg, 0);
-                emit_mov_mem_rdx_from_rax(cg, 0x10);
                 place_label(cg, l_done);
-                emit_mov_rax_from_rbp(cg, list_disp);
                 return;
             }
-            die("unknown call");
-            return;
-        }
-        case EX_BIN:
-            if (e->v.bin.op == OP_AND || e->v.bin.op == OP_OR) {
-                int l_end = new_label(cg);
-                int l_done = new_label(cg);
+            if (e->v.bin.op == OP_SHL || e->v.bin.op == OP_DIV_POW2 || e->v.bin.op == OP_DIV_CONST) {
                 gen_expr(cg, e->v.bin.left);
-                emit8(&cg->code, 0x48);
-                emit8(&cg->code, 0x85);
-                emit8(&cg->code, 0xC0);
-                if (e->v.bin.op == OP_AND) {
-                    emit8(&cg->code, 0x0F);
-                    emit8(&cg->code, 0x84);
-                    emit_rel32_label(cg, l_end);
-                } else {
-                    emit8(&cg->code, 0x0F);
-                    emit8(&cg->code, 0x85);
-                    emit_rel32_label(cg, l_end);
-                }
-                gen_expr(cg, e->v.bin.right);
-                emit8(&cg->code, 0x48);
-                emit8(&cg->code, 0x85);
-                emit8(&cg->code, 0xC0);
-                emit8(&cg->code, 0x0F);
-                emit8(&cg->code, 0x95);
-                emit8(&cg->code, 0xC0);
-                emit8(&cg->code, 0x48);
-                emit8(&cg->code, 0x0F);
-                emit8(&cg->code, 0xB6);
-                emit8(&cg->code, 0xC0);
-                emit8(&cg->code, 0xE9);
-                emit_rel32_label(cg, l_done);
-                place_label(cg, l_end);
-                if (e->v.bin.op == OP_AND) {
-                    emit_mov_rax_imm64(cg, 0);
-                } else {
-                    emit_mov_rax_imm64(cg, 1);
-                }
-                place_label(cg, l_done);
+                emit_const_op_rax(cg, e->v.bin.op, e->v.bin.right->v.num);
                 return;
             }
-            gen_expr(cg, e->v.bin.left);
-            emit_push_rax(cg);
-            gen_expr(cg, e->v.bin.right);
-            emit_pop_rcx(cg);
+            gen_pair(cg, e->v.bin.left, e->v.bin.right);
             if (e->v.bin.op == OP_ADD) {
                 emit8(&cg->code, 0x48);
                 emit8(&cg->code, 0x01);
@@ -908,8 +1973,7 @@ static void gen_expr(CodeGen *cg, Expr *e) {
                 emit8(&cg->code, 0xF9);
                 return;
             }
-            if (e->v.bin.op == OP_EQ || e->v.bin.op == OP_NE || e->v.bin.op == OP_LT ||
-                e->v.bin.op == OP_GT || e->v.bin.op == OP_LE || e->v.bin.op == OP_GE) {
+            if (is_compare(e->v.bin.op)) {
                 emit8(&cg->code, 0x48);
                 emit8(&cg->code, 0x39);
                 emit8(&cg->code, 0xC1);
@@ -931,14 +1995,18 @@ static void gen_expr(CodeGen *cg, Expr *e) {
 }
 
 
-static void emit_print_newline(CodeGen *cg) {
-    emit8(&cg->code, 0xC6);
-    emit8(&cg->code, 0x85);
-    emit32(&cg->code, (uint32_t)cg->intbuf_offset);
-    emit8(&cg->code, 0x0A);
+// writes r8 bytes at rdx to stdout
+static void emit_write_stdout(CodeGen *cg) {
+    if (cg->target == TARGET_LINUX) {
+        emit_push_rdi_rsi(cg);
+        emit_mov_reg_imm32(cg, REG_RDI, 1);
+        emit_mov_reg_reg(cg, REG_RSI, REG_RDX);
+        emit_mov_reg_reg(cg, REG_RDX, REG_R8);
+        emit_syscall(cg, 1);
+        emit_pop_rsi_rdi(cg);
+        return;
+    }
     emit_mov_rcx_from_rbp(cg, (int32_t)cg->stdout_offset);
-    emit_lea_rdx_rbp(cg, (int32_t)cg->intbuf_offset);
-    emit_mov_r8d_imm32(cg, 1);
     emit_lea_r9_rbp(cg, (int32_t)cg->bytes_written_offset);
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0xC7);
@@ -949,145 +2017,301 @@ static void emit_print_newline(CodeGen *cg) {
     emit_call_iat(cg, cg->iat_write_rva);
 }
 
-static void emit_print_str(CodeGen *cg, StringLit *s) {
-    emit_mov_rcx_from_rbp(cg, (int32_t)cg->stdout_offset);
-    emit_lea_rdx_rip(cg, s->rva);
-    emit_mov_r8d_imm32(cg, (uint32_t)s->len);
-    emit_lea_r9_rbp(cg, (int32_t)cg->bytes_written_offset);
+// output goes through a heap buffer of OUTBUF_SIZE bytes from the prolog.
+// the routines below are emitted once after the epilog and called from prints:
+//   flush:  writes out [outbuf, outbuf+outpos) and resets outpos
+//   append: copies r8 bytes at rdx into the buffer, flushing first if they dont fit
+//           (anything bigger than the whole buffer is written straight through)
+// both clobber what WriteFile does, rsi/rdi are kept
+static void emit_out_routines(CodeGen *cg) {
+    int l_copy = new_label(cg);
+    int l_done = new_label(cg);
+    int l_skip = new_label(cg);
+
+    place_label(cg, cg->flush_label);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xEC);
+    emit8(&cg->code, 0x28);
+    emit_mov_r8_from_rbp(cg, (int32_t)cg->outpos_offset);
+    emit8(&cg->code, 0x4D);
+    emit8(&cg->code, 0x85);
+    emit8(&cg->code, 0xC0);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0x84);
+    emit_rel32_label(cg, l_skip);
+    emit_mov_reg_from_rbp(cg, REG_RDX, (int32_t)cg->outbuf_offset);
+    emit_write_stdout(cg);
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0xC7);
-    emit8(&cg->code, 0x44);
-    emit8(&cg->code, 0x24);
-    emit8(&cg->code, 0x20);
+    emit8(&cg->code, 0x85);
+    emit32(&cg->code, (uint32_t)cg->outpos_offset);
     emit32(&cg->code, 0);
-    emit_call_iat(cg, cg->iat_write_rva);
-}
-
-
-static void emit_print_int(CodeGen *cg) {
-    int l_nonzero = new_label(cg);
-    int l_pos = new_label(cg);
-    int l_loop = new_label(cg);
-    int l_after = new_label(cg);
-    int l_done = new_label(cg);
+    place_label(cg, l_skip);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xC4);
+    emit8(&cg->code, 0x28);
+    emit8(&cg->code, 0xC3);
 
+    place_label(cg, cg->append_label);
+    emit8(&cg->code, 0x56);
+    emit8(&cg->code, 0x57);
+    // keeps win64 calls aligned, leaves shadow space + 5th arg and two spare slots
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xEC);
+    emit8(&cg->code, 0x38);
+    emit_mov_rax_from_rbp(cg, (int32_t)cg->outpos_offset);
+    emit8(&cg->code, 0x4A);
+    emit8(&cg->code, 0x8D);
+    emit8(&cg->code, 0x0C);
+    emit8(&cg->code, 0x00);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x81);
+    emit8(&cg->code, 0xF9);
+    emit32(&cg->code, OUTBUF_SIZE);
+    emit_jbe_label(cg, l_copy);
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x89);
-    emit8(&cg->code, 0xC1);
-    emit_lea_rdx_rbp(cg, (int32_t)(cg->intbuf_offset + 32));
+    emit8(&cg->code, 0x54);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x28);
     emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0x44);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x30);
+    emit_call_label(cg, cg->flush_label);
+    emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x8B);
-    emit8(&cg->code, 0xD2);
+    emit8(&cg->code, 0x54);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x28);
     emit8(&cg->code, 0x4C);
     emit8(&cg->code, 0x8B);
-    emit8(&cg->code, 0xDA);
-    emit8(&cg->code, 0x48);
-    emit8(&cg->code, 0x85);
-    emit8(&cg->code, 0xC9);
-    emit8(&cg->code, 0x0F);
-    emit8(&cg->code, 0x85);
-    emit_rel32_label(cg, l_nonzero);
+    emit8(&cg->code, 0x44);
+    emit8(&cg->code, 0x24);
+    emit8(&cg->code, 0x30);
+    emit8(&cg->code, 0x31);
+    emit8(&cg->code, 0xC0);
     emit8(&cg->code, 0x49);
-    emit8(&cg->code, 0x83);
-    emit8(&cg->code, 0xEB);
+    emit8(&cg->code, 0x81);
+    emit8(&cg->code, 0xF8);
+    emit32(&cg->code, OUTBUF_SIZE);
+    emit_jbe_label(cg, l_copy);
+    emit_write_stdout(cg);
+    emit8(&cg->code, 0xE9);
+    emit_rel32_label(cg, l_done);
+
+    place_label(cg, l_copy);
+    emit_mov_reg_from_rbp(cg, REG_RDI, (int32_t)cg->outbuf_offset);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x01);
+    emit8(&cg->code, 0xC7);
+    emit_mov_reg_reg(cg, REG_RSI, REG_RDX);
+    emit_mov_rcx_from_r8(cg);
+    emit8(&cg->code, 0xF3);
+    emit8(&cg->code, 0xA4);
+    emit8(&cg->code, 0x4C);
     emit8(&cg->code, 0x01);
+    emit8(&cg->code, 0xC0);
+    emit_mov_rbp_from_rax(cg, (int32_t)cg->outpos_offset);
+
+    place_label(cg, l_done);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xC4);
+    emit8(&cg->code, 0x38);
+    emit8(&cg->code, 0x5F);
+    emit8(&cg->code, 0x5E);
+    emit8(&cg->code, 0xC3);
+}
+
+// end of one print statement: --line-buffered pushes it out right away
+static void emit_print_end(CodeGen *cg) {
+    if (cg->line_buffered) emit_call_label(cg, cg->flush_label);
+}
+
+static void emit_print_newline(CodeGen *cg) {
+    emit8(&cg->code, 0xC6);
+    emit8(&cg->code, 0x85);
+    emit32(&cg->code, (uint32_t)cg->intbuf_offset);
+    emit8(&cg->code, 0x0A);
+    emit_lea_rdx_rbp(cg, (int32_t)cg->intbuf_offset);
+    emit_mov_r8d_imm32(cg, 1);
+    emit_call_label(cg, cg->append_label);
+}
+
+static void emit_print_str(CodeGen *cg, StringLit *s) {
+    emit_lea_rdx_str(cg, s);
+    emit_mov_r8d_imm32(cg, (uint32_t)s->len);
+    emit_call_label(cg, cg->append_label);
+}
+
+
+// prints rax and the newline with a single append
+static void emit_print_int(CodeGen *cg) {
+    emit_call_label(cg, cg->print_int_label);
+}
+
+// the body of every number print, emitted once after the epilog. digits are
+// built backwards from the newline at the end of intbuf, two at a time: n / 100
+// is a multiply by the reciprocal and n % 100 indexes a "00".."99" table that
+// sits right after the code. the magnitude is handled unsigned so INT64_MIN
+// needs no special case. ends by jumping into append, which returns for us
+static void emit_print_int_routine(CodeGen *cg) {
+    int l_pos = new_label(cg);
+    int l_loop = new_label(cg);
+    int l_small = new_label(cg);
+    int l_one = new_label(cg);
+    int l_sign = new_label(cg);
+    int l_out = new_label(cg);
+    int l_table = new_label(cg);
+
+    place_label(cg, cg->print_int_label);
+    // lea r11, [rbp + intbuf + 31]; mov byte [r11], 10
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x8D);
+    emit8(&cg->code, 0x9D);
+    emit32(&cg->code, (uint32_t)(cg->intbuf_offset + 31));
     emit8(&cg->code, 0x41);
     emit8(&cg->code, 0xC6);
     emit8(&cg->code, 0x03);
-    emit8(&cg->code, '0');
-    emit8(&cg->code, 0xE9);
-    emit_rel32_label(cg, l_done);
-
-    place_label(cg, l_nonzero);
-    emit8(&cg->code, 0x45);
-    emit8(&cg->code, 0x31);
-    emit8(&cg->code, 0xC0);
+    emit8(&cg->code, 0x0A);
+    // r8 keeps the sign, rcx = |rax|
+    emit_mov_reg_reg(cg, REG_R8, REG_RAX);
+    emit_mov_reg_reg(cg, REG_RCX, REG_RAX);
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x85);
     emit8(&cg->code, 0xC9);
-    emit8(&cg->code, 0x0F);
-    emit8(&cg->code, 0x8D);
-    emit_rel32_label(cg, l_pos);
+    emit_jcc_label(cg, 0x9, l_pos);
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0xF7);
     emit8(&cg->code, 0xD9);
-    emit8(&cg->code, 0x41);
-    emit8(&cg->code, 0xB8);
-    emit32(&cg->code, 1);
-
     place_label(cg, l_pos);
-    place_label(cg, l_loop);
+    // r9 = ceil(2^66 / 100), r10 = the table
+    emit8(&cg->code, 0x49);
+    emit8(&cg->code, 0xB9);
+    emit64(&cg->code, 0x28F5C28F5C28F5C3ULL);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x8D);
+    emit8(&cg->code, 0x15);
+    emit_rel32_label(cg, l_table);
     emit8(&cg->code, 0x48);
     emit8(&cg->code, 0x83);
     emit8(&cg->code, 0xF9);
-    emit8(&cg->code, 0x00);
-    emit8(&cg->code, 0x0F);
-    emit8(&cg->code, 0x84);
-    emit_rel32_label(cg, l_after);
-    emit8(&cg->code, 0x48);
-    emit8(&cg->code, 0x89);
-    emit8(&cg->code, 0xC8);
+    emit8(&cg->code, 100);
+    emit_jcc_label(cg, 0x2, l_small);
+
+    place_label(cg, l_loop);
+    // rdx = (rcx >> 2) * r9 >> 66 = rcx / 100
+    emit_mov_reg_reg(cg, REG_RAX, REG_RCX);
     emit8(&cg->code, 0x48);
-    emit8(&cg->code, 0x31);
-    emit8(&cg->code, 0xD2);
-    emit_mov_r9_imm32(cg, 10);
+    emit8(&cg->code, 0xC1);
+    emit8(&cg->code, 0xE8);
+    emit8(&cg->code, 0x02);
     emit8(&cg->code, 0x49);
     emit8(&cg->code, 0xF7);
-    emit8(&cg->code, 0xF1);
+    emit8(&cg->code, 0xE1);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0xC1);
+    emit8(&cg->code, 0xEA);
+    emit8(&cg->code, 0x02);
+    // rax = rcx - rdx * 100
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x6B);
+    emit8(&cg->code, 0xC2);
+    emit8(&cg->code, 100);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0xF7);
+    emit8(&cg->code, 0xD8);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x01);
+    emit8(&cg->code, 0xC8);
+    // movzx eax, word [r10 + rax*2]; sub r11, 2; mov [r11], ax
+    emit8(&cg->code, 0x41);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0xB7);
+    emit8(&cg->code, 0x04);
+    emit8(&cg->code, 0x42);
     emit8(&cg->code, 0x49);
     emit8(&cg->code, 0x83);
     emit8(&cg->code, 0xEB);
-    emit8(&cg->code, 0x01);
-    emit8(&cg->code, 0x80);
-    emit8(&cg->code, 0xC2);
-    emit8(&cg->code, '0');
+    emit8(&cg->code, 0x02);
+    emit8(&cg->code, 0x66);
     emit8(&cg->code, 0x41);
-    emit8(&cg->code, 0x88);
-    emit8(&cg->code, 0x13);
+    emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0x03);
+    emit_mov_reg_reg(cg, REG_RCX, REG_RDX);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xF9);
+    emit8(&cg->code, 100);
+    emit_jcc_label(cg, 0x3, l_loop);
+
+    // last one or two digits
+    place_label(cg, l_small);
     emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xF9);
+    emit8(&cg->code, 10);
+    emit_jcc_label(cg, 0x2, l_one);
+    emit8(&cg->code, 0x41);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0xB7);
+    emit8(&cg->code, 0x04);
+    emit8(&cg->code, 0x4A);
+    emit8(&cg->code, 0x49);
+    emit8(&cg->code, 0x83);
+    emit8(&cg->code, 0xEB);
+    emit8(&cg->code, 0x02);
+    emit8(&cg->code, 0x66);
+    emit8(&cg->code, 0x41);
     emit8(&cg->code, 0x89);
+    emit8(&cg->code, 0x03);
+    emit_jmp_label(cg, l_sign);
+    place_label(cg, l_one);
+    emit8(&cg->code, 0x80);
     emit8(&cg->code, 0xC1);
-    emit8(&cg->code, 0xE9);
-    emit_rel32_label(cg, l_loop);
+    emit8(&cg->code, '0');
+    emit8(&cg->code, 0x49);
+    emit8(&cg->code, 0xFF);
+    emit8(&cg->code, 0xCB);
+    emit8(&cg->code, 0x41);
+    emit8(&cg->code, 0x88);
+    emit8(&cg->code, 0x0B);
 
-    place_label(cg, l_after);
-    emit8(&cg->code, 0x45);
+    place_label(cg, l_sign);
+    emit8(&cg->code, 0x4D);
     emit8(&cg->code, 0x85);
     emit8(&cg->code, 0xC0);
-    emit8(&cg->code, 0x0F);
-    emit8(&cg->code, 0x84);
-    emit_rel32_label(cg, l_done);
+    emit_jcc_label(cg, 0x9, l_out);
     emit8(&cg->code, 0x49);
-    emit8(&cg->code, 0x83);
-    emit8(&cg->code, 0xEB);
-    emit8(&cg->code, 0x01);
+    emit8(&cg->code, 0xFF);
+    emit8(&cg->code, 0xCB);
     emit8(&cg->code, 0x41);
     emit8(&cg->code, 0xC6);
     emit8(&cg->code, 0x03);
     emit8(&cg->code, '-');
 
-    place_label(cg, l_done);
-    emit8(&cg->code, 0x4D);
-    emit8(&cg->code, 0x8B);
-    emit8(&cg->code, 0xC2);
+    // rdx = r11, r8 = intbuf + 32 - r11
+    place_label(cg, l_out);
+    emit_mov_reg_reg(cg, REG_RDX, REG_R11);
+    emit8(&cg->code, 0x4C);
+    emit8(&cg->code, 0x8D);
+    emit8(&cg->code, 0x85);
+    emit32(&cg->code, (uint32_t)(cg->intbuf_offset + 32));
     emit8(&cg->code, 0x4D);
     emit8(&cg->code, 0x29);
     emit8(&cg->code, 0xD8);
-    emit_mov_rcx_from_rbp(cg, (int32_t)cg->stdout_offset);
-    emit8(&cg->code, 0x4C);
-    emit8(&cg->code, 0x89);
-    emit8(&cg->code, 0xDA);
-    emit8(&cg->code, 0x4C);
-    emit8(&cg->code, 0x89);
-    emit8(&cg->code, 0xC0);
-    emit_lea_r9_rbp(cg, (int32_t)cg->bytes_written_offset);
-    emit8(&cg->code, 0x48);
-    emit8(&cg->code, 0xC7);
-    emit8(&cg->code, 0x44);
-    emit8(&cg->code, 0x24);
-    emit8(&cg->code, 0x20);
-    emit32(&cg->code, 0);
-    emit_call_iat(cg, cg->iat_write_rva);
+    emit_jmp_label(cg, cg->append_label);
+
+    place_label(cg, l_table);
+    for (int i = 0; i < 100; i++) {
+        emit8(&cg->code, (uint8_t)('0' + i / 10));
+        emit8(&cg->code, (uint8_t)('0' + i % 10));
+    }
 }
 
 
@@ -1102,38 +2326,30 @@ void gen_stmt(CodeGen *cg, Stmt *s, int *loop_depth) {
     if (s->kind == ST_PRINT) {
         if (s->v.print.expr->kind == EX_STR) {
             emit_print_str(cg, s->v.print.expr->v.str);
+            emit_print_newline(cg);
         } else {
             gen_expr(cg, s->v.print.expr);
             emit_print_int(cg);
         }
-        emit_print_newline(cg);
+        emit_print_end(cg);
         return;
     }
     if (s->kind == ST_LET) {
-        int idx = sym_find(&cg->sym, s->v.let.name);
         gen_expr(cg, s->v.let.expr);
-        emit_mov_rbp_from_rax(cg, (int32_t)(-16 - idx * 8));
+        emit_store_var(cg, s->v.let.name);
         return;
     }
     if (s->kind == ST_SET) {
-        int idx = sym_find(&cg->sym, s->v.set.name);
         gen_expr(cg, s->v.set.expr);
-        emit_mov_rbp_from_rax(cg, (int32_t)(-16 - idx * 8));
+        emit_store_var(cg, s->v.set.name);
         return;
     }
     if (s->kind == ST_IF) {
         int l_else = new_label(cg);
         int l_end = new_label(cg);
-        gen_expr(cg, s->v.ifs.cond);
-        emit8(&cg->code, 0x48);
-        emit8(&cg->code, 0x85);
-        emit8(&cg->code, 0xC0);
-        emit8(&cg->code, 0x0F);
-        emit8(&cg->code, 0x84);
-        emit_rel32_label(cg, l_else);
+        gen_branch(cg, s->v.ifs.cond, l_else, 0);
         gen_stmt(cg, s->v.ifs.thenb, loop_depth);
-        emit8(&cg->code, 0xE9);
-        emit_rel32_label(cg, l_end);
+        if (s->v.ifs.elseb) emit_jmp_label(cg, l_end);
         place_label(cg, l_else);
         gen_stmt(cg, s->v.ifs.elseb, loop_depth);
         place_label(cg, l_end);
@@ -1146,9 +2362,13 @@ void gen_stmt(CodeGen *cg, Stmt *s, int *loop_depth) {
         int l_start = new_label(cg);
         int l_end = new_label(cg);
         gen_expr(cg, s->v.repeat.count);
+        // disp is a placeholder until patch_fixups, keep the peephole off it
+        peep_fence(cg);
         emit_mov_rbp_from_rax(cg, disp);
+        fix_last32(cg, FIX_LOOP, slot);
         place_label(cg, l_start);
         emit_mov_rax_from_rbp(cg, disp);
+        fix_last32(cg, FIX_LOOP, slot);
         emit8(&cg->code, 0x48);
         emit8(&cg->code, 0x83);
         emit8(&cg->code, 0xF8);
@@ -1157,11 +2377,14 @@ void gen_stmt(CodeGen *cg, Stmt *s, int *loop_depth) {
         emit8(&cg->code, 0x8E);
         emit_rel32_label(cg, l_end);
         gen_stmt(cg, s->v.repeat.body, loop_depth);
+        peep_fence(cg);
         emit_mov_rax_from_rbp(cg, disp);
+        fix_last32(cg, FIX_LOOP, slot);
         emit8(&cg->code, 0x48);
         emit8(&cg->code, 0xFF);
         emit8(&cg->code, 0xC8);
         emit_mov_rbp_from_rax(cg, disp);
+        fix_last32(cg, FIX_LOOP, slot);
         emit8(&cg->code, 0xE9);
         emit_rel32_label(cg, l_start);
         place_label(cg, l_end);
@@ -1175,21 +2398,652 @@ void gen_stmt(CodeGen *cg, Stmt *s, int *loop_depth) {
 }
 
 
+/* ---- -O: lowering the ir ---- */
+
+typedef enum {
+    LOC_REG,
+    LOC_MEM,
+    LOC_IMM
+} LocKind;
+
+typedef struct {
+    LocKind kind;
+    Reg reg;
+    int32_t disp;
+    int64_t imm;
+} Loc;
+
+static Loc ir_loc(CodeGen *cg, IrFunc *f, IrVal v) {
+    Loc l = {LOC_IMM, REG_NONE, 0, 0};
+    if (v.kind == IRV_IMM) {
+        l.imm = v.v;
+        return l;
+    }
+    int n = (int)v.v;
+    if (f->vreg_reg[n] != REG_NONE) {
+        l.kind = LOC_REG;
+        l.reg = f->vreg_reg[n];
+    } else {
+        l.kind = LOC_MEM;
+        l.disp = temp_slot(cg, f->vreg_slot[n]);
+    }
+    return l;
+}
+
+
+static Loc vreg_loc(CodeGen *cg, IrFunc *f, int v) {
+    IrVal val = {IRV_VREG, v};
+    return ir_loc(cg, f, val);
+}
+
+
+static int fits_i8(int64_t v) {
+    return v >= -128 && v <= 127;
+}
+
+
+static int fits_i32(int64_t v) {
+    return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+// modrm for reg with a register or [rbp+disp] operand, short disp when it fits
+static void emit_modrm_loc(CodeGen *cg, int reg, Loc l) {
+    if (l.kind == LOC_REG) {
+        emit8(&cg->code, (uint8_t)(0xC0 | ((reg & 7) << 3) | (l.reg & 7)));
+    } else if (fits_i8(l.disp)) {
+        emit8(&cg->code, (uint8_t)(0x45 | ((reg & 7) << 3)));
+        emit8(&cg->code, (uint8_t)l.disp);
+    } else {
+        emit8(&cg->code, (uint8_t)(0x85 | ((reg & 7) << 3)));
+        emit32(&cg->code, (uint32_t)l.disp);
+    }
+}
+
+// op reg, r/m (or op r/m, reg for the store forms)
+static void emit_op_loc(CodeGen *cg, uint8_t op, int reg, Loc l) {
+    emit_rex_w(cg, reg, l.kind == LOC_REG ? l.reg : REG_RBP);
+    emit8(&cg->code, op);
+    emit_modrm_loc(cg, reg, l);
+}
+
+static void emit_op2_loc(CodeGen *cg, uint8_t op, int reg, Loc l) {
+    emit_rex_w(cg, reg, l.kind == LOC_REG ? l.reg : REG_RBP);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, op);
+    emit_modrm_loc(cg, reg, l);
+}
+
+
+// mov dst, [base]. rsp/r12 need a sib byte, rbp/r13 a zero disp8
+static void emit_load_mem(CodeGen *cg, Reg dst, Reg base) {
+    emit_rex_w(cg, dst, base);
+    emit8(&cg->code, 0x8B);
+    if ((base & 7) == 5) {
+        emit8(&cg->code, (uint8_t)(0x45 | ((dst & 7) << 3)));
+        emit8(&cg->code, 0);
+    } else {
+        emit8(&cg->code, (uint8_t)(((dst & 7) << 3) | (base & 7)));
+        if ((base & 7) == 4) emit8(&cg->code, 0x24);
+    }
+}
+
+
+static void emit_load_loc(CodeGen *cg, Reg dst, Loc l) {
+    if (l.kind == LOC_REG) {
+        if (l.reg != dst) emit_mov_reg_reg(cg, dst, l.reg);
+    } else if (l.kind == LOC_MEM) {
+        emit_op_loc(cg, 0x8B, dst, l);
+    } else if (fits_i32(l.imm)) {
+        emit_mov_reg_imm32(cg, dst, (int32_t)l.imm);
+    } else {
+        emit_rex_w(cg, 0, dst);
+        emit8(&cg->code, (uint8_t)(0xB8 | (dst & 7)));
+        emit64(&cg->code, (uint64_t)l.imm);
+    }
+}
+
+
+static void emit_store_loc(CodeGen *cg, Loc l, Reg src) {
+    if (l.kind == LOC_REG) {
+        if (l.reg != src) emit_mov_reg_reg(cg, l.reg, src);
+    } else {
+        emit_op_loc(cg, 0x89, src, l);
+    }
+}
+
+// add/sub/cmp/imul of dst with any operand. big immediates go through rcx
+static void emit_alu_loc(CodeGen *cg, OpKind op, Reg dst, Loc src) {
+    if (src.kind == LOC_IMM && !fits_i32(src.imm)) {
+        emit_load_loc(cg, REG_RCX, src);
+        src.kind = LOC_REG;
+        src.reg = REG_RCX;
+    }
+    if (src.kind == LOC_IMM) {
+        Loc d = {LOC_REG, dst, 0, 0};
+        if (op == OP_MUL) {
+            emit_op_loc(cg, fits_i8(src.imm) ? 0x6B : 0x69, dst, d);
+        } else {
+            int ext = op == OP_ADD ? 0 : (op == OP_SUB ? 5 : 7);
+            emit_op_loc(cg, fits_i8(src.imm) ? 0x83 : 0x81, ext, d);
+        }
+        if (fits_i8(src.imm)) emit8(&cg->code, (uint8_t)src.imm);
+        else emit32(&cg->code, (uint32_t)src.imm);
+        return;
+    }
+    if (op == OP_MUL) emit_op2_loc(cg, 0xAF, dst, src);
+    else emit_op_loc(cg, op == OP_ADD ? 0x03 : (op == OP_SUB ? 0x2B : 0x3B), dst, src);
+}
+
+
+static void emit_setcc_rax(CodeGen *cg, uint8_t cc) {
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, (uint8_t)(0x90 | cc));
+    emit8(&cg->code, 0xC0);
+    emit8(&cg->code, 0x48);
+    emit8(&cg->code, 0x0F);
+    emit8(&cg->code, 0xB6);
+    emit8(&cg->code, 0xC0);
+}
+
+
+static int same_reg(Loc a, Loc b) {
+    return a.kind == LOC_REG && b.kind == LOC_REG && a.reg == b.reg;
+}
+
+static void gen_ir_bin(CodeGen *cg, IrFunc *f, IrInst *in) {
+    Loc a = ir_loc(cg, f, in->args[0]);
+    Loc b = ir_loc(cg, f, in->args[1]);
+    OpKind op = in->alu;
+    if (op == OP_DIV) {
+        emit_load_loc(cg, REG_RAX, a);
+        if (b.kind == LOC_IMM) {
+            emit_load_loc(cg, REG_RCX, b);
+            b.kind = LOC_REG;
+            b.reg = REG_RCX;
+        }
+        emit8(&cg->code, 0x48);
+        emit8(&cg->code, 0x99);
+        emit_op_loc(cg, 0xF7, 7, b);
+        // dead_code keeps a division that may trap even when nothing reads it
+        if (in->dst >= 0) emit_store_loc(cg, vreg_loc(cg, f, in->dst), REG_RAX);
+        return;
+    }
+    Loc d = vreg_loc(cg, f, in->dst);
+    if (op == OP_SHL) {
+        Reg w = d.kind == LOC_REG ? d.reg : REG_RAX;
+        emit_load_loc(cg, w, a);
+        emit_shift_reg(cg, 4, w, (int)b.imm);
+        emit_store_loc(cg, d, w);
+        return;
+    }
+    if (op == OP_DIV_POW2 || op == OP_DIV_CONST) {
+        emit_load_loc(cg, REG_RAX, a);
+        emit_const_op_rax(cg, op, b.imm);
+        emit_store_loc(cg, d, REG_RAX);
+        return;
+    }
+    if (op == OP_ADD || op == OP_SUB || op == OP_MUL) {
+        if ((op == OP_ADD || op == OP_MUL) && (same_reg(d, b) || a.kind == LOC_IMM)) {
+            Loc t = a;
+            a = b;
+            b = t;
+        }
+        // work straight in the destination register unless b lives there
+        Reg w = d.kind == LOC_REG && !same_reg(d, b) ? d.reg : REG_RAX;
+        emit_load_loc(cg, w, a);
+        emit_alu_loc(cg, op, w, b);
+        emit_store_loc(cg, d, w);
+        return;
+    }
+    emit_load_loc(cg, REG_RAX, a);
+    emit_alu_loc(cg, OP_EQ, REG_RAX, b);
+    emit_setcc_rax(cg, cond_code(op));
+    emit_store_loc(cg, d, REG_RAX);
+}
+
+
+static void gen_ir_call(CodeGen *cg, IrFunc *f, IrInst *in) {
+    Loc a0 = ir_loc(cg, f, in->args[0]);
+    switch (in->fn) {
+        case BI_LIST_NEW:
+            emit_load_loc(cg, REG_RAX, a0);
+            emit_list_new(cg);
+            break;
+        case BI_ARRAY_NEW:
+            emit_load_loc(cg, REG_RAX, a0);
+            emit_array_new(cg);
+            break;
+        case BI_LEN:
+            emit_load_loc(cg, REG_RAX, a0);
+            emit_list_len(cg);
+            break;
+        case BI_GET:
+            emit_load_loc(cg, REG_RCX, a0);
+            emit_load_loc(cg, REG_RAX, ir_loc(cg, f, in->args[1]));
+            emit_list_get(cg);
+            break;
+        case BI_SET:
+            emit_load_loc(cg, REG_RAX, a0);
+            emit_mov_rbp_from_rax(cg, (int32_t)cg->temp_offset);
+            emit_load_loc(cg, REG_RAX, ir_loc(cg, f, in->args[1]));
+            emit_mov_rbp_from_rax(cg, (int32_t)cg->temp2_offset);
+            emit_load_loc(cg, REG_RAX, ir_loc(cg, f, in->args[2]));
+            emit_list_set(cg);
+            break;
+        case BI_PUSH:
+            emit_load_loc(cg, REG_RAX, a0);
+            emit_mov_rbp_from_rax(cg, (int32_t)cg->temp_offset);
+            emit_load_loc(cg, REG_RAX, ir_loc(cg, f, in->args[1]));
+            emit_mov_rbp_from_rax(cg, (int32_t)cg->temp2_offset);
+            emit_list_push(cg);
+            break;
+        case BI_RESERVE:
+            emit_load_loc(cg, REG_RAX, a0);
+            emit_mov_rbp_from_rax(cg, (int32_t)cg->temp_offset);
+            emit_load_loc(cg, REG_RAX, ir_loc(cg, f, in->args[1]));
+            emit_mov_rbp_from_rax(cg, (int32_t)cg->temp2_offset);
+            emit_list_reserve(cg);
+            break;
+        case BI_POP:
+            emit_load_loc(cg, REG_RAX, a0);
+            emit_list_pop(cg);
+            break;
+        case BI_RANGE:
+            emit_load_loc(cg, REG_RAX, a0);
+            emit_range(cg);
+            break;
+        default:
+            die("unknown call");
+    }
+    if (in->dst >= 0) emit_store_loc(cg, vreg_loc(cg, f, in->dst), REG_RAX);
+}
+
+
+static void gen_ir_inst(CodeGen *cg, IrFunc *f, IrInst *in) {
+    switch (in->op) {
+        case IR_COPY: {
+            Loc d = vreg_loc(cg, f, in->dst);
+            Loc a = ir_loc(cg, f, in->args[0]);
+            if (d.kind == LOC_REG) {
+                emit_load_loc(cg, d.reg, a);
+            } else if (a.kind == LOC_REG) {
+                emit_store_loc(cg, d, a.reg);
+            } else if (a.kind == LOC_IMM && fits_i32(a.imm)) {
+                emit_op_loc(cg, 0xC7, 0, d);
+                emit32(&cg->code, (uint32_t)a.imm);
+            } else {
+                emit_load_loc(cg, REG_RAX, a);
+                emit_store_loc(cg, d, REG_RAX);
+            }
+            return;
+        }
+        case IR_BIN:
+            gen_ir_bin(cg, f, in);
+            return;
+        case IR_UNARY: {
+            Loc d = vreg_loc(cg, f, in->dst);
+            Loc a = ir_loc(cg, f, in->args[0]);
+            if (in->alu == OP_NEG) {
+                Reg w = d.kind == LOC_REG ? d.reg : REG_RAX;
+                emit_load_loc(cg, w, a);
+                Loc wl = {LOC_REG, w, 0, 0};
+                emit_op_loc(cg, 0xF7, 3, wl);
+                emit_store_loc(cg, d, w);
+            } else {
+                emit_load_loc(cg, REG_RAX, a);
+                emit_test_rax(cg);
+                emit_setcc_rax(cg, 0x4);
+                emit_store_loc(cg, d, REG_RAX);
+            }
+            return;
+        }
+        case IR_CALL:
+            gen_ir_call(cg, f, in);
+            return;
+        case IR_PRINT:
+            emit_load_loc(cg, REG_RAX, ir_loc(cg, f, in->args[0]));
+            emit_print_int(cg);
+            emit_print_end(cg);
+            return;
+        case IR_PRINT_STR:
+            emit_print_str(cg, in->str);
+            emit_print_newline(cg);
+            emit_print_end(cg);
+            return;
+        case IR_ADDR:
+            emit_load_loc(cg, REG_RCX, ir_loc(cg, f, in->args[0]));
+            emit_load_loc(cg, REG_RAX, ir_loc(cg, f, in->args[1]));
+            emit_list_addr(cg);
+            emit_store_loc(cg, vreg_loc(cg, f, in->dst), REG_RAX);
+            return;
+        case IR_LOAD: {
+            if (in->dst < 0) return;
+            Loc d = vreg_loc(cg, f, in->dst);
+            Loc a = ir_loc(cg, f, in->args[0]);
+            if (a.kind != LOC_REG) {
+                emit_load_loc(cg, REG_RAX, a);
+                a.kind = LOC_REG;
+                a.reg = REG_RAX;
+            }
+            Reg w = d.kind == LOC_REG ? d.reg : REG_RAX;
+            emit_load_mem(cg, w, a.reg);
+            emit_store_loc(cg, d, w);
+            return;
+        }
+        // the count goes first and r8 last, nothing before it can clobber an operand
+        case IR_VFILL:
+        case IR_VIOTA:
+            emit_load_loc(cg, REG_RCX, ir_loc(cg, f, in->args[2]));
+            emit_load_loc(cg, REG_RDX, ir_loc(cg, f, in->args[0]));
+            emit_load_loc(cg, REG_R8, ir_loc(cg, f, in->args[1]));
+            if (in->op == IR_VFILL) emit_vec_fill(cg);
+            else emit_vec_iota(cg);
+            return;
+        case IR_VMAP:
+            emit_load_loc(cg, REG_RCX, ir_loc(cg, f, in->args[3]));
+            emit_load_loc(cg, REG_RDX, ir_loc(cg, f, in->args[0]));
+            emit_load_loc(cg, REG_RAX, ir_loc(cg, f, in->args[1]));
+            emit_load_loc(cg, REG_R8, ir_loc(cg, f, in->args[2]));
+            emit_vec_map(cg, in->alu);
+            return;
+        case IR_VSUM:
+            emit_load_loc(cg, REG_RCX, ir_loc(cg, f, in->args[1]));
+            emit_load_loc(cg, REG_RDX, ir_loc(cg, f, in->args[0]));
+            emit_vec_sum(cg);
+            emit_store_loc(cg, vreg_loc(cg, f, in->dst), REG_RAX);
+            return;
+    }
+}
+
+// the block ends in a comparison nobody but its branch reads
+static int fuses_with_branch(IrBlock *b, int *uses) {
+    if (b->term != TERM_BR || b->cond.kind != IRV_VREG || b->count == 0) return 0;
+    IrInst *in = &b->insts[b->count - 1];
+    return in->op == IR_BIN && is_compare(in->alu) && in->dst == (int)b->cond.v && uses[in->dst] == 1;
+}
+
+
+// cmp for a fused branch, returns the cc that means true
+static uint8_t gen_ir_cmp(CodeGen *cg, IrFunc *f, IrInst *in) {
+    Loc a = ir_loc(cg, f, in->args[0]);
+    Loc b = ir_loc(cg, f, in->args[1]);
+    OpKind op = in->alu;
+    if (a.kind == LOC_IMM && b.kind != LOC_IMM) {
+        Loc t = a;
+        a = b;
+        b = t;
+        if (op == OP_LT) op = OP_GT;
+        else if (op == OP_GT) op = OP_LT;
+        else if (op == OP_LE) op = OP_GE;
+        else if (op == OP_GE) op = OP_LE;
+    }
+    Reg r = a.kind == LOC_REG ? a.reg : REG_RAX;
+    if (a.kind != LOC_REG) emit_load_loc(cg, REG_RAX, a);
+    emit_alu_loc(cg, OP_EQ, r, b);
+    return cond_code(op);
+}
+
+
+void gen_ir(CodeGen *cg, IrFunc *f) {
+    int *labels = (int *)region_alloc(cg->rg, f->count * sizeof(int) + sizeof(int));
+    for (size_t i = 0; i < f->count; i++) labels[i] = new_label(cg);
+    int l_end = new_label(cg);
+    int *uses = ir_count_uses(f);
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        int next = (int)i + 1;
+        int fuse = fuses_with_branch(b, uses);
+        place_label(cg, labels[i]);
+        for (size_t j = 0; j + fuse < b->count; j++) gen_ir_inst(cg, f, &b->insts[j]);
+        if (b->term == TERM_JMP) {
+            if (b->succ[0] != next) emit_jmp_label(cg, labels[b->succ[0]]);
+        } else if (b->term == TERM_BR) {
+            uint8_t cc = 0x5;
+            if (fuse) {
+                cc = gen_ir_cmp(cg, f, &b->insts[b->count - 1]);
+            } else {
+                Loc c = ir_loc(cg, f, b->cond);
+                if (c.kind == LOC_REG) {
+                    emit_op_loc(cg, 0x85, c.reg, c);
+                } else {
+                    emit_load_loc(cg, REG_RAX, c);
+                    emit_test_rax(cg);
+                }
+            }
+            if (b->succ[0] == next) {
+                emit_jcc_label(cg, (uint8_t)(cc ^ 1), labels[b->succ[1]]);
+            } else {
+                emit_jcc_label(cg, cc, labels[b->succ[0]]);
+                if (b->succ[1] != next) emit_jmp_label(cg, labels[b->succ[1]]);
+            }
+        } else if (next != (int)f->count) {
+            emit_jmp_label(cg, l_end);
+        }
+    }
+    place_label(cg, l_end);
+    free(uses);
+}
+
+
+// parallel codegen for a run of top-level statements. each part gets a copy
+// of cg with its own code buffer, labels and fixups (label ids start past
+// the ones cg already has, anything below that is one of the runtime labels),
+// then the parts are spliced back in order. top-level statements only share
+// the frame and the runtime labels, so the bytes come out exactly as if
+// gen_stmt had run over them one by one
+typedef struct {
+    CodeGen *cg;
+    CodeGen *part;
+    Stmt **items;
+    size_t count;
+    int parts;
+} GenJob;
+
+static void gen_part(void *arg, int i) {
+    GenJob *j = (GenJob *)arg;
+    CodeGen *w = &j->part[i];
+    size_t lo = j->count * (size_t)i / (size_t)j->parts;
+    size_t hi = j->count * (size_t)(i + 1) / (size_t)j->parts;
+    for (size_t k = lo; k < hi; k++) {
+        int loop_depth = 0;
+        peep_fence(w);
+        gen_stmt(w, j->items[k], &loop_depth);
+    }
+}
+
+
+static void splice_part(CodeGen *cg, CodeGen *w) {
+    size_t base = cg->code.len;
+    if (cg->code.cap < base + w->code.len) {
+        size_t nc = cg->code.cap ? cg->code.cap : 1024;
+        while (nc < base + w->code.len) nc *= 2;
+        cg->code.data = (uint8_t *)region_grow(cg->rg, cg->code.data, cg->code.cap, nc);
+        cg->code.cap = nc;
+    }
+    memcpy(cg->code.data + base, w->code.data, w->code.len);
+    cg->code.len = base + w->code.len;
+    int first = cg->label_base + (int)cg->label_count;
+    for (size_t i = 0; i < w->label_count; i++) {
+        int id = new_label(cg);
+        int pos = w->labels[i].pos;
+        cg->labels[id - cg->label_base].pos = pos < 0 ? -1 : pos + (int)base;
+    }
+    for (size_t i = 0; i < w->fixup_count; i++) {
+        Fixup f = w->fixups[i];
+        f.offset += base;
+        if (f.kind == FIX_LABEL && f.label_id >= w->label_base) f.label_id = first + (f.label_id - w->label_base);
+        fixups_push(cg, f);
+    }
+    peep_fence(cg);
+    cg->peep.insns += w->peep.insns;
+    cg->peep.bytes += w->peep.bytes;
+}
+
+
+// part_rg holds one scratch region per part, they are reset after splicing
+void gen_stmts(CodeGen *cg, Stmt **items, size_t count, int parts, Region *part_rg) {
+    if (parts <= 1 || count < (size_t)parts) {
+        for (size_t i = 0; i < count; i++) {
+            int loop_depth = 0;
+            peep_fence(cg);
+            gen_stmt(cg, items[i], &loop_depth);
+        }
+        return;
+    }
+    CodeGen *part = (CodeGen *)xmalloc((size_t)parts * sizeof(CodeGen));
+    for (int i = 0; i < parts; i++) {
+        CodeGen *w = &part[i];
+        *w = *cg;
+        w->rg = &part_rg[i];
+        memset(&w->code, 0, sizeof(w->code));
+        w->code.rg = w->rg;
+        w->fixups = 0;
+        w->fixup_count = 0;
+        w->fixup_cap = 0;
+        w->labels = 0;
+        w->label_count = 0;
+        w->label_cap = 0;
+        w->label_base = cg->label_base + (int)cg->label_count;
+        memset(&w->peep, 0, sizeof(w->peep));
+    }
+    GenJob j = {cg, part, items, count, parts};
+    pool_run(gen_part, &j, parts);
+    for (int i = 0; i < parts; i++) {
+        splice_part(cg, &part[i]);
+        region_reset(&part_rg[i]);
+    }
+    free(part);
+}
+
+
+// branch relaxation. every jump to a label goes out as a rel32 jmp/jcc, here
+// the ones whose target ends up within reach shrink to the 2-byte rel8 forms.
+// all start out short and the ones that dont reach grow back; growing only
+// ever pushes targets further away, so that settles in a few rounds. labels
+// and the other fixups move down with the code. calls and the lea of the
+// print_int table use labels too, but only E9 and 0F 8x are touched
+typedef struct {
+    size_t start;
+    size_t fix;
+    int len;
+    int is_short;
+} Branch;
+
+
+// where pos ends up once the short branches in b are squeezed,
+// saved[i] is what the first i of them save
+static size_t relax_pos(Branch *b, size_t n, size_t *saved, size_t pos) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (b[mid].start < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return pos - saved[lo];
+}
+
+
+static int cmp_branch(const void *a, const void *b) {
+    size_t x = ((const Branch *)a)->start, y = ((const Branch *)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+
+void relax_branches(CodeGen *cg) {
+    uint8_t *code = cg->code.data;
+    size_t n = 0;
+    Branch *b = (Branch *)xmalloc((cg->fixup_count + 1) * sizeof(Branch));
+    for (size_t i = 0; i < cg->fixup_count; i++) {
+        Fixup *f = &cg->fixups[i];
+        if (f->kind != FIX_LABEL || cg->labels[f->label_id].pos < 0) continue;
+        if (f->offset >= 1 && code[f->offset - 1] == 0xE9) {
+            b[n++] = (Branch){f->offset - 1, i, 5, 1};
+        } else if (f->offset >= 2 && code[f->offset - 2] == 0x0F && (code[f->offset - 1] & 0xF0) == 0x80) {
+            b[n++] = (Branch){f->offset - 2, i, 6, 1};
+        }
+    }
+    qsort(b, n, sizeof(Branch), cmp_branch);
+    size_t *saved = (size_t *)xmalloc((n + 1) * sizeof(size_t));
+    for (int grew = 1; grew;) {
+        saved[0] = 0;
+        for (size_t i = 0; i < n; i++) saved[i + 1] = saved[i] + (b[i].is_short ? (size_t)b[i].len - 2 : 0);
+        grew = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (!b[i].is_short) continue;
+            size_t to = (size_t)cg->labels[cg->fixups[b[i].fix].label_id].pos;
+            int64_t d = (int64_t)relax_pos(b, n, saved, to) - (int64_t)(b[i].start - saved[i] + 2);
+            if (d < -128 || d > 127) {
+                b[i].is_short = 0;
+                grew = 1;
+            }
+        }
+    }
+
+    // squeeze the code in place, short branches get their rel8 right away
+    // and lose the fixup
+    uint8_t *gone = (uint8_t *)xmalloc(cg->fixup_count + 1);
+    memset(gone, 0, cg->fixup_count + 1);
+    size_t in = 0, out = 0;
+    for (size_t i = 0; i < n; i++) {
+        memmove(code + out, code + in, b[i].start - in);
+        out += b[i].start - in;
+        in = b[i].start;
+        if (b[i].is_short) {
+            size_t to = (size_t)cg->labels[cg->fixups[b[i].fix].label_id].pos;
+            int64_t d = (int64_t)relax_pos(b, n, saved, to) - (int64_t)(out + 2);
+            code[out] = b[i].len == 5 ? 0xEB : (uint8_t)(0x70 | (code[in + 1] & 0x0F));
+            code[out + 1] = (uint8_t)(int8_t)d;
+            out += 2;
+            gone[b[i].fix] = 1;
+        } else {
+            memmove(code + out, code + in, (size_t)b[i].len);
+            out += (size_t)b[i].len;
+        }
+        in += (size_t)b[i].len;
+    }
+    memmove(code + out, code + in, cg->code.len - in);
+    cg->code.len = out + (cg->code.len - in);
+
+    size_t k = 0;
+    for (size_t i = 0; i < cg->fixup_count; i++) {
+        if (gone[i]) continue;
+        Fixup f = cg->fixups[i];
+        f.offset = relax_pos(b, n, saved, f.offset);
+        cg->fixups[k++] = f;
+    }
+    cg->fixup_count = k;
+    for (size_t i = 0; i < cg->label_count; i++) {
+        if (cg->labels[i].pos >= 0) cg->labels[i].pos = (int)relax_pos(b, n, saved, (size_t)cg->labels[i].pos);
+    }
+    free(gone);
+    free(saved);
+    free(b);
+}
+
+
 void patch_fixups(CodeGen *cg) {
     for (size_t i = 0; i < cg->fixup_count; i++) {
         Fixup *f = &cg->fixups[i];
+        uint32_t next = cg->text_rva + (uint32_t)(f->offset + 4);
+        int32_t v;
         if (f->kind == FIX_LABEL) {
             int pos = cg->labels[f->label_id].pos;
             if (pos < 0) die("label not placed");
-            uint32_t target = cg->text_rva + (uint32_t)pos;
-            uint32_t next = cg->text_rva + (uint32_t)(f->offset + 4);
-            int32_t rel = (int32_t)(target - next);
-            memcpy(cg->code.data + f->offset, &rel, 4);
+            v = (int32_t)(cg->text_rva + (uint32_t)pos - next);
+        } else if (f->kind == FIX_RIP) {
+            v = (int32_t)(f->target_rva - next);
+        } else if (f->kind == FIX_STR) {
+            v = (int32_t)(f->str->rva - next);
+        } else if (f->kind == FIX_FRAME) {
+            v = (int32_t)cg->frame_size;
+        } else if (f->kind == FIX_VSTACK) {
+            v = (int32_t)cg->vstack_base_offset;
+        } else if (f->kind == FIX_LOOP) {
+            v = (int32_t)(cg->loop_slots_offset - f->label_id * 8);
         } else {
-            uint32_t next = cg->text_rva + (uint32_t)(f->offset + 4);
-            int32_t rel = (int32_t)(f->target_rva - next);
-            memcpy(cg->code.data + f->offset, &rel, 4);
+            v = (int32_t)(cg->locals_offset - cg->sym.items[f->label_id].slot * 8);
         }
+        memcpy(cg->code.data + f->offset, &v, 4);
     }
 }
-
+
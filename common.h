@@ -22,19 +22,91 @@ typedef enum {
     TK_SYM
 } TokenKind;
 
+// bump allocator for the front end, see util.c
+#define REGION_BLOCK (1 << 20)
+
+typedef struct RegionBlock {
+    struct RegionBlock *next;
+    // set on blocks that hold a single big allocation. also keeps the data
+    // after the header 16-aligned
+    size_t own;
+} RegionBlock;
+
+typedef struct {
+    RegionBlock *blocks;
+    char *ptr;
+    char *end;
+} Region;
+
+// the input program. plain utf-8 is lexed straight out of the mapping,
+// utf-16 gets transcoded into buf
+typedef struct {
+    const char *data;
+    size_t len;
+    void *map;
+    size_t map_len;
+    char *buf;
+} SourceFile;
+
+// keyword and punctuation ids, so the parser compares ints instead of text
+typedef enum {
+    TOK_NONE,
+    KW_PRINT,
+    KW_LET,
+    KW_V,
+    KW_TAKOM,
+    KW_SLUCHAE,
+    KW_ELSE,
+    KW_REPEAT,
+    KW_TRUE,
+    KW_FALSE,
+    KW_AND,
+    KW_OR,
+    KW_NOT,
+    P_PLUS,
+    P_MINUS,
+    P_STAR,
+    P_SLASH,
+    P_ASSIGN,
+    P_LT,
+    P_GT,
+    P_LE,
+    P_GE,
+    P_EQ,
+    P_NE,
+    P_ARROW,
+    P_LPAREN,
+    P_RPAREN,
+    P_LBRACE,
+    P_RBRACE,
+    P_SEMI,
+    P_COMMA,
+    TOK_ID_COUNT
+} TokId;
+
 typedef struct {
     TokenKind kind;
     char *text;
     int64_t num;
+    TokId id;
 } Token;
 
+// interned identifier text: equal names share one pointer.
+// text and table both live in the region, the table is open addressing
+typedef struct {
+    Region *rg;
+    char **slots;
+    uint32_t *hashes;
+    size_t count;
+    size_t cap;
+} StrPool;
+
 typedef struct {
     const char *src;
     size_t len;
     size_t pos;
-    Token *items;
-    size_t count;
-    size_t cap;
+    StrPool pool;
+    Region *rg;
 } Lexer;
 
 typedef struct StringLit {
@@ -76,7 +148,11 @@ typedef enum {
     OP_AND,
     OP_OR,
     OP_NEG,
-    OP_NOT
+    OP_NOT,
+    // only made by fold.c, the right side is always a literal
+    OP_SHL,
+    OP_DIV_POW2,
+    OP_DIV_CONST
 } OpKind;
 
 typedef struct Expr Expr;
@@ -103,7 +179,8 @@ struct Expr {
             size_t argc;
         } call;
         struct {
-            char *param;
+            char *params[2];
+            size_t nparams;
             Expr *body;
         } lambda;
     } v;
@@ -134,36 +211,237 @@ struct Stmt {
     } v;
 };
 
+typedef enum {
+    BI_NONE = -1,
+    BI_LIST_NEW,
+    BI_ARRAY_NEW,
+    BI_LEN,
+    BI_GET,
+    BI_SET,
+    BI_PUSH,
+    BI_POP,
+    BI_RANGE,
+    BI_RESERVE,
+    // these take a lambda and never reach a call, every backend turns them into a loop
+    BI_MAP,
+    BI_FILTER,
+    BI_REDUCE,
+    BI_EACH,
+    BI_COUNT
+} Builtin;
+
+// lambda parameters in scope, innermost last. at is wherever the backend keeps
+// each one: a register or a vstack slot on the ast path, a vreg in the IR, a vm
+// register. the ast path keeps the loop index here too, as an entry without a name
+#define LAMBDA_PARAMS 16
+
 typedef struct {
-    Token *items;
-    size_t count;
+    const char *name[LAMBDA_PARAMS];
+    int at[LAMBDA_PARAMS];
+    int count;
+} Params;
+
+// tokens are pulled from the lexer into a ring. peek_n looks at most
+// PARSE_LOOKAHEAD past the current token (the lambda check, "( a , x ) =>"
+// ends at pos+5), the rest of the ring keeps a Token* valid for a couple of
+// advances after it is taken
+#define PARSE_LOOKAHEAD 5
+#define PARSE_RING (PARSE_LOOKAHEAD + 3)
+
+// rg holds the ast and can be reset between top-level statements, string
+// literals and their table live in lit_rg until the image is written
+typedef struct {
+    Lexer *lx;
+    Token ring[PARSE_RING];
     size_t pos;
+    size_t filled;
     StringLit **strings;
     size_t strings_count;
     size_t strings_cap;
+    Region *rg;
+    Region *lit_rg;
 } Parser;
 
+typedef enum {
+    REG_NONE = -1,
+    REG_RAX,
+    REG_RCX,
+    REG_RDX,
+    REG_RBX,
+    REG_RSP,
+    REG_RBP,
+    REG_RSI,
+    REG_RDI,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15
+} Reg;
+
+// first/last are the statements sema saw the variable at, hold the outermost
+// repeat it was used in after being declared outside of it. see sym_pack
 typedef struct {
     char *name;
     int index;
     TypeKind type;
+    Reg reg;
+    int first;
+    int last;
+    int hold;
+    int slot;
+    char closed;
+    char escaped;
 } Sym;
 
+// items keep declaration order, hash is open addressing over them: each slot
+// holds index+1, 0 means empty. pos counts statements for the live ranges,
+// loops is the stack of open repeats and loop_end says where each one ended
 typedef struct {
     Sym *items;
     size_t count;
     size_t cap;
+    int *hash;
+    size_t hash_cap;
+    int pos;
+    int *loops;
+    int loop_depth;
+    int loop_depth_cap;
+    int *loop_start;
+    int *loop_end;
+    int loop_count;
+    int loop_cap;
 } SymTab;
 
+typedef enum {
+    IRV_NONE,
+    IRV_VREG,
+    IRV_IMM
+} IrValKind;
+
+typedef struct {
+    IrValKind kind;
+    int64_t v;
+} IrVal;
+
+typedef enum {
+    IR_COPY,
+    IR_BIN,
+    IR_UNARY,
+    IR_CALL,
+    IR_PRINT,
+    IR_PRINT_STR,
+    // only made by the loop pass: &list.data[index] and *ptr
+    IR_ADDR,
+    IR_LOAD,
+    // whole counted loops over list data, see vectorize_loop in ir.c
+    IR_VFILL,
+    IR_VIOTA,
+    IR_VMAP,
+    IR_VSUM
+} IrOp;
+
+typedef struct {
+    IrOp op;
+    OpKind alu;
+    Builtin fn;
+    int dst;
+    IrVal args[4];
+    size_t argc;
+    StringLit *str;
+} IrInst;
+
+typedef enum {
+    TERM_JMP,
+    TERM_BR,
+    TERM_EXIT
+} TermKind;
+
+typedef struct {
+    IrInst *insts;
+    size_t count;
+    size_t cap;
+    TermKind term;
+    IrVal cond;
+    int succ[2];
+    // bit k is live_vreg[k], see ir_liveness. they point into live_sets
+    uint64_t *live_in;
+    uint64_t *live_out;
+} IrBlock;
+
+// vregs [0, nvars) are the SymTab variables by index, the rest are temporaries.
+// the live sets only cover the live_count vregs that ever cross into a block,
+// live_index maps a vreg to its bit or -1
+typedef struct {
+    IrBlock *blocks;
+    size_t count;
+    size_t cap;
+    int nvars;
+    int nvregs;
+    size_t live_words;
+    int live_count;
+    int *live_index;
+    int *live_vreg;
+    uint64_t *live_sets;
+    size_t live_sets_cap;
+    Reg *vreg_reg;
+    int *vreg_slot;
+    int spill_slots;
+} IrFunc;
+
+// bytecode for --run, see vm.c. registers [0, nvars) are the SymTab variables
+typedef struct {
+    int32_t op;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+} VmInst;
+
+typedef struct {
+    VmInst *code;
+    size_t count;
+    size_t cap;
+    int64_t *consts;
+    size_t consts_count;
+    size_t consts_cap;
+    StringLit **strs;
+    size_t strs_count;
+    size_t strs_cap;
+    int nregs;
+} VmProg;
+
 typedef struct {
     uint8_t *data;
     size_t len;
     size_t cap;
+    Region *rg;
 } CodeBuf;
 
+// stdout buffer, see emit_out_routines
+#define OUTBUF_SIZE 8192
+// list arena, see emit_alloc
+#define ARENA_CHUNK (1 << 20)
+#define ARENA_SMALL_MAX 4096
+
+typedef enum {
+    TARGET_WIN64,
+    TARGET_LINUX
+} Target;
+
+// everything that is only known once the whole program has been seen:
+// label and rip targets, string rvas, the frame size, the frame areas
+// below the locals (vstack base, loop counters) and the slot of each variable
 typedef enum {
     FIX_LABEL,
-    FIX_RIP
+    FIX_RIP,
+    FIX_STR,
+    FIX_FRAME,
+    FIX_VSTACK,
+    FIX_LOOP,
+    FIX_VAR
 } FixKind;
 
 typedef struct {
@@ -171,12 +449,26 @@ typedef struct {
     size_t offset;
     int label_id;
     uint32_t target_rva;
+    StringLit *str;
 } Fixup;
 
 typedef struct {
     int pos;
 } Label;
 
+// emit-time peephole state, see peep_live in codegen.c
+typedef struct {
+    size_t fence;   // a label or a fixup sits here, nothing before it may change
+    size_t end;     // code.len when the rest was recorded, stale otherwise
+    size_t start;   // where the last instruction starts
+    size_t push;    // a vstack push of rax right before that one, or -1
+    int last;       // what the last instruction was, PEEP_*
+    int has_slot;   // rax == [rbp+slot]
+    int32_t slot;
+    size_t insns;   // what it took out
+    size_t bytes;
+} Peephole;
+
 typedef struct {
     CodeBuf code;
     Fixup *fixups;
@@ -185,10 +477,12 @@ typedef struct {
     Label *labels;
     size_t label_count;
     size_t label_cap;
+    int label_base;
     SymTab sym;
     int64_t stdout_offset;
     int64_t bytes_written_offset;
     int64_t intbuf_offset;
+    int64_t locals_offset;
     int64_t vstack_base_offset;
     int64_t loop_slots_offset;
     int loop_slots;
@@ -204,8 +498,23 @@ typedef struct {
     int64_t heap_offset;
     int64_t temp_offset;
     int64_t temp2_offset;
-    int64_t lambda_param_offset;
-    char *lambda_param_name;
+    int64_t outbuf_offset;
+    int64_t outpos_offset;
+    int64_t arena_ptr_offset;
+    int64_t arena_end_offset;
+    int flush_label;
+    int append_label;
+    int alloc_label;
+    int grow_label;
+    int print_int_label;
+    int line_buffered;
+    Params params;
+    int vdepth;
+    int opt;
+    int peephole;
+    Peephole peep;
+    Target target;
+    Region *rg;
 } CodeGen;
 
 
@@ -224,21 +533,68 @@ typedef struct {
 } RDataLayout;
 
 void die(const char *msg);
+// plain builds parse, check and emit this many top-level statements at a time
+#define GEN_CHUNK 4096
+#define GEN_MAX_THREADS 64
+
+typedef void (*PoolFn)(void *arg, int job);
+
 void *xmalloc(size_t n);
 char *xstrndup(const char *s, size_t n);
+void *region_alloc(Region *rg, size_t n);
+char *region_strndup(Region *rg, const char *s, size_t n);
+void *region_grow(Region *rg, void *old, size_t old_n, size_t new_n);
+void region_reset(Region *rg);
+void region_free(Region *rg);
+uint32_t str_hash(const char *s, size_t n);
+char *str_intern(StrPool *sp, const char *s, size_t n);
 size_t align_up(size_t v, size_t a);
-char *read_file(const char *path, size_t *out_len);
-char *default_output(const char *in);
-void lex_all(Lexer *lx);
+double now_ms(void);
+bool read_file(const char *path, SourceFile *sf);
+void close_file(SourceFile *sf);
+char *default_output(const char *in, const char *ext);
+Token lex_next(Lexer *lx);
+const char *tok_name(TokId id);
+Stmt *parse_next(Parser *p);
 Stmt *parse_program(Parser *p);
+void fold_program(Stmt *prog, Region *rg);
+int strength_reduce(OpKind *op, int64_t *rhs);
+void div_magic(int64_t d, int64_t *mul, int *shift);
 void sym_add(SymTab *st, const char *name, TypeKind type);
 int sym_find(SymTab *st, const char *name);
+int sym_pack(SymTab *st);
+int param_find(const Params *ps, const char *name);
 void sem_stmt(Stmt *s, SymTab *st, int *max_stack, int *max_repeat, int repeat_depth);
+Builtin builtin_find(const char *name);
+const char *builtin_name(Builtin b);
+void regalloc(Stmt *prog, SymTab *st);
+void regalloc_ir(IrFunc *f, SymTab *st);
+IrFunc *ir_build(Stmt *prog, SymTab *st);
+void ir_optimize(IrFunc *f);
+void ir_liveness(IrFunc *f);
+int *ir_loop_depth(IrFunc *f);
+int *ir_count_uses(IrFunc *f);
+int ir_is_live(const uint64_t *set, int v);
+int ir_live_next(IrFunc *f, const uint64_t *set, int k);
+void ir_dump(IrFunc *f, SymTab *st, FILE *out);
+VmProg *vm_compile(Stmt *prog, SymTab *st);
+void vm_run(VmProg *p, int line_buffered);
 void gen_stmt(CodeGen *cg, Stmt *s, int *loop_depth);
+void gen_ir(CodeGen *cg, IrFunc *f);
+void layout_frame(CodeGen *cg, size_t nlocals, int nloops, int nvstack);
 void gen_prolog(CodeGen *cg);
+void gen_stmts(CodeGen *cg, Stmt **items, size_t count, int parts, Region *part_rg);
 void gen_epilog(CodeGen *cg);
+void relax_branches(CodeGen *cg);
 void patch_fixups(CodeGen *cg);
 RDataLayout layout_rdata(CodeGen *cg, StringLit **strings, size_t strings_count);
 void write_pe(const char *out, CodeGen *cg, StringLit **strings, size_t strings_count);
+int pool_cpus(void);
+void pool_start(int threads);
+void pool_run(PoolFn fn, void *arg, int njobs);
+void pool_stop(void);
+void jit_run(CodeGen *cg, StringLit **strings, size_t strings_count);
+size_t layout_elf_rodata(CodeGen *cg, StringLit **strings, size_t strings_count);
+void write_elf(const char *out, CodeGen *cg, StringLit **strings, size_t strings_count);
 
-#endif
+#endif
@@ -0,0 +1,102 @@
+﻿#include "common.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#define ELF_BASE 0x400000ULL
+
+static void buf_u16(uint8_t *b, size_t off, uint16_t v) {
+    b[off + 0] = (uint8_t)(v & 0xFF);
+    b[off + 1] = (uint8_t)((v >> 8) & 0xFF);
+}
+
+
+static void buf_u32(uint8_t *b, size_t off, uint32_t v) {
+    b[off + 0] = (uint8_t)(v & 0xFF);
+    b[off + 1] = (uint8_t)((v >> 8) & 0xFF);
+    b[off + 2] = (uint8_t)((v >> 16) & 0xFF);
+    b[off + 3] = (uint8_t)((v >> 24) & 0xFF);
+}
+
+
+static void buf_u64(uint8_t *b, size_t off, uint64_t v) {
+    buf_u32(b, off, (uint32_t)(v & 0xFFFFFFFFu));
+    buf_u32(b, off + 4, (uint32_t)(v >> 32));
+}
+
+// no imports on linux, the read-only part is just the string literals
+size_t layout_elf_rodata(CodeGen *cg, StringLit **strings, size_t strings_count) {
+    size_t off = 0;
+    for (size_t i = 0; i < strings_count; i++) {
+        off = align_up(off, 8);
+        strings[i]->rva = cg->rdata_rva + (uint32_t)off;
+        off += strings[i]->len + 1;
+    }
+    return off;
+}
+
+
+static void phdr(uint8_t *b, size_t off, uint32_t flags, uint64_t file_off, uint64_t size) {
+    buf_u32(b, off + 0, 1);
+    buf_u32(b, off + 4, flags);
+    buf_u64(b, off + 8, file_off);
+    buf_u64(b, off + 16, ELF_BASE + file_off);
+    buf_u64(b, off + 24, ELF_BASE + file_off);
+    buf_u64(b, off + 32, size);
+    buf_u64(b, off + 40, size);
+    buf_u64(b, off + 48, 0x1000);
+}
+
+void write_elf(const char *out, CodeGen *cg, StringLit **strings, size_t strings_count) {
+    // file offsets equal rvas, so each segment maps straight from the file:
+    // headers + strings read-only at 0, code r-x on the next page boundary
+    cg->rdata_rva = 0x1000;
+    size_t rodata_size = layout_elf_rodata(cg, strings, strings_count);
+    cg->text_rva = (uint32_t)align_up(cg->rdata_rva + rodata_size, 0x1000);
+    patch_fixups(cg);
+
+    // headers and strings up to the code page, the code goes out straight from the buffer
+    size_t image_size = cg->text_rva;
+    uint8_t *img = (uint8_t *)calloc(1, image_size);
+    if (!img) die("out of memory");
+
+    img[0] = 0x7F;
+    img[1] = 'E';
+    img[2] = 'L';
+    img[3] = 'F';
+    img[4] = 2;
+    img[5] = 1;
+    img[6] = 1;
+    buf_u16(img, 16, 2);
+    buf_u16(img, 18, 0x3E);
+    buf_u32(img, 20, 1);
+    buf_u64(img, 24, ELF_BASE + cg->text_rva);
+    buf_u64(img, 32, 64);
+    buf_u64(img, 40, 0);
+    buf_u32(img, 48, 0);
+    buf_u16(img, 52, 64);
+    buf_u16(img, 54, 56);
+    buf_u16(img, 56, 2);
+    buf_u16(img, 58, 64);
+    buf_u16(img, 60, 0);
+    buf_u16(img, 62, 0);
+
+    phdr(img, 64, 4, 0, cg->rdata_rva + rodata_size);
+    phdr(img, 64 + 56, 5, cg->text_rva, cg->code.len);
+
+    for (size_t i = 0; i < strings_count; i++) {
+        memcpy(img + strings[i]->rva, strings[i]->data, strings[i]->len);
+    }
+
+    FILE *f = fopen(out, "wb");
+    if (!f) die("failed to open output");
+    fwrite(img, 1, image_size, f);
+    fwrite(cg->code.data, 1, cg->code.len, f);
+    fclose(f);
+    free(img);
+#ifndef _WIN32
+    chmod(out, 0755);
+#endif
+}
+
@@ -0,0 +1,205 @@
+﻿#include "common.h"
+
+static int lit_value(Expr *e, int64_t *v) {
+    if (e->kind == EX_NUM) {
+        *v = e->v.num;
+        return 1;
+    }
+    if (e->kind == EX_BOOL) {
+        *v = e->v.boolv ? 1 : 0;
+        return 1;
+    }
+    return 0;
+}
+
+
+static void set_num(Expr *e, int64_t v) {
+    e->kind = EX_NUM;
+    e->v.num = v;
+}
+
+
+static int log2_exact(int64_t v) {
+    if (v <= 1 || (v & (v - 1)) != 0) return -1;
+    int k = 0;
+    while (((int64_t)1 << k) != v) k++;
+    return k;
+}
+
+// signed magic numbers, hacker's delight 10-1 widened to 64 bits.
+// x / d == (hi64(x * mul) [+/- x]) >> shift, plus one when that is negative
+void div_magic(int64_t d, int64_t *mul, int *shift) {
+    const uint64_t two63 = (uint64_t)1 << 63;
+    uint64_t ad = d < 0 ? 0 - (uint64_t)d : (uint64_t)d;
+    uint64_t t = two63 + ((uint64_t)d >> 63);
+    uint64_t anc = t - 1 - t % ad;
+    int p = 63;
+    uint64_t q1 = two63 / anc;
+    uint64_t r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad;
+    uint64_t r2 = two63 - q2 * ad;
+    uint64_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    uint64_t m = q2 + 1;
+    *mul = (int64_t)(d < 0 ? 0 - m : m);
+    *shift = p - 64;
+}
+
+// x * 2^k -> shl, x / 2^k -> shift with rounding fixup, x / d -> multiply-high.
+// rhs is rewritten to the shift count for the shift forms
+int strength_reduce(OpKind *op, int64_t *rhs) {
+    int k = log2_exact(*rhs);
+    if (*op == OP_MUL && k > 0) {
+        *op = OP_SHL;
+        *rhs = k;
+        return 1;
+    }
+    if (*op != OP_DIV) return 0;
+    if (k > 0) {
+        *op = OP_DIV_POW2;
+        *rhs = k;
+        return 1;
+    }
+    // 0 traps, +-1 are trivial, and min has no magic that fits
+    if (*rhs == 0 || *rhs == 1 || *rhs == -1 || *rhs == INT64_MIN) return 0;
+    *op = OP_DIV_CONST;
+    return 1;
+}
+
+
+static int fold_bin(OpKind op, int64_t a, int64_t b, int64_t *out) {
+    switch (op) {
+        case OP_ADD: *out = (int64_t)((uint64_t)a + (uint64_t)b); return 1;
+        case OP_SUB: *out = (int64_t)((uint64_t)a - (uint64_t)b); return 1;
+        case OP_MUL: *out = (int64_t)((uint64_t)a * (uint64_t)b); return 1;
+        case OP_DIV:
+            // let the program trap at runtime like it would without folding
+            if (b == 0 || (a == INT64_MIN && b == -1)) return 0;
+            *out = a / b;
+            return 1;
+        case OP_EQ: *out = a == b; return 1;
+        case OP_NE: *out = a != b; return 1;
+        case OP_LT: *out = a < b; return 1;
+        case OP_GT: *out = a > b; return 1;
+        case OP_LE: *out = a <= b; return 1;
+        case OP_GE: *out = a >= b; return 1;
+        case OP_AND: *out = a != 0 && b != 0; return 1;
+        case OP_OR: *out = a != 0 || b != 0; return 1;
+        default: return 0;
+    }
+}
+
+static void fold_expr(Expr *e, Region *rg) {
+    if (!e) return;
+    switch (e->kind) {
+        case EX_NUM:
+        case EX_BOOL:
+        case EX_VAR:
+        case EX_STR:
+            return;
+        case EX_LAMBDA:
+            fold_expr(e->v.lambda.body, rg);
+            return;
+        case EX_CALL:
+            for (size_t i = 0; i < e->v.call.argc; i++) fold_expr(e->v.call.args[i], rg);
+            return;
+        case EX_UNARY: {
+            int64_t a;
+            fold_expr(e->v.un.expr, rg);
+            if (!lit_value(e->v.un.expr, &a)) return;
+            if (e->v.un.op == OP_NEG) set_num(e, (int64_t)(0 - (uint64_t)a));
+            else set_num(e, a == 0);
+            return;
+        }
+        case EX_BIN: {
+            Expr *l = e->v.bin.left;
+            Expr *r = e->v.bin.right;
+            OpKind op = e->v.bin.op;
+            int64_t a, b, v;
+            fold_expr(l, rg);
+            fold_expr(r, rg);
+            int la = lit_value(l, &a);
+            int lb = lit_value(r, &b);
+            if (la && lb) {
+                if (fold_bin(op, a, b, &v)) set_num(e, v);
+                return;
+            }
+            if ((op == OP_AND || op == OP_OR) && la) {
+                // the literal side decides: either the answer is fixed or it is just the other side's truth
+                if ((op == OP_AND) == (a == 0)) {
+                    set_num(e, op == OP_OR);
+                } else {
+                    Expr *zero = (Expr *)region_alloc(rg, sizeof(Expr));
+                    set_num(zero, 0);
+                    e->v.bin.op = OP_NE;
+                    e->v.bin.left = r;
+                    e->v.bin.right = zero;
+                }
+                return;
+            }
+            if (op == OP_MUL && la && !lb) {
+                e->v.bin.left = r;
+                e->v.bin.right = l;
+                r = l;
+                b = a;
+                lb = 1;
+            }
+            if (lb && strength_reduce(&op, &b)) {
+                e->v.bin.op = op;
+                set_num(r, b);
+            }
+            return;
+        }
+    }
+}
+
+static void fold_stmt(Stmt *s, Region *rg) {
+    if (!s) return;
+    switch (s->kind) {
+        case ST_BLOCK:
+            for (size_t i = 0; i < s->v.block.count; i++) fold_stmt(s->v.block.items[i], rg);
+            return;
+        case ST_PRINT:
+            fold_expr(s->v.print.expr, rg);
+            return;
+        case ST_LET:
+            fold_expr(s->v.let.expr, rg);
+            return;
+        case ST_SET:
+            fold_expr(s->v.set.expr, rg);
+            return;
+        case ST_IF:
+            fold_expr(s->v.ifs.cond, rg);
+            fold_stmt(s->v.ifs.thenb, rg);
+            fold_stmt(s->v.ifs.elseb, rg);
+            return;
+        case ST_REPEAT:
+            fold_expr(s->v.repeat.count, rg);
+            fold_stmt(s->v.repeat.body, rg);
+            return;
+        case ST_EXPR:
+            fold_expr(s->v.expr.expr, rg);
+            return;
+    }
+}
+
+// rg is where the parser put the ast, new nodes go there too
+void fold_program(Stmt *prog, Region *rg) {
+    fold_stmt(prog, rg);
+}
+
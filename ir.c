@@ -0,0 +1,1589 @@
+﻿#include "common.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+typedef struct {
+    IrFunc *f;
+    SymTab *st;
+    int cur;
+    Params params;
+} IrBuilder;
+
+static IrVal val_imm(int64_t v) {
+    IrVal r = {IRV_IMM, v};
+    return r;
+}
+
+
+static IrVal val_vreg(int v) {
+    IrVal r = {IRV_VREG, v};
+    return r;
+}
+
+
+static int new_block(IrFunc *f) {
+    if (f->count == f->cap) {
+        size_t nc = f->cap ? f->cap * 2 : 16;
+        f->blocks = (IrBlock *)realloc(f->blocks, nc * sizeof(IrBlock));
+        if (!f->blocks) die("out of memory");
+        f->cap = nc;
+    }
+    IrBlock *b = &f->blocks[f->count];
+    memset(b, 0, sizeof(IrBlock));
+    b->term = TERM_EXIT;
+    b->succ[0] = -1;
+    b->succ[1] = -1;
+    return (int)f->count++;
+}
+
+
+static int new_temp(IrFunc *f) {
+    return f->nvregs++;
+}
+
+
+static IrInst *add_inst(IrFunc *f, int block, IrOp op, size_t argc) {
+    IrBlock *b = &f->blocks[block];
+    if (b->count == b->cap) {
+        size_t nc = b->cap ? b->cap * 2 : 8;
+        b->insts = (IrInst *)realloc(b->insts, nc * sizeof(IrInst));
+        if (!b->insts) die("out of memory");
+        b->cap = nc;
+    }
+    IrInst *in = &b->insts[b->count++];
+    memset(in, 0, sizeof(IrInst));
+    in->op = op;
+    in->fn = BI_NONE;
+    in->dst = -1;
+    in->argc = argc;
+    return in;
+}
+
+
+static void set_jmp(IrFunc *f, int block, int target) {
+    f->blocks[block].term = TERM_JMP;
+    f->blocks[block].succ[0] = target;
+    f->blocks[block].succ[1] = -1;
+}
+
+
+static void set_br(IrFunc *f, int block, IrVal cond, int then_b, int else_b) {
+    f->blocks[block].term = TERM_BR;
+    f->blocks[block].cond = cond;
+    f->blocks[block].succ[0] = then_b;
+    f->blocks[block].succ[1] = else_b;
+}
+
+static IrVal build_expr(IrBuilder *b, Expr *e);
+
+// stand-ins for the then/else blocks of a condition, they only get numbers
+// after it so that the blocks of the && / || chain come first
+#define COND_THEN -2
+#define COND_ELSE -3
+
+// a condition is only ever branched on: && / || / не become jumps between
+// blocks and a comparison stays the last thing in its block, where gen_ir
+// fuses it with the branch. nothing is turned into 0/1 on the way
+static void build_cond(IrBuilder *b, Expr *e, int then_b, int else_b) {
+    IrFunc *f = b->f;
+    if (e->kind == EX_BIN && (e->v.bin.op == OP_AND || e->v.bin.op == OP_OR)) {
+        int mid = new_block(f);
+        if (e->v.bin.op == OP_AND) build_cond(b, e->v.bin.left, mid, else_b);
+        else build_cond(b, e->v.bin.left, then_b, mid);
+        b->cur = mid;
+        build_cond(b, e->v.bin.right, then_b, else_b);
+        return;
+    }
+    if (e->kind == EX_UNARY && e->v.un.op == OP_NOT) {
+        build_cond(b, e->v.un.expr, else_b, then_b);
+        return;
+    }
+    IrVal c = build_expr(b, e);
+    set_br(f, b->cur, c, then_b, else_b);
+}
+
+
+// the condition started in block from and made blocks first..end-1
+static void patch_cond(IrFunc *f, int from, int first, int end, int then_b, int else_b) {
+    for (int i = first - 1; i < end; i++) {
+        IrBlock *bb = &f->blocks[i < first ? from : i];
+        if (bb->term != TERM_BR) continue;
+        for (int k = 0; k < 2; k++) {
+            if (bb->succ[k] == COND_THEN) bb->succ[k] = then_b;
+            else if (bb->succ[k] == COND_ELSE) bb->succ[k] = else_b;
+        }
+    }
+}
+
+
+// a && b / a || b as a value: the condition picks one of two copies
+static IrVal build_logic(IrBuilder *b, Expr *e) {
+    IrFunc *f = b->f;
+    int t = new_temp(f);
+    int from = b->cur;
+    int first = (int)f->count;
+    build_cond(b, e, COND_THEN, COND_ELSE);
+    int then_b = new_block(f);
+    IrInst *in = add_inst(f, then_b, IR_COPY, 1);
+    in->dst = t;
+    in->args[0] = val_imm(1);
+    int else_b = new_block(f);
+    in = add_inst(f, else_b, IR_COPY, 1);
+    in->dst = t;
+    in->args[0] = val_imm(0);
+    int done = new_block(f);
+    patch_cond(f, from, first, then_b, then_b, else_b);
+    set_jmp(f, then_b, done);
+    set_jmp(f, else_b, done);
+    b->cur = done;
+    return val_vreg(t);
+}
+
+static IrInst *add_call(IrFunc *f, int block, Builtin fn, int dst, size_t argc) {
+    IrInst *in = add_inst(f, block, IR_CALL, argc);
+    in->fn = fn;
+    in->dst = dst;
+    return in;
+}
+
+
+// map / filter / reduce / for-each become a repeat over the length taken up
+// front, counter and all, so the loop pass sees them like any other: the gets
+// turn into a walking pointer and a plain sum into a vector one. the lambda
+// parameters are temps, nothing is called per element but what the body calls
+static IrVal build_lambda_loop(IrBuilder *b, Expr *e, Builtin fn) {
+    IrFunc *f = b->f;
+    Expr *lam = e->v.call.args[e->v.call.argc - 1];
+    Params outer = b->params;
+    IrVal src = build_expr(b, e->v.call.args[0]);
+    int acc = -1;
+    if (fn == BI_REDUCE) {
+        IrVal init = build_expr(b, e->v.call.args[1]);
+        acc = new_temp(f);
+        IrInst *in = add_inst(f, b->cur, IR_COPY, 1);
+        in->dst = acc;
+        in->args[0] = init;
+        b->params.name[b->params.count] = lam->v.lambda.params[0];
+        b->params.at[b->params.count++] = acc;
+    }
+    int n = new_temp(f);
+    add_call(f, b->cur, BI_LEN, n, 1)->args[0] = src;
+    int out = -1;
+    if (fn == BI_MAP || fn == BI_FILTER) {
+        // a map fills every slot, a filter pushes into room for all of them
+        out = new_temp(f);
+        add_call(f, b->cur, fn == BI_MAP ? BI_ARRAY_NEW : BI_LIST_NEW, out, 1)->args[0] = val_vreg(n);
+    }
+    int counter = new_temp(f);
+    int iv = new_temp(f);
+    IrInst *in = add_inst(f, b->cur, IR_COPY, 1);
+    in->dst = counter;
+    in->args[0] = val_vreg(n);
+    in = add_inst(f, b->cur, IR_COPY, 1);
+    in->dst = iv;
+    in->args[0] = val_imm(0);
+    int head = new_block(f);
+    set_jmp(f, b->cur, head);
+    in = add_inst(f, head, IR_BIN, 2);
+    in->alu = OP_GT;
+    in->dst = new_temp(f);
+    in->args[0] = val_vreg(counter);
+    in->args[1] = val_imm(0);
+    IrVal test = val_vreg(in->dst);
+
+    int body = new_block(f);
+    b->cur = body;
+    int x = new_temp(f);
+    in = add_call(f, body, BI_GET, x, 2);
+    in->args[0] = src;
+    in->args[1] = val_vreg(iv);
+    b->params.name[b->params.count] = lam->v.lambda.params[lam->v.lambda.nparams - 1];
+    b->params.at[b->params.count++] = x;
+    if (fn == BI_FILTER) {
+        int from = b->cur;
+        int first = (int)f->count;
+        build_cond(b, lam->v.lambda.body, COND_THEN, COND_ELSE);
+        int cond_end = (int)f->count;
+        int keep = new_block(f);
+        in = add_call(f, keep, BI_PUSH, new_temp(f), 2);
+        in->args[0] = val_vreg(out);
+        in->args[1] = val_vreg(x);
+        b->cur = new_block(f);
+        patch_cond(f, from, first, cond_end, keep, b->cur);
+        set_jmp(f, keep, b->cur);
+    } else {
+        IrVal v = build_expr(b, lam->v.lambda.body);
+        if (fn == BI_MAP) {
+            in = add_call(f, b->cur, BI_SET, new_temp(f), 3);
+            in->args[0] = val_vreg(out);
+            in->args[1] = val_vreg(iv);
+            in->args[2] = v;
+        } else if (fn == BI_REDUCE) {
+            in = add_inst(f, b->cur, IR_COPY, 1);
+            in->dst = acc;
+            in->args[0] = v;
+        }
+    }
+    in = add_inst(f, b->cur, IR_BIN, 2);
+    in->alu = OP_ADD;
+    in->dst = iv;
+    in->args[0] = val_vreg(iv);
+    in->args[1] = val_imm(1);
+    in = add_inst(f, b->cur, IR_BIN, 2);
+    in->alu = OP_SUB;
+    in->dst = counter;
+    in->args[0] = val_vreg(counter);
+    in->args[1] = val_imm(1);
+    set_jmp(f, b->cur, head);
+    int exit = new_block(f);
+    set_br(f, head, test, body, exit);
+    b->cur = exit;
+    b->params = outer;
+    if (fn == BI_REDUCE) return val_vreg(acc);
+    if (fn == BI_EACH) return src;
+    return val_vreg(out);
+}
+
+static IrVal build_expr(IrBuilder *b, Expr *e) {
+    IrFunc *f = b->f;
+    switch (e->kind) {
+        case EX_NUM:
+            return val_imm(e->v.num);
+        case EX_BOOL:
+            return val_imm(e->v.boolv ? 1 : 0);
+        case EX_VAR: {
+            int k = param_find(&b->params, e->v.var);
+            if (k >= 0) return val_vreg(b->params.at[k]);
+            int idx = sym_find(b->st, e->v.var);
+            if (idx < 0) die("unknown variable");
+            return val_vreg(idx);
+        }
+        case EX_STR:
+            die("string in expression");
+            break;
+        case EX_LAMBDA:
+            die("lambda in expression");
+            break;
+        case EX_UNARY: {
+            IrVal a = build_expr(b, e->v.un.expr);
+            IrInst *in = add_inst(f, b->cur, IR_UNARY, 1);
+            in->alu = e->v.un.op;
+            in->dst = new_temp(f);
+            in->args[0] = a;
+            return val_vreg(in->dst);
+        }
+        case EX_BIN: {
+            if (e->v.bin.op == OP_AND || e->v.bin.op == OP_OR) return build_logic(b, e);
+            IrVal l = build_expr(b, e->v.bin.left);
+            IrVal r = build_expr(b, e->v.bin.right);
+            IrInst *in = add_inst(f, b->cur, IR_BIN, 2);
+            in->alu = e->v.bin.op;
+            in->dst = new_temp(f);
+            in->args[0] = l;
+            in->args[1] = r;
+            return val_vreg(in->dst);
+        }
+        case EX_CALL: {
+            Builtin fn = builtin_find(e->v.call.name);
+            if (fn == BI_NONE) die("unknown call");
+            if (fn >= BI_MAP) return build_lambda_loop(b, e, fn);
+            IrVal args[3];
+            size_t argc = e->v.call.argc;
+            if (argc > 3) die("too many arguments");
+            for (size_t i = 0; i < argc; i++) args[i] = build_expr(b, e->v.call.args[i]);
+            if (fn == BI_LIST_NEW && argc == 0) {
+                args[0] = val_imm(8);
+                argc = 1;
+            }
+            IrInst *in = add_inst(f, b->cur, IR_CALL, argc);
+            in->fn = fn;
+            in->dst = new_temp(f);
+            for (size_t i = 0; i < argc; i++) in->args[i] = args[i];
+            return val_vreg(in->dst);
+        }
+    }
+    return val_imm(0);
+}
+
+static void build_stmt(IrBuilder *b, Stmt *s) {
+    IrFunc *f = b->f;
+    if (!s) return;
+    switch (s->kind) {
+        case ST_BLOCK:
+            for (size_t i = 0; i < s->v.block.count; i++) build_stmt(b, s->v.block.items[i]);
+            return;
+        case ST_PRINT: {
+            if (s->v.print.expr->kind == EX_STR) {
+                IrInst *in = add_inst(f, b->cur, IR_PRINT_STR, 0);
+                in->str = s->v.print.expr->v.str;
+                return;
+            }
+            IrVal v = build_expr(b, s->v.print.expr);
+            IrInst *in = add_inst(f, b->cur, IR_PRINT, 1);
+            in->args[0] = v;
+            return;
+        }
+        case ST_LET:
+        case ST_SET: {
+            const char *name = s->kind == ST_LET ? s->v.let.name : s->v.set.name;
+            IrVal v = build_expr(b, s->kind == ST_LET ? s->v.let.expr : s->v.set.expr);
+            IrInst *in = add_inst(f, b->cur, IR_COPY, 1);
+            in->dst = sym_find(b->st, name);
+            in->args[0] = v;
+            return;
+        }
+        case ST_IF: {
+            int from = b->cur;
+            int first = (int)f->count;
+            build_cond(b, s->v.ifs.cond, COND_THEN, COND_ELSE);
+            int cond_end = (int)f->count;
+            int then_b = new_block(f);
+            b->cur = then_b;
+            build_stmt(b, s->v.ifs.thenb);
+            int then_end = b->cur;
+            int else_b = -1;
+            int else_end = -1;
+            if (s->v.ifs.elseb) {
+                else_b = new_block(f);
+                b->cur = else_b;
+                build_stmt(b, s->v.ifs.elseb);
+                else_end = b->cur;
+            }
+            int join = new_block(f);
+            patch_cond(f, from, first, cond_end, then_b, else_b >= 0 ? else_b : join);
+            set_jmp(f, then_end, join);
+            if (else_end >= 0) set_jmp(f, else_end, join);
+            b->cur = join;
+            return;
+        }
+        case ST_REPEAT: {
+            IrVal n = build_expr(b, s->v.repeat.count);
+            int counter = new_temp(f);
+            IrInst *in = add_inst(f, b->cur, IR_COPY, 1);
+            in->dst = counter;
+            in->args[0] = n;
+            int head = new_block(f);
+            set_jmp(f, b->cur, head);
+            in = add_inst(f, head, IR_BIN, 2);
+            in->alu = OP_GT;
+            in->dst = new_temp(f);
+            in->args[0] = val_vreg(counter);
+            in->args[1] = val_imm(0);
+            IrVal test = val_vreg(in->dst);
+            int body = new_block(f);
+            b->cur = body;
+            build_stmt(b, s->v.repeat.body);
+            in = add_inst(f, b->cur, IR_BIN, 2);
+            in->alu = OP_SUB;
+            in->dst = counter;
+            in->args[0] = val_vreg(counter);
+            in->args[1] = val_imm(1);
+            set_jmp(f, b->cur, head);
+            int exit = new_block(f);
+            set_br(f, head, test, body, exit);
+            b->cur = exit;
+            return;
+        }
+        case ST_EXPR:
+            build_expr(b, s->v.expr.expr);
+            return;
+    }
+}
+
+IrFunc *ir_build(Stmt *prog, SymTab *st) {
+    IrFunc *f = (IrFunc *)xmalloc(sizeof(IrFunc));
+    memset(f, 0, sizeof(IrFunc));
+    f->nvars = (int)st->count;
+    f->nvregs = f->nvars;
+    IrBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.f = f;
+    b.st = st;
+    b.cur = new_block(f);
+    build_stmt(&b, prog);
+    return f;
+}
+
+/* ---- liveness ---- */
+
+int ir_is_live(const uint64_t *set, int v) {
+    return (int)((set[v / 64] >> (v % 64)) & 1);
+}
+
+
+static void live_set(uint64_t *set, int v) {
+    set[v / 64] |= (uint64_t)1 << (v % 64);
+}
+
+
+static int low_bit64(uint64_t m) {
+#ifdef _MSC_VER
+    unsigned long r;
+    _BitScanForward64(&r, m);
+    return (int)r;
+#else
+    return __builtin_ctzll(m);
+#endif
+}
+
+
+// the next bit at or after k in one of the block sets, -1 when there is none
+int ir_live_next(IrFunc *f, const uint64_t *set, int k) {
+    size_t w = (size_t)k / 64;
+    if (w >= f->live_words) return -1;
+    uint64_t bits = set[w] & (~(uint64_t)0 << (k % 64));
+    while (!bits) {
+        if (++w >= f->live_words) return -1;
+        bits = set[w];
+    }
+    return (int)w * 64 + low_bit64(bits);
+}
+
+
+// only a vreg some block reads before writing it can be live into any block,
+// most temporaries are made and used up inside one, so the sets are over just
+// those, numbered in vreg order so the variables come before the temps. all
+// four sets per block come out of one slab that stays allocated across calls.
+// the blocks go through a worklist in postorder, a block is only looked at
+// again when the live_in of a successor grew
+void ir_liveness(IrFunc *f) {
+    int n = f->nvregs;
+    size_t nb = f->count;
+    free(f->live_index);
+    free(f->live_vreg);
+    f->live_index = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    f->live_vreg = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int *def_in = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    for (int v = 0; v < n; v++) {
+        f->live_index[v] = -1;
+        def_in[v] = -1;
+    }
+    f->live_count = 0;
+#define EXPOSED(v, i) do { \
+        if (def_in[v] != (int)(i)) f->live_index[v] = 0; \
+    } while (0)
+    for (size_t i = 0; i < nb; i++) {
+        IrBlock *b = &f->blocks[i];
+        for (size_t j = 0; j < b->count; j++) {
+            IrInst *in = &b->insts[j];
+            for (size_t k = 0; k < in->argc; k++) {
+                if (in->args[k].kind == IRV_VREG) EXPOSED((int)in->args[k].v, i);
+            }
+            if (in->dst >= 0) def_in[in->dst] = (int)i;
+        }
+        if (b->term == TERM_BR && b->cond.kind == IRV_VREG) EXPOSED((int)b->cond.v, i);
+    }
+#undef EXPOSED
+    free(def_in);
+    for (int v = 0; v < n; v++) {
+        if (f->live_index[v] < 0) continue;
+        f->live_index[v] = f->live_count;
+        f->live_vreg[f->live_count++] = v;
+    }
+
+    size_t words = ((size_t)f->live_count + 63) / 64;
+    size_t need = nb * words * 4;
+    f->live_words = words;
+    if (!f->live_sets || need > f->live_sets_cap) {
+        free(f->live_sets);
+        f->live_sets = (uint64_t *)xmalloc(need * sizeof(uint64_t) + 8);
+        f->live_sets_cap = need;
+    }
+    memset(f->live_sets, 0, need * sizeof(uint64_t));
+    for (size_t i = 0; i < nb; i++) {
+        IrBlock *b = &f->blocks[i];
+        uint64_t *use = f->live_sets + (i * 4 + 2) * words;
+        uint64_t *def = use + words;
+        b->live_in = f->live_sets + i * 4 * words;
+        b->live_out = b->live_in + words;
+        for (size_t j = 0; j < b->count; j++) {
+            IrInst *in = &b->insts[j];
+            for (size_t k = 0; k < in->argc; k++) {
+                int x = in->args[k].kind == IRV_VREG ? f->live_index[in->args[k].v] : -1;
+                if (x >= 0 && !ir_is_live(def, x)) live_set(use, x);
+            }
+            if (in->dst >= 0 && f->live_index[in->dst] >= 0) live_set(def, f->live_index[in->dst]);
+        }
+        if (b->term == TERM_BR && b->cond.kind == IRV_VREG) {
+            int x = f->live_index[b->cond.v];
+            if (x >= 0 && !ir_is_live(def, x)) live_set(use, x);
+        }
+    }
+
+    // preds, then the blocks in postorder with anything unreachable after them
+    int *pred_start = (int *)xmalloc((nb + 2) * sizeof(int));
+    memset(pred_start, 0, (nb + 2) * sizeof(int));
+    for (size_t i = 0; i < nb; i++) {
+        for (int k = 0; k < 2; k++) {
+            if (f->blocks[i].succ[k] >= 0) pred_start[f->blocks[i].succ[k] + 2]++;
+        }
+    }
+    for (size_t i = 0; i < nb; i++) pred_start[i + 2] += pred_start[i + 1];
+    int *preds = (int *)xmalloc((size_t)pred_start[nb + 1] * sizeof(int) + sizeof(int));
+    for (size_t i = 0; i < nb; i++) {
+        for (int k = 0; k < 2; k++) {
+            if (f->blocks[i].succ[k] >= 0) preds[pred_start[f->blocks[i].succ[k] + 1]++] = (int)i;
+        }
+    }
+    int *queue = (int *)xmalloc(nb * sizeof(int) + sizeof(int));
+    int *stack = (int *)xmalloc(nb * sizeof(int) + sizeof(int));
+    int *next = (int *)xmalloc(nb * sizeof(int) + sizeof(int));
+    char *queued = (char *)xmalloc(nb + 1);
+    memset(queued, 0, nb + 1);
+    size_t tail = 0;
+    for (size_t r = 0; r < nb; r++) {
+        if (queued[r]) continue;
+        int sp = 0;
+        stack[sp++] = (int)r;
+        next[r] = 0;
+        queued[r] = 1;
+        while (sp > 0) {
+            int x = stack[sp - 1];
+            if (next[x] < 2) {
+                int s = f->blocks[x].succ[next[x]++];
+                if (s >= 0 && !queued[s]) {
+                    queued[s] = 1;
+                    next[s] = 0;
+                    stack[sp++] = s;
+                }
+                continue;
+            }
+            queue[tail++] = x;
+            sp--;
+        }
+    }
+
+    size_t head = 0, len = nb;
+    while (len > 0) {
+        int i = queue[head];
+        head = (head + 1) % nb;
+        len--;
+        queued[i] = 0;
+        IrBlock *b = &f->blocks[i];
+        uint64_t *use = f->live_sets + ((size_t)i * 4 + 2) * words;
+        uint64_t *def = use + words;
+        int grew = 0;
+        for (size_t w = 0; w < words; w++) {
+            uint64_t out = 0;
+            for (int k = 0; k < 2; k++) {
+                if (b->succ[k] >= 0) out |= f->blocks[b->succ[k]].live_in[w];
+            }
+            uint64_t in = use[w] | (out & ~def[w]);
+            if (in != b->live_in[w]) grew = 1;
+            b->live_out[w] = out;
+            b->live_in[w] = in;
+        }
+        if (!grew) continue;
+        for (int k = pred_start[i]; k < pred_start[i + 1]; k++) {
+            int p = preds[k];
+            if (queued[p]) continue;
+            queued[p] = 1;
+            queue[(head + len) % nb] = p;
+            len++;
+        }
+    }
+    free(pred_start);
+    free(preds);
+    free(queue);
+    free(stack);
+    free(next);
+    free(queued);
+}
+
+/* ---- optimizations ---- */
+
+static int *count_defs(IrFunc *f) {
+    int *defs = (int *)xmalloc((size_t)f->nvregs * sizeof(int) + 1);
+    memset(defs, 0, (size_t)f->nvregs * sizeof(int));
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        for (size_t j = 0; j < b->count; j++) {
+            if (b->insts[j].dst >= 0) defs[b->insts[j].dst]++;
+        }
+    }
+    return defs;
+}
+
+
+// reads of each vreg, branch conditions included. gen_ir wants it too
+int *ir_count_uses(IrFunc *f) {
+    int *uses = (int *)xmalloc((size_t)f->nvregs * sizeof(int) + 1);
+    memset(uses, 0, (size_t)f->nvregs * sizeof(int));
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        for (size_t j = 0; j < b->count; j++) {
+            IrInst *in = &b->insts[j];
+            for (size_t k = 0; k < in->argc; k++) {
+                if (in->args[k].kind == IRV_VREG) uses[in->args[k].v]++;
+            }
+        }
+        if (b->term == TERM_BR && b->cond.kind == IRV_VREG) uses[b->cond.v]++;
+    }
+    return uses;
+}
+
+
+static int is_imm(IrVal v, int64_t x) {
+    return v.kind == IRV_IMM && v.v == x;
+}
+
+
+static void make_copy(IrInst *in, IrVal v) {
+    in->op = IR_COPY;
+    in->argc = 1;
+    in->args[0] = v;
+}
+
+// folds one instruction in place, returns 1 if it changed
+static int fold_inst(IrInst *in) {
+    if (in->op == IR_UNARY && in->args[0].kind == IRV_IMM) {
+        int64_t a = in->args[0].v;
+        if (in->alu == OP_NEG) make_copy(in, val_imm((int64_t)(0 - (uint64_t)a)));
+        else make_copy(in, val_imm(a == 0));
+        return 1;
+    }
+    if (in->op != IR_BIN) return 0;
+    IrVal l = in->args[0];
+    IrVal r = in->args[1];
+    if (l.kind == IRV_IMM && r.kind == IRV_IMM) {
+        int64_t a = l.v;
+        int64_t b = r.v;
+        int64_t v;
+        switch (in->alu) {
+            case OP_ADD: v = (int64_t)((uint64_t)a + (uint64_t)b); break;
+            case OP_SUB: v = (int64_t)((uint64_t)a - (uint64_t)b); break;
+            case OP_MUL: v = (int64_t)((uint64_t)a * (uint64_t)b); break;
+            case OP_DIV:
+                // leave the trapping cases to the cpu
+                if (b == 0 || (a == INT64_MIN && b == -1)) return 0;
+                v = a / b;
+                break;
+            case OP_SHL: v = (int64_t)((uint64_t)a << b); break;
+            case OP_DIV_POW2: v = a / ((int64_t)1 << b); break;
+            case OP_DIV_CONST: v = a / b; break;
+            case OP_EQ: v = a == b; break;
+            case OP_NE: v = a != b; break;
+            case OP_LT: v = a < b; break;
+            case OP_GT: v = a > b; break;
+            case OP_LE: v = a <= b; break;
+            case OP_GE: v = a >= b; break;
+            default: return 0;
+        }
+        make_copy(in, val_imm(v));
+        return 1;
+    }
+    switch (in->alu) {
+        case OP_ADD:
+            if (is_imm(r, 0)) { make_copy(in, l); return 1; }
+            if (is_imm(l, 0)) { make_copy(in, r); return 1; }
+            return 0;
+        case OP_SUB:
+            if (is_imm(r, 0)) { make_copy(in, l); return 1; }
+            return 0;
+        case OP_MUL:
+            if (is_imm(r, 1)) { make_copy(in, l); return 1; }
+            if (is_imm(l, 1)) { make_copy(in, r); return 1; }
+            if (is_imm(r, 0) || is_imm(l, 0)) { make_copy(in, val_imm(0)); return 1; }
+            break;
+        case OP_DIV:
+            if (is_imm(r, 1)) { make_copy(in, l); return 1; }
+            break;
+        default:
+            break;
+    }
+    // constants that only showed up after propagation get the same treatment as in fold.c
+    if (in->alu == OP_MUL && l.kind == IRV_IMM) {
+        in->args[0] = r;
+        in->args[1] = l;
+        r = l;
+    }
+    if (r.kind == IRV_IMM) {
+        OpKind op = in->alu;
+        int64_t v = r.v;
+        if (strength_reduce(&op, &v)) {
+            in->alu = op;
+            in->args[1] = val_imm(v);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// constant propagation: single-def temporaries everywhere, anything else within its block
+static int fold_constants(IrFunc *f) {
+    int changed = 0;
+    int n = f->nvregs;
+    int *defs = count_defs(f);
+    char *gknown = (char *)xmalloc((size_t)n + 1);
+    int64_t *gval = (int64_t *)xmalloc((size_t)n * sizeof(int64_t) + 8);
+    size_t *stamp = (size_t *)xmalloc((size_t)n * sizeof(size_t) + 8);
+    int64_t *lval = (int64_t *)xmalloc((size_t)n * sizeof(int64_t) + 8);
+    memset(gknown, 0, (size_t)n);
+    memset(stamp, 0, (size_t)n * sizeof(size_t));
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        for (size_t j = 0; j < b->count; j++) {
+            IrInst *in = &b->insts[j];
+            if (in->op == IR_COPY && in->dst >= f->nvars && defs[in->dst] == 1 && in->args[0].kind == IRV_IMM) {
+                gknown[in->dst] = 1;
+                gval[in->dst] = in->args[0].v;
+            }
+        }
+    }
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        size_t cur = i + 1;
+        for (size_t j = 0; j < b->count; j++) {
+            IrInst *in = &b->insts[j];
+            for (size_t k = 0; k < in->argc; k++) {
+                IrVal *a = &in->args[k];
+                if (a->kind != IRV_VREG) continue;
+                if (gknown[a->v]) {
+                    *a = val_imm(gval[a->v]);
+                    changed = 1;
+                } else if (stamp[a->v] == cur) {
+                    *a = val_imm(lval[a->v]);
+                    changed = 1;
+                }
+            }
+            if (fold_inst(in)) changed = 1;
+            if (in->dst >= 0) {
+                if (in->op == IR_COPY && in->args[0].kind == IRV_IMM) {
+                    stamp[in->dst] = cur;
+                    lval[in->dst] = in->args[0].v;
+                } else {
+                    stamp[in->dst] = 0;
+                }
+            }
+        }
+        if (b->term == TERM_BR && b->cond.kind == IRV_VREG) {
+            if (gknown[b->cond.v]) {
+                b->cond = val_imm(gval[b->cond.v]);
+                changed = 1;
+            } else if (stamp[b->cond.v] == cur) {
+                b->cond = val_imm(lval[b->cond.v]);
+                changed = 1;
+            }
+        }
+    }
+    free(defs);
+    free(gknown);
+    free(gval);
+    free(stamp);
+    free(lval);
+    return changed;
+}
+
+// "t = op ...; x = t" with t used only there becomes "x = op ..."
+static int coalesce_copies(IrFunc *f) {
+    int changed = 0;
+    int *defs = count_defs(f);
+    int *uses = ir_count_uses(f);
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        size_t o = 0;
+        for (size_t j = 0; j < b->count; j++) {
+            IrInst *in = &b->insts[j];
+            if (j + 1 < b->count && in->dst >= f->nvars && defs[in->dst] == 1 && uses[in->dst] == 1) {
+                IrInst *next = &b->insts[j + 1];
+                if (next->op == IR_COPY && next->args[0].kind == IRV_VREG && next->args[0].v == in->dst) {
+                    in->dst = next->dst;
+                    b->insts[o++] = *in;
+                    j++;
+                    changed = 1;
+                    continue;
+                }
+            }
+            b->insts[o++] = *in;
+        }
+        b->count = o;
+    }
+    free(defs);
+    free(uses);
+    return changed;
+}
+
+
+static int is_pure(IrInst *in) {
+    switch (in->op) {
+        case IR_COPY:
+        case IR_UNARY:
+        case IR_ADDR:
+        case IR_LOAD:
+        case IR_VSUM:
+            return 1;
+        case IR_BIN:
+            if (in->alu != OP_DIV) return 1;
+            return in->args[1].kind == IRV_IMM && in->args[1].v != 0 && in->args[1].v != -1;
+        case IR_CALL:
+            return in->fn == BI_LIST_NEW || in->fn == BI_ARRAY_NEW || in->fn == BI_LEN || in->fn == BI_RANGE;
+        default:
+            return 0;
+    }
+}
+
+static int dead_code(IrFunc *f) {
+    int changed = 0;
+    ir_liveness(f);
+    // per vreg while scanning a block backward: 0 nothing seen yet so live_out
+    // decides, 1 read further down, 2 written further down and not read before it.
+    // every block puts back the zeros it touched
+    char *seen = (char *)xmalloc((size_t)f->nvregs + 1);
+    memset(seen, 0, (size_t)f->nvregs + 1);
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        if (b->term == TERM_BR && b->cond.kind == IRV_VREG) seen[b->cond.v] = 1;
+        size_t keep = b->count;
+        char *dead = (char *)xmalloc(b->count + 1);
+        memset(dead, 0, b->count + 1);
+        for (size_t j = b->count; j-- > 0;) {
+            IrInst *in = &b->insts[j];
+            int d = in->dst;
+            if (d >= 0 && seen[d] != 1
+                && (seen[d] == 2 || f->live_index[d] < 0 || !ir_is_live(b->live_out, f->live_index[d]))) {
+                if (is_pure(in)) {
+                    dead[j] = 1;
+                    keep--;
+                    changed = 1;
+                    continue;
+                }
+                in->dst = -1;
+            }
+            if (in->dst >= 0) seen[in->dst] = 2;
+            for (size_t k = 0; k < in->argc; k++) {
+                if (in->args[k].kind == IRV_VREG) seen[in->args[k].v] = 1;
+            }
+        }
+        for (size_t j = 0; j < b->count; j++) {
+            IrInst *in = &b->insts[j];
+            if (in->dst >= 0) seen[in->dst] = 0;
+            for (size_t k = 0; k < in->argc; k++) {
+                if (in->args[k].kind == IRV_VREG) seen[in->args[k].v] = 0;
+            }
+        }
+        if (b->term == TERM_BR && b->cond.kind == IRV_VREG) seen[b->cond.v] = 0;
+        if (keep != b->count) {
+            size_t o = 0;
+            for (size_t j = 0; j < b->count; j++) {
+                if (!dead[j]) b->insts[o++] = b->insts[j];
+            }
+            b->count = o;
+        }
+        free(dead);
+    }
+    free(seen);
+    return changed;
+}
+
+
+static int simplify_branches(IrFunc *f) {
+    int changed = 0;
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        if (b->term != TERM_BR) continue;
+        if (b->cond.kind == IRV_IMM) {
+            set_jmp(f, (int)i, b->cond.v ? b->succ[0] : b->succ[1]);
+            changed = 1;
+        } else if (b->succ[0] == b->succ[1]) {
+            set_jmp(f, (int)i, b->succ[0]);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// jumps into an empty block that only jumps on go straight to its target
+static int thread_jumps(IrFunc *f) {
+    int changed = 0;
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        int n = b->term == TERM_BR ? 2 : (b->term == TERM_JMP ? 1 : 0);
+        for (int k = 0; k < n; k++) {
+            int t = b->succ[k];
+            for (size_t hops = 0; hops < f->count; hops++) {
+                IrBlock *tb = &f->blocks[t];
+                if (tb->count != 0 || tb->term != TERM_JMP || tb->succ[0] == t) break;
+                t = tb->succ[0];
+            }
+            if (t != b->succ[k]) {
+                b->succ[k] = t;
+                changed = 1;
+            }
+        }
+    }
+    return changed;
+}
+
+
+static int *count_preds(IrFunc *f) {
+    int *preds = (int *)xmalloc(f->count * sizeof(int) + 1);
+    memset(preds, 0, f->count * sizeof(int));
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        if (b->term == TERM_JMP) preds[b->succ[0]]++;
+        if (b->term == TERM_BR) {
+            preds[b->succ[0]]++;
+            preds[b->succ[1]]++;
+        }
+    }
+    return preds;
+}
+
+// a block reached only by one unconditional jump is glued onto its predecessor
+static int merge_blocks(IrFunc *f) {
+    int changed = 0;
+    int *preds = count_preds(f);
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        while (b->term == TERM_JMP) {
+            int c = b->succ[0];
+            if (c == 0 || c == (int)i || preds[c] != 1) break;
+            IrBlock *cb = &f->blocks[c];
+            for (size_t j = 0; j < cb->count; j++) {
+                IrInst *in = add_inst(f, (int)i, IR_COPY, 0);
+                *in = cb->insts[j];
+            }
+            b = &f->blocks[i];
+            cb = &f->blocks[c];
+            b->term = cb->term;
+            b->cond = cb->cond;
+            b->succ[0] = cb->succ[0];
+            b->succ[1] = cb->succ[1];
+            cb->count = 0;
+            set_jmp(f, c, c);
+            preds[c] = 0;
+            changed = 1;
+        }
+    }
+    free(preds);
+    return changed;
+}
+
+
+static void mark_reachable(IrFunc *f, int n, char *seen) {
+    int *stack = (int *)xmalloc(f->count * 2 * sizeof(int) + sizeof(int));
+    size_t sp = 0;
+    stack[sp++] = n;
+    while (sp > 0) {
+        int b = stack[--sp];
+        if (seen[b]) continue;
+        seen[b] = 1;
+        IrBlock *bb = &f->blocks[b];
+        if (bb->term == TERM_JMP || bb->term == TERM_BR) stack[sp++] = bb->succ[0];
+        if (bb->term == TERM_BR) stack[sp++] = bb->succ[1];
+    }
+    free(stack);
+}
+
+static int remove_unreachable(IrFunc *f) {
+    char *seen = (char *)xmalloc(f->count + 1);
+    memset(seen, 0, f->count + 1);
+    mark_reachable(f, 0, seen);
+    int *remap = (int *)xmalloc(f->count * sizeof(int) + 1);
+    size_t o = 0;
+    for (size_t i = 0; i < f->count; i++) {
+        if (seen[i]) {
+            remap[i] = (int)o;
+            f->blocks[o++] = f->blocks[i];
+        } else {
+            free(f->blocks[i].insts);
+            remap[i] = -1;
+        }
+    }
+    int changed = o != f->count;
+    f->count = o;
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        if (b->succ[0] >= 0) b->succ[0] = remap[b->succ[0]];
+        if (b->succ[1] >= 0) b->succ[1] = remap[b->succ[1]];
+    }
+    free(seen);
+    free(remap);
+    return changed;
+}
+
+/* ---- loops ---- */
+
+// every edge into a block from itself or a later one is a back edge, ir_build
+// only ever jumps backwards to the head of a repeat
+typedef struct {
+    IrFunc *f;
+    int *pred_start;    // preds of block b are preds[pred_start[b] .. pred_start[b + 1])
+    int *preds;
+    int *mark;          // == stamp for the blocks of the current loop
+    int *body;
+    size_t nbody;
+    int stamp;
+} Loops;
+
+static void loops_init(Loops *L, IrFunc *f) {
+    L->f = f;
+    L->pred_start = (int *)xmalloc((f->count + 1) * sizeof(int));
+    L->preds = (int *)xmalloc(f->count * 2 * sizeof(int) + sizeof(int));
+    L->mark = (int *)xmalloc(f->count * sizeof(int) + sizeof(int));
+    L->body = (int *)xmalloc(f->count * sizeof(int) + sizeof(int));
+    L->nbody = 0;
+    L->stamp = 0;
+    memset(L->pred_start, 0, (f->count + 1) * sizeof(int));
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        int n = b->term == TERM_BR ? 2 : (b->term == TERM_JMP ? 1 : 0);
+        for (int k = 0; k < n; k++) L->pred_start[b->succ[k] + 1]++;
+        L->mark[i] = -1;
+    }
+    for (size_t i = 0; i < f->count; i++) L->pred_start[i + 1] += L->pred_start[i];
+    int *fill = (int *)xmalloc(f->count * sizeof(int) + sizeof(int));
+    memcpy(fill, L->pred_start, f->count * sizeof(int));
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        int n = b->term == TERM_BR ? 2 : (b->term == TERM_JMP ? 1 : 0);
+        for (int k = 0; k < n; k++) L->preds[fill[b->succ[k]]++] = (int)i;
+    }
+    free(fill);
+}
+
+
+static void loops_free(Loops *L) {
+    free(L->pred_start);
+    free(L->preds);
+    free(L->mark);
+    free(L->body);
+}
+
+
+static int cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// collects the loop headed by h into body (sorted, h first), walking back from
+// every back edge. 0 when h heads no loop or the entry can sneak in around it
+static int find_loop(Loops *L, int h) {
+    int stamp = ++L->stamp;
+    size_t n = 0;
+    L->mark[h] = stamp;
+    L->body[n++] = h;
+    for (int k = L->pred_start[h]; k < L->pred_start[h + 1]; k++) {
+        int l = L->preds[k];
+        if (l < h || L->mark[l] == stamp) continue;
+        L->mark[l] = stamp;
+        L->body[n++] = l;
+    }
+    if (n == 1) {
+        int self = 0;
+        for (int k = L->pred_start[h]; k < L->pred_start[h + 1]; k++) self |= L->preds[k] == h;
+        if (!self) return 0;
+    }
+    for (size_t i = 1; i < n; i++) {
+        int b = L->body[i];
+        for (int k = L->pred_start[b]; k < L->pred_start[b + 1]; k++) {
+            int q = L->preds[k];
+            if (L->mark[q] == stamp) continue;
+            if (q == 0) return 0;
+            L->mark[q] = stamp;
+            L->body[n++] = q;
+        }
+    }
+    qsort(L->body, n, sizeof(int), cmp_int);
+    L->nbody = n;
+    return 1;
+}
+
+// how many loops each block sits in, regalloc weighs uses with it
+int *ir_loop_depth(IrFunc *f) {
+    int *depth = (int *)xmalloc(f->count * sizeof(int) + sizeof(int));
+    memset(depth, 0, f->count * sizeof(int));
+    Loops L;
+    loops_init(&L, f);
+    for (size_t h = 0; h < f->count; h++) {
+        if (!find_loop(&L, (int)h)) continue;
+        for (size_t i = 0; i < L.nbody; i++) depth[L.body[i]]++;
+    }
+    loops_free(&L);
+    return depth;
+}
+
+// safe to run once up front even if the loop never does: no traps, no allocations.
+// the length only stays put when nothing in the loop pushes or pops
+static int is_invariant_op(IrInst *in, int resizes) {
+    switch (in->op) {
+        case IR_COPY:
+        case IR_UNARY:
+            return 1;
+        case IR_BIN:
+            if (in->alu != OP_DIV) return 1;
+            return in->args[1].kind == IRV_IMM && in->args[1].v != 0 && in->args[1].v != -1;
+        case IR_CALL:
+            return in->fn == BI_LEN && !resizes;
+        default:
+            return 0;
+    }
+}
+
+
+static int is_step(IrInst *in, int v) {
+    return in->op == IR_BIN && in->dst == v && (in->alu == OP_ADD || in->alu == OP_SUB)
+        && in->args[0].kind == IRV_VREG && in->args[0].v == v && in->args[1].kind == IRV_IMM
+        && in->args[1].v >= -((int64_t)1 << 40) && in->args[1].v <= ((int64_t)1 << 40);
+}
+
+typedef struct {
+    int *defs;      // definitions in the whole function
+    int *uses;
+    int *ldefs;     // definitions inside the current loop, where lstamp matches
+    int *lstamp;
+    int cap;
+} LoopDefs;
+
+static int loop_defs(LoopDefs *d, int stamp, int v) {
+    return d->lstamp[v] == stamp ? d->ldefs[v] : 0;
+}
+
+
+static void grow_defs(LoopDefs *d, int n) {
+    if (n <= d->cap) return;
+    int nc = d->cap * 2 > n ? d->cap * 2 : n;
+    d->defs = (int *)realloc(d->defs, (size_t)nc * sizeof(int));
+    d->ldefs = (int *)realloc(d->ldefs, (size_t)nc * sizeof(int));
+    d->lstamp = (int *)realloc(d->lstamp, (size_t)nc * sizeof(int));
+    d->uses = (int *)realloc(d->uses, (size_t)nc * sizeof(int));
+    if (!d->defs || !d->ldefs || !d->lstamp || !d->uses) die("out of memory");
+    for (int v = d->cap; v < nc; v++) {
+        d->defs[v] = 2;
+        d->uses[v] = 2;
+        d->lstamp[v] = -1;
+    }
+    d->cap = nc;
+}
+
+static int is_invariant(LoopDefs *d, int stamp, IrVal v) {
+    return v.kind == IRV_IMM || !loop_defs(d, stamp, (int)v.v);
+}
+
+
+// "x = get xs, i" with xs fixed and x used once
+static int is_walk_get(LoopDefs *d, int stamp, IrInst *in, int iv) {
+    return in->op == IR_CALL && in->fn == BI_GET && in->args[0].kind == IRV_VREG
+        && is_invariant(d, stamp, in->args[0]) && in->args[1].kind == IRV_VREG && in->args[1].v == iv
+        && in->dst >= 0 && d->defs[in->dst] == 1 && d->uses[in->dst] == 1;
+}
+
+
+static int is_walk_set(LoopDefs *d, int stamp, IrInst *in, int iv) {
+    return in->op == IR_CALL && in->fn == BI_SET && in->args[0].kind == IRV_VREG
+        && is_invariant(d, stamp, in->args[0]) && in->args[1].kind == IRV_VREG && in->args[1].v == iv;
+}
+
+
+static IrInst *add_vec(IrFunc *f, int block, IrOp op, int dst, size_t argc) {
+    IrInst *in = add_inst(f, block, op, argc);
+    in->dst = dst;
+    return in;
+}
+
+
+static IrVal list_addr(IrFunc *f, LoopDefs *d, int block, IrVal xs, int iv) {
+    int p = new_temp(f);
+    grow_defs(d, f->nvregs);
+    IrInst *in = add_vec(f, block, IR_ADDR, p, 2);
+    in->args[0] = xs;
+    in->args[1] = val_vreg(iv);
+    return val_vreg(p);
+}
+
+// a single-block repeat stepping i by one that only fills, maps or sums list
+// elements at i becomes one vector instruction over the remaining count.
+// the body only runs with the counter above zero, so it is the trip count
+static int vectorize_loop(Loops *L, LoopDefs *d, int h) {
+    IrFunc *f = L->f;
+    int stamp = L->stamp;
+    if (L->nbody != 2 || L->body[0] != h) return 0;
+    int bi = L->body[1];
+    IrBlock *hb = &f->blocks[h];
+    IrBlock *b = &f->blocks[bi];
+    if (hb->count != 1 || hb->term != TERM_BR || hb->succ[0] != bi) return 0;
+    if (b->term != TERM_JMP || b->succ[0] != h || b->count < 3) return 0;
+    IrInst *test = &hb->insts[0];
+    if (test->op != IR_BIN || test->alu != OP_GT || !is_imm(test->args[1], 0) || test->args[0].kind != IRV_VREG) return 0;
+    if (hb->cond.kind != IRV_VREG || hb->cond.v != test->dst) return 0;
+    int c = (int)test->args[0].v;
+    IrInst *dec = &b->insts[b->count - 1];
+    IrInst *step = &b->insts[b->count - 2];
+    if (!is_step(dec, c) || dec->alu != OP_SUB || !is_imm(dec->args[1], 1)) return 0;
+    int iv = step->dst;
+    if (iv < 0 || iv == c || !is_step(step, iv) || step->alu != OP_ADD || !is_imm(step->args[1], 1)) return 0;
+    if (loop_defs(d, stamp, iv) != 1 || loop_defs(d, stamp, c) != 1) return 0;
+
+    IrInst *in = b->insts;
+    size_t k = b->count - 2;
+    IrOp op;
+    OpKind alu = OP_ADD;
+    IrVal lists[3];
+    IrVal val = val_imm(0);
+    int sum = -1;
+    if (k == 1 && is_walk_set(d, stamp, &in[0], iv)) {
+        // xs[i] = i or xs[i] = something fixed
+        lists[0] = in[0].args[0];
+        val = in[0].args[2];
+        if (val.kind == IRV_VREG && val.v == iv) op = IR_VIOTA;
+        else if (is_invariant(d, stamp, val)) op = IR_VFILL;
+        else return 0;
+    } else if (k == 2 && is_walk_get(d, stamp, &in[0], iv)) {
+        // s = s + xs[i]
+        int x = in[0].dst;
+        IrInst *acc = &in[1];
+        if (acc->op != IR_BIN || acc->alu != OP_ADD || acc->dst < 0) return 0;
+        sum = acc->dst;
+        IrVal other = acc->args[0].kind == IRV_VREG && acc->args[0].v == x ? acc->args[1] : acc->args[0];
+        if (other.kind != IRV_VREG || other.v != sum || sum == iv || sum == c || sum == x) return 0;
+        if (!((acc->args[0].kind == IRV_VREG && acc->args[0].v == x) || (acc->args[1].kind == IRV_VREG && acc->args[1].v == x))) return 0;
+        if (loop_defs(d, stamp, sum) != 1) return 0;
+        op = IR_VSUM;
+        lists[0] = in[0].args[0];
+        val = val_vreg(x);
+    } else if (k == 4 && is_walk_get(d, stamp, &in[0], iv) && is_walk_get(d, stamp, &in[1], iv)
+               && is_walk_set(d, stamp, &in[3], iv)) {
+        // out[i] = a[i] op b[i]
+        IrInst *bin = &in[2];
+        if (bin->op != IR_BIN || (bin->alu != OP_ADD && bin->alu != OP_SUB && bin->alu != OP_MUL)) return 0;
+        if (bin->dst < 0 || d->defs[bin->dst] != 1 || d->uses[bin->dst] != 1) return 0;
+        if (in[3].args[2].kind != IRV_VREG || in[3].args[2].v != bin->dst) return 0;
+        int x = in[0].dst;
+        int y = in[1].dst;
+        if (x == y || bin->args[0].kind != IRV_VREG || bin->args[1].kind != IRV_VREG) return 0;
+        if (bin->args[0].v == x && bin->args[1].v == y) {
+            lists[1] = in[0].args[0];
+            lists[2] = in[1].args[0];
+        } else if (bin->args[0].v == y && bin->args[1].v == x) {
+            lists[1] = in[1].args[0];
+            lists[2] = in[0].args[0];
+        } else {
+            return 0;
+        }
+        op = IR_VMAP;
+        alu = bin->alu;
+        lists[0] = in[3].args[0];
+    } else {
+        return 0;
+    }
+
+    IrInst acc = op == IR_VSUM ? in[1] : in[0];
+    int exit = hb->succ[1];
+    free(b->insts);
+    b->insts = 0;
+    b->count = 0;
+    b->cap = 0;
+    IrVal n = val_vreg(c);
+    IrVal dst = list_addr(f, d, bi, lists[0], iv);
+    IrInst *v;
+    switch (op) {
+        case IR_VFILL:
+        case IR_VIOTA:
+            v = add_vec(f, bi, op, -1, 3);
+            v->args[0] = dst;
+            v->args[1] = val;
+            v->args[2] = n;
+            break;
+        case IR_VMAP: {
+            IrVal a = list_addr(f, d, bi, lists[1], iv);
+            IrVal bb = list_addr(f, d, bi, lists[2], iv);
+            v = add_vec(f, bi, op, -1, 4);
+            v->alu = alu;
+            v->args[0] = dst;
+            v->args[1] = a;
+            v->args[2] = bb;
+            v->args[3] = n;
+            break;
+        }
+        default:
+            v = add_vec(f, bi, op, (int)val.v, 2);
+            v->args[0] = dst;
+            v->args[1] = n;
+            *add_inst(f, bi, IR_COPY, 0) = acc;
+            break;
+    }
+    v = add_vec(f, bi, IR_BIN, iv, 2);
+    v->alu = OP_ADD;
+    v->args[0] = val_vreg(iv);
+    v->args[1] = n;
+    set_jmp(f, bi, exit);
+    return 1;
+}
+
+// invariant pure instructions move to the preheader, whole element-wise loops turn
+// into vector instructions, and otherwise xs[i] with xs fixed and i only ever
+// stepped by constants becomes a load through a pointer stepped alongside
+static int optimize_loop(Loops *L, LoopDefs *d, int h) {
+    IrFunc *f = L->f;
+    int stamp = L->stamp;
+    int pre = -1;
+    for (int k = L->pred_start[h]; k < L->pred_start[h + 1]; k++) {
+        int q = L->preds[k];
+        if (L->mark[q] == stamp) continue;
+        if (pre >= 0 && pre != q) return 0;
+        pre = q;
+    }
+    if (pre < 0 || f->blocks[pre].term != TERM_JMP) return 0;
+
+    int resizes = 0;
+    int moves = 0;
+    for (size_t i = 0; i < L->nbody; i++) {
+        IrBlock *b = &f->blocks[L->body[i]];
+        for (size_t j = 0; j < b->count; j++) {
+            IrInst *in = &b->insts[j];
+            if (in->dst >= 0) {
+                if (d->lstamp[in->dst] != stamp) {
+                    d->lstamp[in->dst] = stamp;
+                    d->ldefs[in->dst] = 0;
+                }
+                d->ldefs[in->dst]++;
+            }
+            if (in->op == IR_CALL && (in->fn == BI_PUSH || in->fn == BI_POP)) resizes = 1;
+            if (in->op == IR_CALL && (in->fn == BI_PUSH || in->fn == BI_RESERVE)) moves = 1;
+        }
+    }
+
+    int changed = 0;
+    for (int again = 1; again;) {
+        again = 0;
+        for (size_t i = 0; i < L->nbody; i++) {
+            int bi = L->body[i];
+            size_t o = 0;
+            for (size_t j = 0; j < f->blocks[bi].count; j++) {
+                IrInst in = f->blocks[bi].insts[j];
+                int ok = in.dst >= f->nvars && d->defs[in.dst] == 1 && is_invariant_op(&in, resizes);
+                for (size_t k = 0; ok && k < in.argc; k++) {
+                    if (in.args[k].kind == IRV_VREG && loop_defs(d, stamp, (int)in.args[k].v)) ok = 0;
+                }
+                if (ok) {
+                    *add_inst(f, pre, IR_COPY, 0) = in;
+                    d->ldefs[in.dst] = 0;
+                    again = changed = 1;
+                    continue;
+                }
+                f->blocks[bi].insts[o++] = in;
+            }
+            f->blocks[bi].count = o;
+        }
+    }
+
+    if (vectorize_loop(L, d, h)) return 1;
+    if (moves) return changed;
+    for (;;) {
+        IrInst *get = 0;
+        for (size_t i = 0; i < L->nbody && !get; i++) {
+            IrBlock *b = &f->blocks[L->body[i]];
+            for (size_t j = 0; j < b->count && !get; j++) {
+                IrInst *in = &b->insts[j];
+                if (in->op != IR_CALL || in->fn != BI_GET) continue;
+                if (in->args[0].kind != IRV_VREG || in->args[1].kind != IRV_VREG) continue;
+                int xs = (int)in->args[0].v;
+                int iv = (int)in->args[1].v;
+                if (loop_defs(d, stamp, xs) || !loop_defs(d, stamp, iv)) continue;
+                int stepped = 0;
+                int other = 0;
+                for (size_t i2 = 0; i2 < L->nbody; i2++) {
+                    IrBlock *b2 = &f->blocks[L->body[i2]];
+                    for (size_t j2 = 0; j2 < b2->count; j2++) {
+                        if (b2->insts[j2].dst != iv) continue;
+                        if (is_step(&b2->insts[j2], iv)) stepped++;
+                        else other++;
+                    }
+                }
+                if (stepped && !other) get = in;
+            }
+        }
+        if (!get) break;
+
+        IrVal xs = get->args[0];
+        IrVal iv = get->args[1];
+        int p = new_temp(f);
+        grow_defs(d, f->nvregs);
+        IrInst *addr = add_inst(f, pre, IR_ADDR, 2);
+        addr->dst = p;
+        addr->args[0] = xs;
+        addr->args[1] = iv;
+        for (size_t i = 0; i < L->nbody; i++) {
+            int bi = L->body[i];
+            size_t n = f->blocks[bi].count;
+            IrInst *old = f->blocks[bi].insts;
+            f->blocks[bi].insts = 0;
+            f->blocks[bi].count = 0;
+            f->blocks[bi].cap = 0;
+            for (size_t j = 0; j < n; j++) {
+                IrInst *in = add_inst(f, bi, IR_COPY, 0);
+                *in = old[j];
+                if (in->op == IR_CALL && in->fn == BI_GET && in->args[0].v == xs.v && in->args[1].v == iv.v
+                    && in->args[0].kind == IRV_VREG && in->args[1].kind == IRV_VREG) {
+                    // dead_code leaves an unused get in place, it might be out of
+                    // range. on the walk it cant be, so it just goes
+                    if (in->dst < 0) {
+                        f->blocks[bi].count--;
+                        continue;
+                    }
+                    in->op = IR_LOAD;
+                    in->fn = BI_NONE;
+                    in->argc = 1;
+                    in->args[0] = val_vreg(p);
+                } else if (in->dst == iv.v && is_step(in, (int)iv.v)) {
+                    IrInst *step = add_inst(f, bi, IR_BIN, 2);
+                    step->alu = in->alu;
+                    step->dst = p;
+                    step->args[0] = val_vreg(p);
+                    step->args[1] = val_imm(in->args[1].v * 8);
+                }
+            }
+            free(old);
+        }
+        changed = 1;
+    }
+    return changed;
+}
+
+// inner loops go first so what they hoist can keep moving out
+static int optimize_loops(IrFunc *f) {
+    int changed = 0;
+    LoopDefs d = {0, 0, 0, 0, 0};
+    grow_defs(&d, f->nvregs);
+    int *defs = count_defs(f);
+    int *uses = ir_count_uses(f);
+    // grow_defs leaves them null for an empty program
+    if (f->nvregs) {
+        memcpy(d.defs, defs, (size_t)f->nvregs * sizeof(int));
+        memcpy(d.uses, uses, (size_t)f->nvregs * sizeof(int));
+    }
+    free(defs);
+    free(uses);
+    Loops L;
+    loops_init(&L, f);
+    for (size_t h = f->count; h-- > 0;) {
+        if (find_loop(&L, (int)h)) changed |= optimize_loop(&L, &d, (int)h);
+    }
+    loops_free(&L);
+    free(d.defs);
+    free(d.ldefs);
+    free(d.lstamp);
+    free(d.uses);
+    return changed;
+}
+
+static void cleanup(IrFunc *f) {
+    for (int round = 0; round < 16; round++) {
+        int changed = 0;
+        changed |= fold_constants(f);
+        changed |= coalesce_copies(f);
+        changed |= simplify_branches(f);
+        changed |= thread_jumps(f);
+        changed |= merge_blocks(f);
+        changed |= remove_unreachable(f);
+        changed |= dead_code(f);
+        if (!changed) break;
+    }
+}
+
+
+void ir_optimize(IrFunc *f) {
+    cleanup(f);
+    if (optimize_loops(f)) cleanup(f);
+}
+
+/* ---- text dump ---- */
+
+static const char *alu_name(OpKind op) {
+    switch (op) {
+        case OP_ADD: return "add";
+        case OP_SUB: return "sub";
+        case OP_MUL: return "mul";
+        case OP_DIV: return "div";
+        case OP_EQ: return "eq";
+        case OP_NE: return "ne";
+        case OP_LT: return "lt";
+        case OP_GT: return "gt";
+        case OP_LE: return "le";
+        case OP_GE: return "ge";
+        case OP_NEG: return "neg";
+        case OP_NOT: return "not";
+        case OP_SHL: return "shl";
+        case OP_DIV_POW2: return "divpow2";
+        case OP_DIV_CONST: return "divconst";
+        default: return "?";
+    }
+}
+
+
+static void dump_val(IrFunc *f, SymTab *st, IrVal v, FILE *out) {
+    if (v.kind == IRV_IMM) fprintf(out, "%lld", (long long)v.v);
+    // $ on variables so one named like a block label still reads as a variable
+    else if (v.v < f->nvars) fprintf(out, "$%s", st->items[v.v].name);
+    else fprintf(out, "%%%lld", (long long)v.v);
+}
+
+
+static void dump_str(StringLit *s, FILE *out) {
+    fputc('"', out);
+    for (size_t i = 0; i < s->len; i++) {
+        char c = s->data[i];
+        if (c == '\n') fputs("\\n", out);
+        else if (c == '\t') fputs("\\t", out);
+        else if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+void ir_dump(IrFunc *f, SymTab *st, FILE *out) {
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        fprintf(out, "b%zu:", i);
+        int first = 1;
+        for (size_t p = 0; p < f->count; p++) {
+            IrBlock *pb = &f->blocks[p];
+            int n = pb->term == TERM_BR ? 2 : (pb->term == TERM_JMP ? 1 : 0);
+            for (int k = 0; k < n; k++) {
+                if (pb->succ[k] != (int)i) continue;
+                fprintf(out, first ? "  ; preds b%zu" : ", b%zu", p);
+                first = 0;
+                break;
+            }
+        }
+        fputc('\n', out);
+        for (size_t j = 0; j < b->count; j++) {
+            IrInst *in = &b->insts[j];
+            fputs("    ", out);
+            if (in->dst >= 0) {
+                dump_val(f, st, val_vreg(in->dst), out);
+                fputs(" = ", out);
+            }
+            switch (in->op) {
+                case IR_COPY: break;
+                case IR_BIN:
+                case IR_UNARY: fprintf(out, "%s ", alu_name(in->alu)); break;
+                case IR_CALL: fprintf(out, "call %s ", builtin_name(in->fn)); break;
+                case IR_ADDR: fputs("addr ", out); break;
+                case IR_LOAD: fputs("load ", out); break;
+                case IR_VFILL: fputs("vfill ", out); break;
+                case IR_VIOTA: fputs("viota ", out); break;
+                case IR_VMAP: fprintf(out, "vmap %s ", alu_name(in->alu)); break;
+                case IR_VSUM: fputs("vsum ", out); break;
+                case IR_PRINT: fputs("print ", out); break;
+                case IR_PRINT_STR: fputs("print ", out); dump_str(in->str, out); break;
+            }
+            for (size_t k = 0; k < in->argc; k++) {
+                if (k) fputs(", ", out);
+                dump_val(f, st, in->args[k], out);
+            }
+            fputc('\n', out);
+        }
+        if (b->term == TERM_JMP) {
+            fprintf(out, "    jmp b%d\n", b->succ[0]);
+        } else if (b->term == TERM_BR) {
+            fputs("    br ", out);
+            dump_val(f, st, b->cond, out);
+            fprintf(out, ", b%d, b%d\n", b->succ[0], b->succ[1]);
+        } else {
+            fputs("    exit\n", out);
+        }
+    }
+}
+
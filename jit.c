@@ -0,0 +1,150 @@
+﻿#include "common.h"
+
+// --jit: lay the image out exactly like write_pe would, but in our own memory,
+// fill the IAT with host functions and call straight into .text.
+// the generated code always ends in ExitProcess, so jit_run never returns
+
+#ifdef _WIN32
+#include <windows.h>
+
+static void *map_image(size_t size) {
+    void *p = VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!p) die("jit: VirtualAlloc failed");
+    return p;
+}
+
+
+static void protect_text(uint8_t *p, size_t size) {
+    DWORD old;
+    if (!VirtualProtect(p, size, PAGE_EXECUTE_READ, &old)) die("jit: VirtualProtect failed");
+    FlushInstructionCache(GetCurrentProcess(), p, size);
+}
+
+
+// on windows the real kernel32 entry points already have the right abi
+static void fill_iat(uint8_t *base, CodeGen *cg) {
+    HMODULE k32 = GetModuleHandleA("kernel32.dll");
+    if (!k32) die("jit: no kernel32");
+    *(FARPROC *)(base + cg->iat_getstd_rva) = GetProcAddress(k32, "GetStdHandle");
+    *(FARPROC *)(base + cg->iat_write_rva) = GetProcAddress(k32, "WriteFile");
+    *(FARPROC *)(base + cg->iat_exit_rva) = GetProcAddress(k32, "ExitProcess");
+    *(FARPROC *)(base + cg->iat_setconcp_rva) = GetProcAddress(k32, "SetConsoleOutputCP");
+    *(FARPROC *)(base + cg->iat_getprocheap_rva) = GetProcAddress(k32, "GetProcessHeap");
+    *(FARPROC *)(base + cg->iat_heapalloc_rva) = GetProcAddress(k32, "HeapAlloc");
+}
+
+#elif defined(__x86_64__) && defined(__GNUC__)
+#include <sys/mman.h>
+
+static void *map_image(size_t size) {
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) die("jit: mmap failed");
+    return p;
+}
+
+
+static void protect_text(uint8_t *p, size_t size) {
+    if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) die("jit: mprotect failed");
+}
+
+
+// the code is win64 and calls through the IAT, so the shims are ms_abi.
+// handles are fake, stdout is the only thing anyone asks for
+#define SHIM __attribute__((ms_abi))
+
+static SHIM void *shim_get_std_handle(uint32_t which) {
+    (void)which;
+    return (void *)1;
+}
+
+
+static SHIM int shim_write_file(void *h, const void *buf, uint32_t n, uint32_t *written, void *ov) {
+    (void)h;
+    (void)ov;
+    size_t done = fwrite(buf, 1, n, stdout);
+    if (written) *written = (uint32_t)done;
+    return done == n;
+}
+
+
+static SHIM void shim_exit_process(uint32_t code) {
+    fflush(stdout);
+    exit((int)code);
+}
+
+
+static SHIM int shim_set_console_cp(uint32_t cp) {
+    (void)cp;
+    return 1;
+}
+
+
+static SHIM void *shim_get_process_heap(void) {
+    return (void *)1;
+}
+
+
+// the runtime asks for HEAP_ZERO_MEMORY everywhere, calloc covers it
+static SHIM void *shim_heap_alloc(void *heap, uint32_t flags, size_t size) {
+    (void)heap;
+    (void)flags;
+    return calloc(1, size ? size : 1);
+}
+
+
+static void fill_iat(uint8_t *base, CodeGen *cg) {
+    *(void **)(base + cg->iat_getstd_rva) = (void *)shim_get_std_handle;
+    *(void **)(base + cg->iat_write_rva) = (void *)shim_write_file;
+    *(void **)(base + cg->iat_exit_rva) = (void *)shim_exit_process;
+    *(void **)(base + cg->iat_setconcp_rva) = (void *)shim_set_console_cp;
+    *(void **)(base + cg->iat_getprocheap_rva) = (void *)shim_get_process_heap;
+    *(void **)(base + cg->iat_heapalloc_rva) = (void *)shim_heap_alloc;
+}
+
+#else
+
+static void *map_image(size_t size) {
+    (void)size;
+    die("--jit needs an x86-64 host");
+    return 0;
+}
+
+
+static void protect_text(uint8_t *p, size_t size) {
+    (void)p;
+    (void)size;
+}
+
+
+static void fill_iat(uint8_t *base, CodeGen *cg) {
+    (void)base;
+    (void)cg;
+}
+
+#endif
+
+
+void jit_run(CodeGen *cg, StringLit **strings, size_t strings_count) {
+    cg->rdata_rva = 0x1000;
+    RDataLayout l = layout_rdata(cg, strings, strings_count);
+    cg->text_rva = (uint32_t)align_up(cg->rdata_rva + l.rdata_size, 0x1000);
+    patch_fixups(cg);
+
+    size_t text_size = align_up(cg->code.len, 0x1000);
+    size_t image_size = cg->text_rva + text_size;
+    uint8_t *base = (uint8_t *)map_image(image_size);
+
+    for (size_t i = 0; i < strings_count; i++) {
+        memcpy(base + strings[i]->rva, strings[i]->data, strings[i]->len);
+    }
+    fill_iat(base, cg);
+    memcpy(base + cg->text_rva, cg->code.data, cg->code.len);
+    protect_text(base + cg->text_rva, text_size);
+
+    // anything the compiler printed so far has to come out before the program does
+    fflush(stdout);
+    void (*entry)(void) = (void (*)(void))(base + cg->text_rva);
+    entry();
+    die("jit: program returned");
+}
+
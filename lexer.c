@@ -1,16 +1,5 @@
 ﻿#include "common.h"
 
-static void lex_push(Lexer *lx, Token t) {
-    if (lx->count == lx->cap) {
-        size_t nc = lx->cap ? lx->cap * 2 : 128;
-        lx->items = (Token *)realloc(lx->items, nc * sizeof(Token));
-        if (!lx->items) die("out of memory");
-        lx->cap = nc;
-    }
-    lx->items[lx->count++] = t;
-}
-
-
 static int lex_peek(Lexer *lx) {
     if (lx->pos >= lx->len) return 0;
     return (unsigned char)lx->src[lx->pos];
@@ -23,19 +12,6 @@ static int lex_get(Lexer *lx) {
 }
 
 
-static void lex_skip_ws(Lexer *lx) {
-    while (1) {
-        int ch = lex_peek(lx);
-        if (ch == 0) break;
-        if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
-            lx->pos++;
-            continue;
-        }
-        break;
-    }
-}
-
-
 static int is_ident_start(int ch) {
     return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_' || ch >= 0x80;
 }
@@ -46,113 +22,374 @@ static int is_ident(int ch) {
 }
 
 
-void lex_all(Lexer *lx) {
-    const char *kw[] = {
-        "исп.команду.print",
-        "пусть",
-        "в",
-        "таком",
-        "случае",
-        "иначе.если",
-        "повторять.раз",
-        "истина.ок",
-        "ложь.падение",
-        "и.также",
-        "или.иначе",
-        "не.а"
-    };
-    while (1) {
-        lex_skip_ws(lx);
-        int ch = lex_peek(lx);
-        if (ch == 0) break;
-        if (is_ident_start(ch)) {
-            size_t start = lx->pos;
-            lex_get(lx);
-            while (is_ident(lex_peek(lx))) lex_get(lx);
-            size_t n = lx->pos - start;
-            char *txt = xstrndup(lx->src + start, n);
-            Token t = {TK_ID, txt, 0};
-            for (size_t i = 0; i < sizeof(kw)/sizeof(kw[0]); i++) {
-                if (strcmp(txt, kw[i]) == 0) {
-                    t.kind = TK_KW;
-                    break;
-                }
-            }
-            lex_push(lx, t);
-            continue;
+// token boundary scanners. each returns the first index in [i, n) whose byte
+// is not in its class (or n). the string one stops at the quote, a backslash
+// or a nul. scalar versions first, they also finish the tails for the simd ones
+static int is_ws(int ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+
+static int is_str_plain(int ch) {
+    return ch != '"' && ch != '\\' && ch != 0;
+}
+
+
+static size_t scan_ws_scalar(const char *s, size_t i, size_t n) {
+    while (i < n && is_ws((unsigned char)s[i])) i++;
+    return i;
+}
+
+
+static size_t scan_ident_scalar(const char *s, size_t i, size_t n) {
+    while (i < n && is_ident((unsigned char)s[i])) i++;
+    return i;
+}
+
+
+static size_t scan_digits_scalar(const char *s, size_t i, size_t n) {
+    while (i < n && s[i] >= '0' && s[i] <= '9') i++;
+    return i;
+}
+
+
+static size_t scan_str_scalar(const char *s, size_t i, size_t n) {
+    while (i < n && is_str_plain((unsigned char)s[i])) i++;
+    return i;
+}
+
+
+typedef struct {
+    size_t (*ws)(const char *s, size_t i, size_t n);
+    size_t (*ident)(const char *s, size_t i, size_t n);
+    size_t (*digits)(const char *s, size_t i, size_t n);
+    size_t (*str)(const char *s, size_t i, size_t n);
+} Scanners;
+
+static Scanners scan = {scan_ws_scalar, scan_ident_scalar, scan_digits_scalar, scan_str_scalar};
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_FN
+#else
+#define AVX2_FN __attribute__((target("avx2")))
+#endif
+
+static int low_bit(uint32_t m) {
+#ifdef _MSC_VER
+    unsigned long r;
+    _BitScanForward(&r, m);
+    return (int)r;
+#else
+    return __builtin_ctz(m);
+#endif
+}
+
+
+// unsigned lo <= c <= hi with only sse2 compares: shift down by lo, then
+// c - lo is in range exactly when min(c - lo, hi - lo) == c - lo
+#define IN_RANGE16(v, lo, hi) \
+    _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(v, _mm_set1_epi8(lo)), _mm_set1_epi8((hi) - (lo))), \
+                   _mm_sub_epi8(v, _mm_set1_epi8(lo)))
+#define IN_RANGE32(v, lo, hi) \
+    _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(v, _mm256_set1_epi8(lo)), _mm256_set1_epi8((hi) - (lo))), \
+                      _mm256_sub_epi8(v, _mm256_set1_epi8(lo)))
+
+// per-class byte masks, bit set = byte belongs to the class
+static uint32_t ws_mask16(__m128i v) {
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    return (uint32_t)_mm_movemask_epi8(m);
+}
+
+
+// letters are folded to lowercase with |0x20, utf-8 lead and continuation
+// bytes are everything with the top bit set
+static uint32_t ident_mask16(__m128i v) {
+    __m128i m = IN_RANGE16(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+    m = _mm_or_si128(m, IN_RANGE16(v, '0', '9'));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')), _mm_cmpeq_epi8(v, _mm_set1_epi8('.'))));
+    return (uint32_t)(_mm_movemask_epi8(m) | _mm_movemask_epi8(v));
+}
+
+
+static uint32_t digit_mask16(__m128i v) {
+    return (uint32_t)_mm_movemask_epi8(IN_RANGE16(v, '0', '9'));
+}
+
+
+static uint32_t str_mask16(__m128i v) {
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    return (uint32_t)_mm_movemask_epi8(m) ^ 0xFFFF;
+}
+
+
+AVX2_FN static uint32_t ws_mask32(__m256i v) {
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+
+AVX2_FN static uint32_t ident_mask32(__m256i v) {
+    __m256i m = IN_RANGE32(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z');
+    m = _mm256_or_si256(m, IN_RANGE32(v, '0', '9'));
+    m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'))));
+    return (uint32_t)(_mm256_movemask_epi8(m) | _mm256_movemask_epi8(v));
+}
+
+
+AVX2_FN static uint32_t digit_mask32(__m256i v) {
+    return (uint32_t)_mm256_movemask_epi8(IN_RANGE32(v, '0', '9'));
+}
+
+
+AVX2_FN static uint32_t str_mask32(__m256i v) {
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    return ~(uint32_t)_mm256_movemask_epi8(m);
+}
+
+
+// whole blocks while every byte is in the class, the first miss ends it.
+// the sse2 loop also mops up after the avx2 one, the scalar loop after both
+#define SCAN_SSE2(name, maskfn, scalar) \
+    static size_t name(const char *s, size_t i, size_t n) { \
+        while (i + 16 <= n) { \
+            uint32_t m = maskfn(_mm_loadu_si128((const __m128i *)(s + i))); \
+            if (m != 0xFFFF) return i + low_bit(~m); \
+            i += 16; \
+        } \
+        return scalar(s, i, n); \
+    }
+
+#define SCAN_AVX2(name, maskfn, sse2) \
+    AVX2_FN static size_t name(const char *s, size_t i, size_t n) { \
+        while (i + 32 <= n) { \
+            uint32_t m = maskfn(_mm256_loadu_si256((const __m256i *)(s + i))); \
+            if (m != 0xFFFFFFFFu) return i + low_bit(~m); \
+            i += 32; \
+        } \
+        return sse2(s, i, n); \
+    }
+
+SCAN_SSE2(scan_ws_sse2, ws_mask16, scan_ws_scalar)
+SCAN_SSE2(scan_ident_sse2, ident_mask16, scan_ident_scalar)
+SCAN_SSE2(scan_digits_sse2, digit_mask16, scan_digits_scalar)
+SCAN_SSE2(scan_str_sse2, str_mask16, scan_str_scalar)
+SCAN_AVX2(scan_ws_avx2, ws_mask32, scan_ws_sse2)
+SCAN_AVX2(scan_ident_avx2, ident_mask32, scan_ident_sse2)
+SCAN_AVX2(scan_digits_avx2, digit_mask32, scan_digits_sse2)
+SCAN_AVX2(scan_str_avx2, str_mask32, scan_str_sse2)
+
+static int cpu_has_avx2(void) {
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) return 0;
+    __cpuid(r, 1);
+    // osxsave + avx, and the os actually saves the ymm state
+    if ((r[2] & (1 << 27)) == 0 || (r[2] & (1 << 28)) == 0) return 0;
+    if ((_xgetbv(0) & 6) != 6) return 0;
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+
+// sse2 is always there on x86-64, avx2 is a runtime question
+static void pick_scanners(void) {
+    static int picked = 0;
+    if (picked) return;
+    picked = 1;
+    if (cpu_has_avx2()) {
+        Scanners s = {scan_ws_avx2, scan_ident_avx2, scan_digits_avx2, scan_str_avx2};
+        scan = s;
+    } else {
+        Scanners s = {scan_ws_sse2, scan_ident_sse2, scan_digits_sse2, scan_str_sse2};
+        scan = s;
+    }
+}
+
+#else
+
+static void pick_scanners(void) {
+}
+
+#endif
+
+
+static const char *tok_names[TOK_ID_COUNT] = {
+    "token",
+    "исп.команду.print",
+    "пусть",
+    "в",
+    "таком",
+    "случае",
+    "иначе.если",
+    "повторять.раз",
+    "истина.ок",
+    "ложь.падение",
+    "и.также",
+    "или.иначе",
+    "не.а",
+    "+", "-", "*", "/", "=", "<", ">", "<=", ">=", "==", "!=", "=>",
+    "(", ")", "{", "}", ";", ","
+};
+
+const char *tok_name(TokId id) {
+    return tok_names[id];
+}
+
+
+// perfect hash over the keyword utf-8 bytes: (len + 2*last + 2*middle) & 31.
+// the constants came out of a brute-force search, redo it if a keyword changes
+#define KW_HASH(s, n) (((n) + 2 * (uint8_t)(s)[(n) - 1] + 2 * (uint8_t)(s)[(n) / 2]) & 31)
+
+static const TokId kw_table[32] = {
+    [1] = KW_FALSE,
+    [3] = KW_PRINT,
+    [4] = KW_LET,
+    [5] = KW_TRUE,
+    [9] = KW_REPEAT,
+    [10] = KW_V,
+    [11] = KW_OR,
+    [13] = KW_ELSE,
+    [17] = KW_NOT,
+    [22] = KW_TAKOM,
+    [23] = KW_AND,
+    [24] = KW_SLUCHAE
+};
+
+static TokId kw_lookup(const char *s, size_t n) {
+    TokId id = kw_table[KW_HASH(s, n)];
+    if (id == TOK_NONE) return TOK_NONE;
+    const char *k = tok_names[id];
+    if (strlen(k) != n || memcmp(k, s, n) != 0) return TOK_NONE;
+    return id;
+}
+
+
+static Token punct(TokenKind kind, TokId id, const char *text) {
+    Token t = {kind, (char *)text, 0, id};
+    return t;
+}
+
+
+// one token per call, the parser pulls them as it goes. TK_EOF forever at the end
+Token lex_next(Lexer *lx) {
+    pick_scanners();
+    lx->pos = scan.ws(lx->src, lx->pos, lx->len);
+    int ch = lex_peek(lx);
+    if (ch == 0) return punct(TK_EOF, TOK_NONE, "");
+    if (is_ident_start(ch)) {
+        size_t start = lx->pos;
+        lx->pos = scan.ident(lx->src, lx->pos + 1, lx->len);
+        size_t n = lx->pos - start;
+        TokId kw = kw_lookup(lx->src + start, n);
+        if (kw != TOK_NONE) {
+            return punct(TK_KW, kw, tok_names[kw]);
         }
-        if (ch >= '0' && ch <= '9') {
-            size_t start = lx->pos;
-            lex_get(lx);
-            while (lex_peek(lx) >= '0' && lex_peek(lx) <= '9') lex_get(lx);
-            size_t n = lx->pos - start;
-            char *txt = xstrndup(lx->src + start, n);
-            Token t = {TK_NUM, txt, strtoll(txt, 0, 10)};
-            lex_push(lx, t);
-            continue;
+        Token t = {TK_ID, str_intern(&lx->pool, lx->src + start, n), 0, TOK_NONE};
+        return t;
+    }
+    if (ch >= '0' && ch <= '9') {
+        size_t start = lx->pos;
+        lx->pos = scan.digits(lx->src, start, lx->len);
+        uint64_t v = 0;
+        int over = 0;
+        for (size_t i = start; i < lx->pos; i++) {
+            uint64_t d = (uint64_t)(lx->src[i] - '0');
+            // strtoll saturated on overflow, keep that
+            if (v > ((uint64_t)INT64_MAX - d) / 10) over = 1;
+            else v = v * 10 + d;
         }
-        if (ch == '"') {
-            lex_get(lx);
-            size_t start = lx->pos;
-            char *buf = (char *)xmalloc(lx->len - start + 1);
-            size_t blen = 0;
-            while (1) {
-                int c = lex_get(lx);
-                if (c == 0) die("unterminated string");
-                if (c == '"') break;
-                if (c == '\\') {
-                    int e = lex_get(lx);
-                    if (e == 'n') c = '\n';
-                    else if (e == 't') c = '\t';
-                    else if (e == '"') c = '"';
-                    else if (e == '\\') c = '\\';
-                    else c = e;
-                }
-                buf[blen++] = (char)c;
-            }
-            buf[blen] = 0;
-            Token t = {TK_STR, buf, 0};
-            lex_push(lx, t);
-            continue;
+        size_t n = lx->pos - start;
+        int64_t num = over ? INT64_MAX : (int64_t)v;
+        Token t = {TK_NUM, str_intern(&lx->pool, lx->src + start, n), num, TOK_NONE};
+        return t;
+    }
+    if (ch == '"') {
+        lex_get(lx);
+        // measure up to the closing quote first, escapes only ever shrink the text
+        size_t end = lx->pos;
+        while (end < lx->len) {
+            end = scan.str(lx->src, end, lx->len);
+            if (end >= lx->len || lx->src[end] == '"') break;
+            end += lx->src[end] == '\\' ? 2 : 1;
         }
-        {
-            size_t start = lx->pos;
-            int c1 = lex_get(lx);
-            int c2 = lex_peek(lx);
-            int c3 = (lx->pos + 1 < lx->len) ? (unsigned char)lx->src[lx->pos + 1] : 0;
-            if (c1 == '=' && c2 == '/' && c3 == '=') {
-                lx->pos++;
-                lx->pos++;
-                Token t = {TK_OP, xstrndup("=/=", 3), 0};
-                lex_push(lx, t);
-                continue;
-            }
-            if ((c1 == '=' && c2 == '=') || (c1 == '!' && c2 == '=') ||
-                (c1 == '<' && c2 == '=') || (c1 == '>' && c2 == '=') ||
-                (c1 == '=' && c2 == '>')) {
-                lex_get(lx);
-                char op[3] = {(char)c1, (char)c2, 0};
-                Token t = {TK_OP, xstrndup(op, 2), 0};
-                lex_push(lx, t);
-                continue;
-            }
-            if (strchr("+-*/=<>", c1)) {
-                char op[2] = {(char)c1, 0};
-                Token t = {TK_OP, xstrndup(op, 1), 0};
-                lex_push(lx, t);
-                continue;
+        char *buf = (char *)region_alloc(lx->rg, end - lx->pos + 1);
+        size_t blen = 0;
+        while (1) {
+            // plain runs are copied in one go, only escapes take the slow way
+            size_t run = scan.str(lx->src, lx->pos, lx->len);
+            memcpy(buf + blen, lx->src + lx->pos, run - lx->pos);
+            blen += run - lx->pos;
+            lx->pos = run;
+            int c = lex_get(lx);
+            if (c == 0) die("unterminated string");
+            if (c == '"') break;
+            if (c == '\\') {
+                int e = lex_get(lx);
+                if (e == 'n') c = '\n';
+                else if (e == 't') c = '\t';
+                else if (e == '"') c = '"';
+                else if (e == '\\') c = '\\';
+                else c = e;
             }
-            if (strchr("(){};,", c1)) {
-                char op[2] = {(char)c1, 0};
-                Token t = {TK_SYM, xstrndup(op, 1), 0};
-                lex_push(lx, t);
-                continue;
-            }
-            fprintf(stderr, "bad character at %zu: %c\n", start, c1);
-            exit(1);
+            buf[blen++] = (char)c;
         }
+        buf[blen] = 0;
+        Token t = {TK_STR, buf, 0, TOK_NONE};
+        return t;
+    }
+
+    size_t start = lx->pos;
+    int c1 = lex_get(lx);
+    int c2 = lex_peek(lx);
+    int c3 = (lx->pos + 1 < lx->len) ? (unsigned char)lx->src[lx->pos + 1] : 0;
+    if (c1 == '=' && c2 == '/' && c3 == '=') {
+        lx->pos++;
+        lx->pos++;
+        return punct(TK_OP, P_NE, "=/=");
+    }
+    TokId two = TOK_NONE;
+    if (c1 == '=' && c2 == '=') two = P_EQ;
+    else if (c1 == '!' && c2 == '=') two = P_NE;
+    else if (c1 == '<' && c2 == '=') two = P_LE;
+    else if (c1 == '>' && c2 == '=') two = P_GE;
+    else if (c1 == '=' && c2 == '>') two = P_ARROW;
+    if (two != TOK_NONE) {
+        lex_get(lx);
+        return punct(TK_OP, two, tok_names[two]);
+    }
+    TokId one = TOK_NONE;
+    TokenKind kind = TK_OP;
+    switch (c1) {
+        case '+': one = P_PLUS; break;
+        case '-': one = P_MINUS; break;
+        case '*': one = P_STAR; break;
+        case '/': one = P_SLASH; break;
+        case '=': one = P_ASSIGN; break;
+        case '<': one = P_LT; break;
+        case '>': one = P_GT; break;
+        case '(': one = P_LPAREN; kind = TK_SYM; break;
+        case ')': one = P_RPAREN; kind = TK_SYM; break;
+        case '{': one = P_LBRACE; kind = TK_SYM; break;
+        case '}': one = P_RBRACE; kind = TK_SYM; break;
+        case ';': one = P_SEMI; kind = TK_SYM; break;
+        case ',': one = P_COMMA; kind = TK_SYM; break;
+    }
+    if (one != TOK_NONE) {
+        return punct(kind, one, tok_names[one]);
     }
-    Token t = {TK_EOF, xstrndup("", 0), 0};
-    lex_push(lx, t);
+    fprintf(stderr, "bad character at %zu: %c\n", start, c1);
+    exit(1);
 }
 
@@ -1,65 +1,203 @@
 ﻿#include "common.h"
 
+static int timing = 0;
+static double phase_t0 = 0;
+
+// --time: one line per phase on stderr, bench/run.py parses these
+static void phase_done(const char *name) {
+    double t = now_ms();
+    if (timing) fprintf(stderr, "time %-14s %10.3f ms\n", name, t - phase_t0);
+    phase_t0 = t;
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "usage: 1cotlinc <file> [out.exe]\n");
+    const char *in = 0;
+    const char *out = 0;
+    int opt = 0;
+    int dump_ir = 0;
+    int line_buffered = 0;
+    int run = 0;
+    int jit = 0;
+    int threads = 0;
+    int peephole = 1;
+    Target target = TARGET_WIN64;
+    int bad_args = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O") == 0) opt = 1;
+        else if (strcmp(argv[i], "--dump-ir") == 0) dump_ir = 1;
+        else if (strcmp(argv[i], "--line-buffered") == 0) line_buffered = 1;
+        else if (strcmp(argv[i], "--run") == 0) run = 1;
+        else if (strcmp(argv[i], "--jit") == 0) jit = 1;
+        else if (strcmp(argv[i], "--time") == 0) timing = 1;
+        else if (strcmp(argv[i], "--no-peephole") == 0) peephole = 0;
+        else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2]) threads = atoi(argv[i] + 2);
+        else if (strcmp(argv[i], "--target=windows-x86_64") == 0) target = TARGET_WIN64;
+        else if (strcmp(argv[i], "--target=linux-x86_64") == 0) target = TARGET_LINUX;
+        else if (strncmp(argv[i], "--target=", 9) == 0) bad_args = 1;
+        else if (!in) in = argv[i];
+        else if (!out) out = argv[i];
+        else bad_args = 1;
+    }
+    if (!in || bad_args) {
+        fprintf(stderr, "usage: 1cotlinc [-O] [--dump-ir] [--line-buffered] [--run] [--jit] [--time] [--no-peephole] [-jN] [--target=windows-x86_64|linux-x86_64] <file> [out]\n");
         return 1;
     }
 
-    size_t len = 0;
-    char *src = read_file(argv[1], &len);
-    if (!src) die("failed to read input");
+    // the jit fills a win64 IAT with host functions, so it always wants that codegen
+    if (jit) target = TARGET_WIN64;
+
+    phase_t0 = now_ms();
+    SourceFile src;
+    if (!read_file(in, &src)) die("failed to read input");
+    phase_done("read_file");
+
+    // names, string literals and the code buffers all come from here. the ast
+    // too, except in a plain build where each statement is gone once emitted
+    Region rg = {0};
+    Region ast = {0};
+    int stream = !opt && !dump_ir && !run;
 
     Lexer lx = {0};
-    lx.src = src;
-    lx.len = len;
-    lex_all(&lx);
+    lx.src = src.data;
+    lx.len = src.len;
+    lx.rg = &rg;
+    lx.pool.rg = &rg;
 
     Parser p = {0};
-    p.items = lx.items;
-    p.count = lx.count;
-    p.pos = 0;
-
-    Stmt *prog = parse_program(&p);
+    p.lx = &lx;
+    p.rg = stream ? &ast : &rg;
+    p.lit_rg = &rg;
 
     SymTab st = {0};
     int max_stack = 0;
     int max_repeat = 0;
-    sem_stmt(prog, &st, &max_stack, &max_repeat, 0);
 
     CodeGen cg = {0};
-    cg.sym = st;
-    cg.loop_slots = max_repeat;
-    cg.rdata_rva = 0x2000;
-    layout_rdata(&cg, p.strings, p.strings_count);
-
-    size_t locals_size = st.count * 8;
-    size_t temps_size = 8 + 8 + 32 + 8 + 8 + 8 + 8;
-    size_t loops_size = cg.loop_slots * 8;
-    size_t vstack_size = max_stack * 8;
-    size_t locals_total = locals_size + temps_size + loops_size + vstack_size;
-
-    cg.stdout_offset = -16 - (int64_t)locals_size - 8;
-    cg.bytes_written_offset = cg.stdout_offset - 8;
-    cg.intbuf_offset = cg.bytes_written_offset - 32;
-    cg.heap_offset = cg.intbuf_offset - 8;
-    cg.temp_offset = cg.heap_offset - 8;
-    cg.temp2_offset = cg.temp_offset - 8;
-    cg.lambda_param_offset = cg.temp2_offset - 8;
-    cg.loop_slots_offset = cg.lambda_param_offset - 8;
-    cg.vstack_base_offset = -16 - (int64_t)locals_total;
-    cg.frame_size = align_up(32 + locals_total, 16);
-
-    gen_prolog(&cg);
-
-    int loop_depth = 0;
-    gen_stmt(&cg, prog, &loop_depth);
-
-    gen_epilog(&cg);
-
-    const char *out = (argc == 3) ? argv[2] : default_output(argv[1]);
-    write_pe(out, &cg, p.strings, p.strings_count);
+    cg.rg = &rg;
+    cg.code.rg = &rg;
+    cg.opt = opt;
+    cg.peephole = peephole;
+    cg.target = target;
+    cg.line_buffered = line_buffered;
+    cg.rdata_rva = 0x1000;
+    // no strings yet, this is only for the IAT rvas
+    if (target != TARGET_LINUX) layout_rdata(&cg, 0, 0);
+
+    if (stream) {
+        // plain build: lex, parse and check GEN_CHUNK top-level statements, emit
+        // them (across threads when there are several), forget their ast, repeat.
+        // the frame sizes are patched in at the end
+        if (threads <= 0) threads = pool_cpus();
+        if (threads > GEN_MAX_THREADS) threads = GEN_MAX_THREADS;
+        pool_start(threads);
+        Region part_rg[GEN_MAX_THREADS];
+        memset(part_rg, 0, sizeof(part_rg));
+        Stmt **chunk = (Stmt **)xmalloc(GEN_CHUNK * sizeof(Stmt *));
+
+        layout_frame(&cg, 0, 0, 0);
+        gen_prolog(&cg);
+        int more = 1;
+        while (more) {
+            size_t n = 0;
+            while (n < GEN_CHUNK) {
+                Stmt *s = parse_next(&p);
+                if (!s) {
+                    more = 0;
+                    break;
+                }
+                sem_stmt(s, &st, &max_stack, &max_repeat, 0);
+                chunk[n++] = s;
+            }
+            cg.sym = st;
+            cg.loop_slots = max_repeat;
+            gen_stmts(&cg, chunk, n, threads, part_rg);
+            region_reset(&ast);
+        }
+        close_file(&src);
+        pool_stop();
+        free(chunk);
+        for (int i = 0; i < threads; i++) region_free(&part_rg[i]);
+        gen_epilog(&cg);
+        // the variables went out with stand-in slots, now that every live
+        // range is known they share what they can
+        int slots = sym_pack(&st);
+        cg.sym = st;
+        layout_frame(&cg, (size_t)slots, max_repeat, max_stack);
+        phase_done("stream");
+    } else {
+        Stmt *prog = parse_program(&p);
+        // every token has its own copy of the text by now
+        close_file(&src);
+        phase_done("parse_program");
+
+        if (opt) {
+            fold_program(prog, p.rg);
+            phase_done("fold_program");
+        }
+
+        sem_stmt(prog, &st, &max_stack, &max_repeat, 0);
+        phase_done("sem_stmt");
 
+        // --run skips codegen entirely and interprets the bytecode
+        if (run) {
+            VmProg *vp = vm_compile(prog, &st);
+            phase_done("vm_compile");
+            vm_run(vp, line_buffered);
+            phase_done("vm_run");
+            region_free(&rg);
+            return 0;
+        }
+
+        // -O and --dump-ir go through the ir
+        IrFunc *ir = ir_build(prog, &st);
+        phase_done("ir_build");
+        if (opt) {
+            ir_optimize(ir);
+            phase_done("ir_optimize");
+        }
+        if (dump_ir) {
+            ir_dump(ir, &st, stdout);
+            region_free(&rg);
+            return 0;
+        }
+        regalloc(prog, &st);
+        regalloc_ir(ir, &st);
+        phase_done("regalloc");
+
+        cg.sym = st;
+        // the variables in memory share the spill slots, see regalloc_ir
+        layout_frame(&cg, 0, 0, ir->spill_slots);
+        gen_prolog(&cg);
+        gen_ir(&cg, ir);
+        gen_epilog(&cg);
+        phase_done("gen_ir");
+    }
+    relax_branches(&cg);
+    phase_done("relax_branches");
+    if (timing) {
+        fprintf(stderr, "size %-14s %10zu bytes\n", "code", cg.code.len);
+        fprintf(stderr, "size %-14s %10zu bytes\n", "frame", cg.frame_size);
+        fprintf(stderr, "peep %-14s %10zu bytes\n", "saved", cg.peep.bytes);
+        fprintf(stderr, "peep %-14s %10zu insns\n", "removed", cg.peep.insns);
+    }
+
+    if (jit) {
+        jit_run(&cg, p.strings, p.strings_count);
+        return 0;
+    }
+
+    if (target == TARGET_LINUX) {
+        if (!out) out = default_output(in, "");
+        write_elf(out, &cg, p.strings, p.strings_count);
+        phase_done("write_elf");
+    } else {
+        if (!out) out = default_output(in, ".exe");
+        write_pe(out, &cg, p.strings, p.strings_count);
+        phase_done("write_pe");
+    }
+
+    region_free(&ast);
+    region_free(&rg);
     return 0;
 }
-
+
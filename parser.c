@@ -3,60 +3,80 @@
 static Expr *parse_expression(Parser *p);
 static Stmt *parse_statement(Parser *p);
 
-static Token *peek(Parser *p) {
-    return &p->items[p->pos];
+// pos and filled count tokens from the start of the file, the ring holds
+// the ones in between plus the few most recently consumed
+static Token *peek_n(Parser *p, size_t n) {
+    if (n > PARSE_LOOKAHEAD) die("parser looks too far ahead");
+    while (p->filled <= p->pos + n) {
+        p->ring[p->filled % PARSE_RING] = lex_next(p->lx);
+        p->filled++;
+    }
+    return &p->ring[(p->pos + n) % PARSE_RING];
 }
 
-static Token *peek_n(Parser *p, size_t n) {
-    return &p->items[p->pos + n];
+
+static Token *peek(Parser *p) {
+    return peek_n(p, 0);
 }
 
 
 static Token *advance(Parser *p) {
-    return &p->items[p->pos++];
+    Token *t = peek(p);
+    p->pos++;
+    return t;
 }
 
 
-static int match(Parser *p, TokenKind kind, const char *text) {
+// id TOK_NONE matches any token of that kind
+static int match(Parser *p, TokenKind kind, TokId id) {
     Token *t = peek(p);
     if (t->kind != kind) return 0;
-    if (text && strcmp(t->text, text) != 0) return 0;
-    p->pos++;
+    if (id != TOK_NONE && t->id != id) return 0;
+    advance(p);
     return 1;
 }
 
 
-static Token *expect(Parser *p, TokenKind kind, const char *text) {
+static Token *expect(Parser *p, TokenKind kind, TokId id) {
     Token *t = peek(p);
-    if (t->kind != kind || (text && strcmp(t->text, text) != 0)) {
-        fprintf(stderr, "expected %s\n", text ? text : "token");
+    if (t->kind != kind || (id != TOK_NONE && t->id != id)) {
+        fprintf(stderr, "expected %s\n", tok_name(id));
         exit(1);
     }
     return advance(p);
 }
 
 
-static Expr *new_expr(ExprKind kind) {
-    Expr *e = (Expr *)xmalloc(sizeof(Expr));
-    memset(e, 0, sizeof(Expr));
+static Expr *new_expr(Parser *p, ExprKind kind) {
+    Expr *e = (Expr *)region_alloc(p->rg, sizeof(Expr));
     e->kind = kind;
     return e;
 }
 
 
-static Stmt *new_stmt(StmtKind kind) {
-    Stmt *s = (Stmt *)xmalloc(sizeof(Stmt));
-    memset(s, 0, sizeof(Stmt));
+static Stmt *new_stmt(Parser *p, StmtKind kind) {
+    Stmt *s = (Stmt *)region_alloc(p->rg, sizeof(Stmt));
     s->kind = kind;
     return s;
 }
 
 
+// room for one more pointer in an array that only ever grows by one.
+// capacity isnt stored, it is 4 and then the next power of two
+static void **ptrs_push(Parser *p, void **items, size_t count, void *v) {
+    if (count < 4 ? count == 0 : (count & (count - 1)) == 0) {
+        size_t nc = count < 4 ? 4 : count * 2;
+        items = (void **)region_grow(p->rg, items, count * sizeof(void *), nc * sizeof(void *));
+    }
+    items[count] = v;
+    return items;
+}
+
+
 static void strings_push(Parser *p, StringLit *s) {
     if (p->strings_count == p->strings_cap) {
         size_t nc = p->strings_cap ? p->strings_cap * 2 : 32;
-        p->strings = (StringLit **)realloc(p->strings, nc * sizeof(StringLit *));
-        if (!p->strings) die("out of memory");
+        p->strings = (StringLit **)region_grow(p->lit_rg, p->strings, p->strings_cap * sizeof(StringLit *), nc * sizeof(StringLit *));
         p->strings_cap = nc;
     }
     p->strings[p->strings_count++] = s;
@@ -70,50 +90,59 @@ static Expr *parse_primary(Parser *p) {
     Token *t = peek(p);
     if (t->kind == TK_NUM) {
         advance(p);
-        Expr *e = new_expr(EX_NUM);
+        Expr *e = new_expr(p, EX_NUM);
         e->v.num = t->num;
         return e;
     }
     if (t->kind == TK_STR) {
         advance(p);
-        StringLit *s = (StringLit *)xmalloc(sizeof(StringLit));
+        StringLit *s = (StringLit *)region_alloc(p->lit_rg, sizeof(StringLit));
         s->len = strlen(t->text);
         s->data = t->text;
         s->rva = 0;
         strings_push(p, s);
-        Expr *e = new_expr(EX_STR);
+        Expr *e = new_expr(p, EX_STR);
         e->v.str = s;
         return e;
     }
-    if (t->kind == TK_KW && (strcmp(t->text, "истина.ок") == 0 || strcmp(t->text, "ложь.падение") == 0)) {
+    if (t->kind == TK_KW && (t->id == KW_TRUE || t->id == KW_FALSE)) {
         advance(p);
-        Expr *e = new_expr(EX_BOOL);
-        e->v.boolv = strcmp(t->text, "истина.ок") == 0;
+        Expr *e = new_expr(p, EX_BOOL);
+        e->v.boolv = t->id == KW_TRUE;
         return e;
     }
     if (t->kind == TK_ID) {
         advance(p);
-        Expr *e = new_expr(EX_VAR);
+        Expr *e = new_expr(p, EX_VAR);
         e->v.var = t->text;
         return e;
     }
-    if (t->kind == TK_SYM && strcmp(t->text, "(") == 0) {
+    if (t->kind == TK_SYM && t->id == P_LPAREN) {
+        // (x) => ... or (acc, x) => ...
+        int close = 2;
         if (peek_n(p, 1)->kind == TK_ID &&
-            peek_n(p, 2)->kind == TK_SYM && strcmp(peek_n(p, 2)->text, ")") == 0 &&
-            peek_n(p, 3)->kind == TK_OP && strcmp(peek_n(p, 3)->text, "=>") == 0) {
+            peek_n(p, 2)->kind == TK_SYM && peek_n(p, 2)->id == P_COMMA &&
+            peek_n(p, 3)->kind == TK_ID) close = 4;
+        if (peek_n(p, 1)->kind == TK_ID &&
+            peek_n(p, close)->kind == TK_SYM && peek_n(p, close)->id == P_RPAREN &&
+            peek_n(p, close + 1)->kind == TK_OP && peek_n(p, close + 1)->id == P_ARROW) {
             advance(p);
-            char *param = expect(p, TK_ID, 0)->text;
-            expect(p, TK_SYM, ")");
-            expect(p, TK_OP, "=>");
-            Expr *body = parse_expression(p);
-            Expr *e = new_expr(EX_LAMBDA);
-            e->v.lambda.param = param;
-            e->v.lambda.body = body;
+            Expr *e = new_expr(p, EX_LAMBDA);
+            e->v.lambda.params[0] = expect(p, TK_ID, TOK_NONE)->text;
+            e->v.lambda.nparams = 1;
+            if (close == 4) {
+                expect(p, TK_SYM, P_COMMA);
+                e->v.lambda.params[1] = expect(p, TK_ID, TOK_NONE)->text;
+                e->v.lambda.nparams = 2;
+            }
+            expect(p, TK_SYM, P_RPAREN);
+            expect(p, TK_OP, P_ARROW);
+            e->v.lambda.body = parse_expression(p);
             return e;
         }
         advance(p);
         Expr *e = parse_expression(p);
-        expect(p, TK_SYM, ")");
+        expect(p, TK_SYM, P_RPAREN);
         return e;
     }
     die("bad expression");
@@ -122,21 +151,19 @@ static Expr *parse_primary(Parser *p) {
 
 static Expr *parse_postfix(Parser *p) {
     Expr *expr = parse_primary(p);
-    while (match(p, TK_SYM, "(")) {
+    while (match(p, TK_SYM, P_LPAREN)) {
         Expr **args = 0;
         size_t argc = 0;
-        if (!match(p, TK_SYM, ")")) {
+        if (!match(p, TK_SYM, P_RPAREN)) {
             while (1) {
                 Expr *a = parse_expression(p);
-                args = (Expr **)realloc(args, (argc + 1) * sizeof(Expr *));
-                if (!args) die("out of memory");
-                args[argc++] = a;
-                if (match(p, TK_SYM, ")")) break;
-                expect(p, TK_SYM, ",");
+                args = (Expr **)ptrs_push(p, (void **)args, argc++, a);
+                if (match(p, TK_SYM, P_RPAREN)) break;
+                expect(p, TK_SYM, P_COMMA);
             }
         }
         if (expr->kind != EX_VAR) die("call on non-name");
-        Expr *call = new_expr(EX_CALL);
+        Expr *call = new_expr(p, EX_CALL);
         call->v.call.name = expr->v.var;
         call->v.call.args = args;
         call->v.call.argc = argc;
@@ -148,16 +175,16 @@ static Expr *parse_postfix(Parser *p) {
 
 static Expr *parse_unary(Parser *p) {
     Token *t = peek(p);
-    if (t->kind == TK_OP && strcmp(t->text, "-") == 0) {
+    if (t->kind == TK_OP && t->id == P_MINUS) {
         advance(p);
-        Expr *e = new_expr(EX_UNARY);
+        Expr *e = new_expr(p, EX_UNARY);
         e->v.un.op = OP_NEG;
         e->v.un.expr = parse_unary(p);
         return e;
     }
-    if (t->kind == TK_KW && strcmp(t->text, "не.а") == 0) {
+    if (t->kind == TK_KW && t->id == KW_NOT) {
         advance(p);
-        Expr *e = new_expr(EX_UNARY);
+        Expr *e = new_expr(p, EX_UNARY);
         e->v.un.op = OP_NOT;
         e->v.un.expr = parse_unary(p);
         return e;
@@ -170,10 +197,10 @@ static Expr *parse_factor(Parser *p) {
     Expr *left = parse_unary(p);
     while (1) {
         Token *t = peek(p);
-        if (t->kind == TK_OP && (strcmp(t->text, "*") == 0 || strcmp(t->text, "/") == 0)) {
+        if (t->kind == TK_OP && (t->id == P_STAR || t->id == P_SLASH)) {
             advance(p);
-            Expr *e = new_expr(EX_BIN);
-            e->v.bin.op = (strcmp(t->text, "*") == 0) ? OP_MUL : OP_DIV;
+            Expr *e = new_expr(p, EX_BIN);
+            e->v.bin.op = (t->id == P_STAR) ? OP_MUL : OP_DIV;
             e->v.bin.left = left;
             e->v.bin.right = parse_unary(p);
             left = e;
@@ -189,10 +216,10 @@ static Expr *parse_term(Parser *p) {
     Expr *left = parse_factor(p);
     while (1) {
         Token *t = peek(p);
-        if (t->kind == TK_OP && (strcmp(t->text, "+") == 0 || strcmp(t->text, "-") == 0)) {
+        if (t->kind == TK_OP && (t->id == P_PLUS || t->id == P_MINUS)) {
             advance(p);
-            Expr *e = new_expr(EX_BIN);
-            e->v.bin.op = (strcmp(t->text, "+") == 0) ? OP_ADD : OP_SUB;
+            Expr *e = new_expr(p, EX_BIN);
+            e->v.bin.op = (t->id == P_PLUS) ? OP_ADD : OP_SUB;
             e->v.bin.left = left;
             e->v.bin.right = parse_factor(p);
             left = e;
@@ -209,13 +236,13 @@ static Expr *parse_compare(Parser *p) {
     while (1) {
         Token *t = peek(p);
         if (t->kind == TK_OP && (
-            strcmp(t->text, "<") == 0 || strcmp(t->text, ">") == 0 ||
-            strcmp(t->text, "<=") == 0 || strcmp(t->text, ">=") == 0)) {
+            t->id == P_LT || t->id == P_GT ||
+            t->id == P_LE || t->id == P_GE)) {
             advance(p);
-            Expr *e = new_expr(EX_BIN);
-            if (strcmp(t->text, "<") == 0) e->v.bin.op = OP_LT;
-            else if (strcmp(t->text, ">") == 0) e->v.bin.op = OP_GT;
-            else if (strcmp(t->text, "<=") == 0) e->v.bin.op = OP_LE;
+            Expr *e = new_expr(p, EX_BIN);
+            if (t->id == P_LT) e->v.bin.op = OP_LT;
+            else if (t->id == P_GT) e->v.bin.op = OP_GT;
+            else if (t->id == P_LE) e->v.bin.op = OP_LE;
             else e->v.bin.op = OP_GE;
             e->v.bin.left = left;
             e->v.bin.right = parse_term(p);
@@ -232,10 +259,10 @@ static Expr *parse_equality(Parser *p) {
     Expr *left = parse_compare(p);
     while (1) {
         Token *t = peek(p);
-        if (t->kind == TK_OP && (strcmp(t->text, "==") == 0 || strcmp(t->text, "!=") == 0 || strcmp(t->text, "=/=") == 0)) {
+        if (t->kind == TK_OP && (t->id == P_EQ || t->id == P_NE)) {
             advance(p);
-            Expr *e = new_expr(EX_BIN);
-            e->v.bin.op = (strcmp(t->text, "==") == 0) ? OP_EQ : OP_NE;
+            Expr *e = new_expr(p, EX_BIN);
+            e->v.bin.op = (t->id == P_EQ) ? OP_EQ : OP_NE;
             e->v.bin.left = left;
             e->v.bin.right = parse_compare(p);
             left = e;
@@ -251,9 +278,9 @@ static Expr *parse_logic_and(Parser *p) {
     Expr *left = parse_equality(p);
     while (1) {
         Token *t = peek(p);
-        if (t->kind == TK_KW && strcmp(t->text, "и.также") == 0) {
+        if (t->kind == TK_KW && t->id == KW_AND) {
             advance(p);
-            Expr *e = new_expr(EX_BIN);
+            Expr *e = new_expr(p, EX_BIN);
             e->v.bin.op = OP_AND;
             e->v.bin.left = left;
             e->v.bin.right = parse_equality(p);
@@ -270,9 +297,9 @@ static Expr *parse_logic_or(Parser *p) {
     Expr *left = parse_logic_and(p);
     while (1) {
         Token *t = peek(p);
-        if (t->kind == TK_KW && strcmp(t->text, "или.иначе") == 0) {
+        if (t->kind == TK_KW && t->id == KW_OR) {
             advance(p);
-            Expr *e = new_expr(EX_BIN);
+            Expr *e = new_expr(p, EX_BIN);
             e->v.bin.op = OP_OR;
             e->v.bin.left = left;
             e->v.bin.right = parse_logic_and(p);
@@ -291,16 +318,14 @@ static Expr *parse_expression(Parser *p) {
 
 
 static Stmt *parse_block(Parser *p) {
-    expect(p, TK_SYM, "{");
-    Stmt *b = new_stmt(ST_BLOCK);
+    expect(p, TK_SYM, P_LBRACE);
+    Stmt *b = new_stmt(p, ST_BLOCK);
     b->v.block.items = 0;
     b->v.block.count = 0;
-    while (!match(p, TK_SYM, "}")) {
+    while (!match(p, TK_SYM, P_RBRACE)) {
         if (peek(p)->kind == TK_EOF) die("expected }");
         Stmt *s = parse_statement(p);
-        b->v.block.items = (Stmt **)realloc(b->v.block.items, (b->v.block.count + 1) * sizeof(Stmt *));
-        if (!b->v.block.items) die("out of memory");
-        b->v.block.items[b->v.block.count++] = s;
+        b->v.block.items = (Stmt **)ptrs_push(p, (void **)b->v.block.items, b->v.block.count++, s);
     }
     return b;
 }
@@ -308,74 +333,79 @@ static Stmt *parse_block(Parser *p) {
 
 static Stmt *parse_statement(Parser *p) {
     Token *t = peek(p);
-    if (t->kind == TK_KW && strcmp(t->text, "исп.команду.print") == 0) {
+    if (t->kind == TK_KW && t->id == KW_PRINT) {
         advance(p);
-        Stmt *s = new_stmt(ST_PRINT);
-        expect(p, TK_SYM, "(");
+        Stmt *s = new_stmt(p, ST_PRINT);
+        expect(p, TK_SYM, P_LPAREN);
         s->v.print.expr = parse_expression(p);
-        expect(p, TK_SYM, ")");
-        match(p, TK_SYM, ";");
+        expect(p, TK_SYM, P_RPAREN);
+        match(p, TK_SYM, P_SEMI);
         return s;
     }
-    if (t->kind == TK_KW && strcmp(t->text, "пусть") == 0) {
+    if (t->kind == TK_KW && t->id == KW_LET) {
         advance(p);
-        Token *id = expect(p, TK_ID, 0);
-        expect(p, TK_OP, "=");
-        Stmt *s = new_stmt(ST_LET);
+        Token *id = expect(p, TK_ID, TOK_NONE);
+        expect(p, TK_OP, P_ASSIGN);
+        Stmt *s = new_stmt(p, ST_LET);
         s->v.let.name = id->text;
         s->v.let.expr = parse_expression(p);
-        match(p, TK_SYM, ";");
+        match(p, TK_SYM, P_SEMI);
         return s;
     }
-    if (t->kind == TK_KW && strcmp(t->text, "в") == 0) {
+    if (t->kind == TK_KW && t->id == KW_V) {
         advance(p);
-        expect(p, TK_KW, "таком");
-        expect(p, TK_KW, "случае");
-        Stmt *s = new_stmt(ST_IF);
+        expect(p, TK_KW, KW_TAKOM);
+        expect(p, TK_KW, KW_SLUCHAE);
+        Stmt *s = new_stmt(p, ST_IF);
         s->v.ifs.cond = parse_expression(p);
         s->v.ifs.thenb = parse_block(p);
         s->v.ifs.elseb = 0;
-        if (peek(p)->kind == TK_KW && strcmp(peek(p)->text, "иначе.если") == 0) {
+        if (peek(p)->kind == TK_KW && peek(p)->id == KW_ELSE) {
             advance(p);
             s->v.ifs.elseb = parse_block(p);
         }
         return s;
     }
-    if (t->kind == TK_KW && strcmp(t->text, "повторять.раз") == 0) {
+    if (t->kind == TK_KW && t->id == KW_REPEAT) {
         advance(p);
-        Stmt *s = new_stmt(ST_REPEAT);
+        Stmt *s = new_stmt(p, ST_REPEAT);
         s->v.repeat.count = parse_expression(p);
         s->v.repeat.body = parse_block(p);
         return s;
     }
-    if (t->kind == TK_ID && peek_n(p, 1)->kind == TK_OP && strcmp(peek_n(p, 1)->text, "=") == 0) {
+    if (t->kind == TK_ID && peek_n(p, 1)->kind == TK_OP && peek_n(p, 1)->id == P_ASSIGN) {
         Token *id = advance(p);
-        expect(p, TK_OP, "=");
-        Stmt *s = new_stmt(ST_SET);
+        expect(p, TK_OP, P_ASSIGN);
+        Stmt *s = new_stmt(p, ST_SET);
         s->v.set.name = id->text;
         s->v.set.expr = parse_expression(p);
-        match(p, TK_SYM, ";");
+        match(p, TK_SYM, P_SEMI);
         return s;
     }
     {
-        Stmt *s = new_stmt(ST_EXPR);
+        Stmt *s = new_stmt(p, ST_EXPR);
         s->v.expr.expr = parse_expression(p);
-        match(p, TK_SYM, ";");
+        match(p, TK_SYM, P_SEMI);
         return s;
     }
 }
 
 
+// next top-level statement, 0 at the end of the file
+Stmt *parse_next(Parser *p) {
+    if (peek(p)->kind == TK_EOF) return 0;
+    return parse_statement(p);
+}
+
+
 Stmt *parse_program(Parser *p) {
-    Stmt *b = new_stmt(ST_BLOCK);
+    Stmt *b = new_stmt(p, ST_BLOCK);
     b->v.block.items = 0;
     b->v.block.count = 0;
-    while (peek(p)->kind != TK_EOF) {
-        Stmt *s = parse_statement(p);
-        b->v.block.items = (Stmt **)realloc(b->v.block.items, (b->v.block.count + 1) * sizeof(Stmt *));
-        if (!b->v.block.items) die("out of memory");
-        b->v.block.items[b->v.block.count++] = s;
+    Stmt *s;
+    while ((s = parse_next(p)) != 0) {
+        b->v.block.items = (Stmt **)ptrs_push(p, (void **)b->v.block.items, b->v.block.count++, s);
     }
     return b;
 }
-
+
@@ -42,14 +42,10 @@ static void buf_u64(uint8_t *b, size_t off, uint64_t v) {
     buf_u32(b, off + 4, (uint32_t)(v >> 32));
 }
 
+// imports first and the strings after them, so the IAT rvas are the same
+// whether or not the strings are known yet (codegen calls through them)
 RDataLayout layout_rdata(CodeGen *cg, StringLit **strings, size_t strings_count) {
     size_t rdata_offset = 0;
-    for (size_t i = 0; i < strings_count; i++) {
-        rdata_offset = align_up(rdata_offset, 8);
-        strings[i]->rva = cg->rdata_rva + (uint32_t)rdata_offset;
-        rdata_offset += strings[i]->len + 1;
-    }
-    rdata_offset = align_up(rdata_offset, 8);
     size_t import_desc_off = rdata_offset;
     rdata_offset += 40;
     size_t ilt_off = rdata_offset;
@@ -76,6 +72,11 @@ RDataLayout layout_rdata(CodeGen *cg, StringLit **strings, size_t strings_count)
     rdata_offset = align_up(rdata_offset, 2);
     size_t dll_name = rdata_offset;
     rdata_offset += strlen("kernel32.dll") + 1;
+    for (size_t i = 0; i < strings_count; i++) {
+        rdata_offset = align_up(rdata_offset, 8);
+        strings[i]->rva = cg->rdata_rva + (uint32_t)rdata_offset;
+        rdata_offset += strings[i]->len + 1;
+    }
     size_t rdata_size = rdata_offset;
 
     cg->iat_getstd_rva = cg->rdata_rva + (uint32_t)iat_off + 0 * 8;
@@ -102,25 +103,24 @@ RDataLayout layout_rdata(CodeGen *cg, StringLit **strings, size_t strings_count)
 
 
 void write_pe(const char *out, CodeGen *cg, StringLit **strings, size_t strings_count) {
-    cg->text_rva = 0x1000;
-    cg->rdata_rva = 0x2000;
+    // .rdata goes first, .text follows wherever it ends up. everything that
+    // points across is a fixup, so that is only settled here
+    cg->rdata_rva = 0x1000;
 
     RDataLayout l = layout_rdata(cg, strings, strings_count);
+    cg->text_rva = (uint32_t)align_up(cg->rdata_rva + l.rdata_size, 0x1000);
     patch_fixups(cg);
 
     size_t headers_size = 0x200;
     size_t text_raw_size = align_up(cg->code.len, 0x200);
     size_t rdata_raw_size = align_up(l.rdata_size, 0x200);
-    uint32_t size_of_image = (uint32_t)align_up(cg->rdata_rva + l.rdata_size, 0x1000);
+    uint32_t size_of_image = (uint32_t)align_up(cg->text_rva + cg->code.len, 0x1000);
 
     uint8_t *rdata = (uint8_t *)calloc(1, rdata_raw_size);
     if (!rdata) die("out of memory");
 
-    size_t rdata_offset = 0;
     for (size_t i = 0; i < strings_count; i++) {
-        rdata_offset = align_up(rdata_offset, 8);
-        memcpy(rdata + rdata_offset, strings[i]->data, strings[i]->len);
-        rdata_offset += strings[i]->len + 1;
+        memcpy(rdata + (strings[i]->rva - cg->rdata_rva), strings[i]->data, strings[i]->len);
     }
 
     buf_u32(rdata, l.import_desc_off + 0, cg->rdata_rva + (uint32_t)l.ilt_off);
@@ -215,41 +215,41 @@ void write_pe(const char *out, CodeGen *cg, StringLit **strings, size_t strings_
         }
     }
 
-    uint8_t text_name[8] = {'.','t','e','x','t',0,0,0};
-    fwrite(text_name, 1, 8, f);
-    write_u32(f, (uint32_t)cg->code.len);
-    write_u32(f, cg->text_rva);
-    write_u32(f, (uint32_t)text_raw_size);
-    write_u32(f, (uint32_t)headers_size);
-    write_u32(f, 0);
-    write_u32(f, 0);
-    write_u16(f, 0);
-    write_u16(f, 0);
-    write_u32(f, 0x60000020);
-
     uint8_t rdata_name[8] = {'.','r','d','a','t','a',0,0};
     fwrite(rdata_name, 1, 8, f);
     write_u32(f, (uint32_t)l.rdata_size);
     write_u32(f, cg->rdata_rva);
     write_u32(f, (uint32_t)rdata_raw_size);
-    write_u32(f, (uint32_t)(headers_size + text_raw_size));
+    write_u32(f, (uint32_t)headers_size);
     write_u32(f, 0);
     write_u32(f, 0);
     write_u16(f, 0);
     write_u16(f, 0);
     write_u32(f, 0x40000040);
 
+    uint8_t text_name[8] = {'.','t','e','x','t',0,0,0};
+    fwrite(text_name, 1, 8, f);
+    write_u32(f, (uint32_t)cg->code.len);
+    write_u32(f, cg->text_rva);
+    write_u32(f, (uint32_t)text_raw_size);
+    write_u32(f, (uint32_t)(headers_size + rdata_raw_size));
+    write_u32(f, 0);
+    write_u32(f, 0);
+    write_u16(f, 0);
+    write_u16(f, 0);
+    write_u32(f, 0x60000020);
+
     long pos = ftell(f);
     while (pos < (long)headers_size) {
         fputc(0, f);
         pos++;
     }
 
+    fwrite(rdata, 1, rdata_raw_size, f);
+
     fwrite(cg->code.data, 1, cg->code.len, f);
     for (size_t i = cg->code.len; i < text_raw_size; i++) fputc(0, f);
 
-    fwrite(rdata, 1, rdata_raw_size, f);
-
     fclose(f);
     free(rdata);
 }
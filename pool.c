@@ -0,0 +1,157 @@
+﻿#include "common.h"
+
+// a handful of worker threads for parallel codegen. pool_run hands out job
+// indexes 0..njobs-1 to the workers and the calling thread alike and returns
+// once every one of them is done
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#define cond_signal(c) WakeConditionVariable(c)
+
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#define mutex_init(m) pthread_mutex_init(m, 0)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init(c, 0)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+#define cond_signal(c) pthread_cond_signal(c)
+#endif
+
+static struct {
+    int threads;
+    Thread *th;
+    Mutex mu;
+    Cond go;
+    Cond done;
+    unsigned round;
+    int busy;
+    int quit;
+    PoolFn fn;
+    void *arg;
+    int njobs;
+    int next;
+} pool;
+
+
+// with the lock held: run jobs until there are none left
+static void take_jobs(void) {
+    while (pool.next < pool.njobs) {
+        int i = pool.next++;
+        mutex_unlock(&pool.mu);
+        pool.fn(pool.arg, i);
+        mutex_lock(&pool.mu);
+    }
+}
+
+
+static void worker(void) {
+    unsigned seen = 0;
+    mutex_lock(&pool.mu);
+    while (1) {
+        while (pool.round == seen && !pool.quit) cond_wait(&pool.go, &pool.mu);
+        if (pool.quit) break;
+        seen = pool.round;
+        take_jobs();
+        if (--pool.busy == 0) cond_signal(&pool.done);
+    }
+    mutex_unlock(&pool.mu);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID unused) {
+    (void)unused;
+    worker();
+    return 0;
+}
+#else
+static void *worker_main(void *unused) {
+    (void)unused;
+    worker();
+    return 0;
+}
+#endif
+
+
+int pool_cpus(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+
+// threads counts the caller, so 1 starts nothing and pool_run runs inline
+void pool_start(int threads) {
+    mutex_init(&pool.mu);
+    cond_init(&pool.go);
+    cond_init(&pool.done);
+    pool.threads = threads;
+    if (threads <= 1) return;
+    pool.th = (Thread *)xmalloc((size_t)(threads - 1) * sizeof(Thread));
+    for (int i = 0; i < threads - 1; i++) {
+#ifdef _WIN32
+        pool.th[i] = CreateThread(0, 0, worker_main, 0, 0, 0);
+        if (!pool.th[i]) die("failed to start thread");
+#else
+        if (pthread_create(&pool.th[i], 0, worker_main, 0) != 0) die("failed to start thread");
+#endif
+    }
+}
+
+
+void pool_run(PoolFn fn, void *arg, int njobs) {
+    mutex_lock(&pool.mu);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.njobs = njobs;
+    pool.next = 0;
+    if (pool.threads > 1) {
+        pool.busy = pool.threads - 1;
+        pool.round++;
+        cond_broadcast(&pool.go);
+    }
+    take_jobs();
+    while (pool.busy) cond_wait(&pool.done, &pool.mu);
+    mutex_unlock(&pool.mu);
+}
+
+
+void pool_stop(void) {
+    if (pool.threads <= 1) return;
+    mutex_lock(&pool.mu);
+    pool.quit = 1;
+    cond_broadcast(&pool.go);
+    mutex_unlock(&pool.mu);
+    for (int i = 0; i < pool.threads - 1; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(pool.th[i], INFINITE);
+        CloseHandle(pool.th[i]);
+#else
+        pthread_join(pool.th[i], 0);
+#endif
+    }
+    free(pool.th);
+    pool.threads = 0;
+}
+
@@ -0,0 +1,433 @@
+﻿#include "common.h"
+
+// callee-saved on win64, so these survive WriteFile/HeapAlloc without spilling
+// (the linux syscall stubs save rdi/rsi themselves).
+// rbx is free here because -O keeps expression temporaries out of the rbx stack
+static const Reg var_regs[] = {REG_RBX, REG_RSI, REG_RDI, REG_R13, REG_R14, REG_R15};
+
+#define LOOP_WEIGHT 8
+#define MAX_WEIGHT ((int64_t)1 << 40)
+#define MAX_LOOP_DEPTH 8
+
+static int expr_calls(Expr *e) {
+    if (!e) return 0;
+    switch (e->kind) {
+        case EX_UNARY:
+            return expr_calls(e->v.un.expr);
+        case EX_BIN:
+            return expr_calls(e->v.bin.left) || expr_calls(e->v.bin.right);
+        case EX_CALL:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// anything that becomes an IR_CALL or IR_PRINT, so a temp live across it needs a saved register
+static int stmt_calls(Stmt *s) {
+    if (!s) return 0;
+    switch (s->kind) {
+        case ST_BLOCK:
+            for (size_t i = 0; i < s->v.block.count; i++) {
+                if (stmt_calls(s->v.block.items[i])) return 1;
+            }
+            return 0;
+        case ST_PRINT:
+            return 1;
+        case ST_LET:
+            return expr_calls(s->v.let.expr);
+        case ST_SET:
+            return expr_calls(s->v.set.expr);
+        case ST_IF:
+            return expr_calls(s->v.ifs.cond) || stmt_calls(s->v.ifs.thenb) || stmt_calls(s->v.ifs.elseb);
+        case ST_REPEAT:
+            return expr_calls(s->v.repeat.count) || stmt_calls(s->v.repeat.body);
+        case ST_EXPR:
+            return expr_calls(s->v.expr.expr);
+    }
+    return 0;
+}
+
+static void count_expr(Expr *e, SymTab *st, int64_t *uses, int64_t w) {
+    if (!e) return;
+    switch (e->kind) {
+        case EX_NUM:
+        case EX_BOOL:
+        case EX_STR:
+            return;
+        case EX_LAMBDA: {
+            // the body runs once per element, weigh it like a repeat body
+            int64_t inner = w * LOOP_WEIGHT;
+            if (inner > MAX_WEIGHT) inner = MAX_WEIGHT;
+            count_expr(e->v.lambda.body, st, uses, inner);
+            return;
+        }
+        case EX_VAR: {
+            int idx = sym_find(st, e->v.var);
+            if (idx >= 0) uses[idx] += w;
+            return;
+        }
+        case EX_UNARY:
+            count_expr(e->v.un.expr, st, uses, w);
+            return;
+        case EX_BIN:
+            count_expr(e->v.bin.left, st, uses, w);
+            count_expr(e->v.bin.right, st, uses, w);
+            return;
+        case EX_CALL:
+            for (size_t i = 0; i < e->v.call.argc; i++) {
+                count_expr(e->v.call.args[i], st, uses, w);
+            }
+            return;
+    }
+}
+
+// loops[d] collects the hottest repeat counter at depth d that has to survive a call
+static void count_stmt(Stmt *s, SymTab *st, int64_t *uses, int64_t *loops, int depth, int64_t w) {
+    if (!s) return;
+    switch (s->kind) {
+        case ST_BLOCK:
+            for (size_t i = 0; i < s->v.block.count; i++) {
+                count_stmt(s->v.block.items[i], st, uses, loops, depth, w);
+            }
+            return;
+        case ST_PRINT:
+            count_expr(s->v.print.expr, st, uses, w);
+            return;
+        case ST_LET: {
+            count_expr(s->v.let.expr, st, uses, w);
+            int idx = sym_find(st, s->v.let.name);
+            if (idx >= 0) uses[idx] += w;
+            return;
+        }
+        case ST_SET: {
+            count_expr(s->v.set.expr, st, uses, w);
+            int idx = sym_find(st, s->v.set.name);
+            if (idx >= 0) uses[idx] += w;
+            return;
+        }
+        case ST_IF:
+            count_expr(s->v.ifs.cond, st, uses, w);
+            count_stmt(s->v.ifs.thenb, st, uses, loops, depth, w);
+            count_stmt(s->v.ifs.elseb, st, uses, loops, depth, w);
+            return;
+        case ST_REPEAT: {
+            count_expr(s->v.repeat.count, st, uses, w);
+            int64_t inner = w * LOOP_WEIGHT;
+            if (inner > MAX_WEIGHT) inner = MAX_WEIGHT;
+            // compare, then read and write for the decrement
+            if (depth < MAX_LOOP_DEPTH && inner * 3 > loops[depth] && stmt_calls(s->v.repeat.body)) {
+                loops[depth] = inner * 3;
+            }
+            count_stmt(s->v.repeat.body, st, uses, loops, depth + 1, inner);
+            return;
+        }
+        case ST_EXPR:
+            count_expr(s->v.expr.expr, st, uses, w);
+            return;
+    }
+}
+
+void regalloc(Stmt *prog, SymTab *st) {
+    if (st->count == 0) return;
+    int64_t *uses = (int64_t *)xmalloc(st->count * sizeof(int64_t));
+    memset(uses, 0, st->count * sizeof(int64_t));
+    int64_t loops[MAX_LOOP_DEPTH] = {0};
+    count_stmt(prog, st, uses, loops, 0, 1);
+
+    // greedy: hottest variable gets the next free register, the rest stay in rbp slots.
+    // a register lost to a loop depth is left free, regalloc_ir gives it to the counter
+    for (size_t r = 0; r < sizeof(var_regs) / sizeof(var_regs[0]); r++) {
+        int best = -1;
+        for (size_t i = 0; i < st->count; i++) {
+            if (st->items[i].reg != REG_NONE || uses[i] == 0) continue;
+            if (best < 0 || uses[i] > uses[best]) best = (int)i;
+        }
+        int loop = -1;
+        for (int d = 0; d < MAX_LOOP_DEPTH; d++) {
+            if (loops[d] > 0 && (loop < 0 || loops[d] > loops[loop])) loop = d;
+        }
+        if (loop >= 0 && (best < 0 || loops[loop] > uses[best])) {
+            loops[loop] = 0;
+            continue;
+        }
+        if (best < 0) break;
+        st->items[best].reg = var_regs[r];
+    }
+    free(uses);
+}
+
+// volatile, so only for temporaries that are dead across every call and print
+static const Reg scratch_regs[] = {REG_R8, REG_R9, REG_R10, REG_R11};
+
+// calls and prints clobber every volatile register (and r12 inside the list builtins),
+// the vector loops work in r8-r10
+static int clobbers_regs(IrInst *in) {
+    return in->op == IR_CALL || in->op == IR_PRINT || in->op == IR_PRINT_STR
+        || in->op == IR_VFILL || in->op == IR_VIOTA || in->op == IR_VMAP || in->op == IR_VSUM;
+}
+
+static int is_saved(Reg r, const Reg *saved, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (saved[i] == r) return 1;
+    }
+    return 0;
+}
+
+
+static Reg take_reg(const Reg *regs, size_t n, char *busy) {
+    for (size_t i = 0; i < n; i++) {
+        if (!busy[regs[i]]) {
+            busy[regs[i]] = 1;
+            return regs[i];
+        }
+    }
+    return REG_NONE;
+}
+
+// linear scan over the temporaries. the variables regalloc() left in memory go
+// through it too, they only ever get a slot, and share them with the temporaries
+// and with each other wherever their live ranges dont overlap
+void regalloc_ir(IrFunc *f, SymTab *st) {
+    int n = f->nvregs;
+    f->vreg_reg = (Reg *)xmalloc((size_t)n * sizeof(Reg) + sizeof(Reg));
+    f->vreg_slot = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    f->spill_slots = 0;
+    for (int v = 0; v < n; v++) {
+        f->vreg_reg[v] = v < f->nvars ? st->items[v].reg : REG_NONE;
+        f->vreg_slot[v] = -1;
+    }
+
+    ir_liveness(f);
+    int *start = (int *)xmalloc((size_t)n * sizeof(int));
+    int *end = (int *)xmalloc((size_t)n * sizeof(int));
+    char *crosses = (char *)xmalloc((size_t)n);
+    int64_t *weight = (int64_t *)xmalloc((size_t)n * sizeof(int64_t));
+    for (int v = 0; v < n; v++) {
+        start[v] = -1;
+        end[v] = -1;
+        crosses[v] = 0;
+        weight[v] = 0;
+    }
+    int *depth = ir_loop_depth(f);
+    // the temps live at the current point of the backward scan below, tpos[v] is
+    // where v sits in live or -1
+    int *live = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int *tpos = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int nlive = 0;
+    for (int v = 0; v < n; v++) tpos[v] = -1;
+
+#define EXTEND(v, p) do { \
+        if (start[v] < 0 || (p) < start[v]) start[v] = (p); \
+        if ((p) > end[v]) end[v] = (p); \
+    } while (0)
+
+    // a vreg that is live between blocks starts where it is first live into or
+    // out of one and ends where it is last, so each bit is only looked at in the
+    // first block that has it from the front and the first one from the back
+    int *bpos = (int *)xmalloc((f->count + 1) * sizeof(int));
+    bpos[0] = 0;
+    for (size_t i = 0; i < f->count; i++) bpos[i + 1] = bpos[i] + (int)f->blocks[i].count + 1;
+    size_t words = f->live_words;
+    uint64_t *seen = (uint64_t *)xmalloc(words * 3 * sizeof(uint64_t) + 8);
+    uint64_t *fin = seen + words;
+    uint64_t *fout = fin + words;
+    for (int dir = 0; dir < 2; dir++) {
+        memset(seen, 0, words * sizeof(uint64_t));
+        for (size_t r = 0; r < f->count; r++) {
+            size_t i = dir ? f->count - 1 - r : r;
+            IrBlock *b = &f->blocks[i];
+            for (size_t k = 0; k < words; k++) {
+                if (dir) {
+                    fout[k] = b->live_out[k] & ~seen[k];
+                    fin[k] = b->live_in[k] & ~seen[k] & ~fout[k];
+                } else {
+                    fin[k] = b->live_in[k] & ~seen[k];
+                    fout[k] = b->live_out[k] & ~seen[k] & ~fin[k];
+                }
+                seen[k] |= fin[k] | fout[k];
+            }
+            for (int k = ir_live_next(f, fin, 0); k >= 0; k = ir_live_next(f, fin, k + 1)) {
+                int v = f->live_vreg[k];
+                if (v >= f->nvars || f->vreg_reg[v] == REG_NONE) EXTEND(v, bpos[i]);
+            }
+            for (int k = ir_live_next(f, fout, 0); k >= 0; k = ir_live_next(f, fout, k + 1)) {
+                int v = f->live_vreg[k];
+                if (v >= f->nvars || f->vreg_reg[v] == REG_NONE) EXTEND(v, bpos[i + 1] - 1);
+            }
+        }
+    }
+    free(bpos);
+    free(seen);
+
+    // the globals are in vreg order, the temps among them start at tbit
+    int tbit = 0;
+    while (tbit < f->live_count && f->live_vreg[tbit] < f->nvars) tbit++;
+
+    int pos = 0;
+    for (size_t i = 0; i < f->count; i++) {
+        IrBlock *b = &f->blocks[i];
+        int64_t w = 1;
+        for (int d = 0; d < depth[i] && w < MAX_WEIGHT; d++) w *= LOOP_WEIGHT;
+        for (size_t j = 0; j < b->count; j++, pos++) {
+            IrInst *in = &b->insts[j];
+            for (size_t k = 0; k < in->argc; k++) {
+                int v = (int)in->args[k].v;
+                if (in->args[k].kind == IRV_VREG && (v >= f->nvars || f->vreg_reg[v] == REG_NONE)) {
+                    EXTEND(v, pos);
+                    weight[v] += w;
+                }
+            }
+            if (in->dst >= f->nvars || (in->dst >= 0 && f->vreg_reg[in->dst] == REG_NONE)) {
+                EXTEND(in->dst, pos);
+                weight[in->dst] += w;
+            }
+        }
+        if (b->term == TERM_BR && b->cond.kind == IRV_VREG
+            && (b->cond.v >= f->nvars || f->vreg_reg[b->cond.v] == REG_NONE)) {
+            EXTEND((int)b->cond.v, pos);
+            weight[b->cond.v] += w;
+        }
+        pos++;
+
+        // whatever is still needed after a call has to sit in a callee-saved register or memory
+        size_t c = 0;
+        while (c < b->count && !clobbers_regs(&b->insts[c])) c++;
+        if (c == b->count) continue;
+#define ADD_LIVE(v) do { \
+        if ((v) >= f->nvars && tpos[v] < 0) { \
+            tpos[v] = nlive; \
+            live[nlive++] = (v); \
+        } \
+    } while (0)
+        for (int k = ir_live_next(f, b->live_out, tbit); k >= 0; k = ir_live_next(f, b->live_out, k + 1)) {
+            ADD_LIVE(f->live_vreg[k]);
+        }
+        if (b->term == TERM_BR && b->cond.kind == IRV_VREG) ADD_LIVE((int)b->cond.v);
+        for (size_t j = b->count; j-- > 0;) {
+            IrInst *in = &b->insts[j];
+            if (in->dst >= 0 && tpos[in->dst] >= 0) {
+                int t = live[--nlive];
+                live[tpos[in->dst]] = t;
+                tpos[t] = tpos[in->dst];
+                tpos[in->dst] = -1;
+            }
+            if (clobbers_regs(in)) {
+                for (int k = 0; k < nlive; k++) crosses[live[k]] = 1;
+            }
+            for (size_t k = 0; k < in->argc; k++) {
+                if (in->args[k].kind == IRV_VREG) ADD_LIVE((int)in->args[k].v);
+            }
+        }
+#undef ADD_LIVE
+        while (nlive > 0) tpos[live[--nlive]] = -1;
+    }
+#undef EXTEND
+
+    char busy[16] = {0};
+    Reg saved[sizeof(var_regs) / sizeof(var_regs[0])];
+    size_t saved_count = 0;
+    for (size_t r = 0; r < sizeof(var_regs) / sizeof(var_regs[0]); r++) {
+        int used = 0;
+        for (size_t i = 0; i < st->count; i++) {
+            if (st->items[i].reg == var_regs[r]) used = 1;
+        }
+        if (!used) saved[saved_count++] = var_regs[r];
+    }
+
+    // sorted by start, and the variables once more by end. a counting sort,
+    // there can be thousands of variables in memory and no position is past pos
+    int *order = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int *by_end = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int *bucket = (int *)xmalloc((size_t)(pos + 2) * sizeof(int));
+    int count = 0, nmem = 0;
+    memset(bucket, 0, (size_t)(pos + 2) * sizeof(int));
+    for (int v = 0; v < n; v++) {
+        if (start[v] >= 0) bucket[start[v] + 1]++;
+    }
+    for (int k = 0; k <= pos; k++) bucket[k + 1] += bucket[k];
+    for (int v = 0; v < n; v++) {
+        if (start[v] < 0) continue;
+        order[bucket[start[v]]++] = v;
+        count++;
+    }
+    memset(bucket, 0, (size_t)(pos + 2) * sizeof(int));
+    for (int v = 0; v < f->nvars; v++) {
+        if (start[v] >= 0) bucket[end[v] + 1]++;
+    }
+    for (int k = 0; k <= pos; k++) bucket[k + 1] += bucket[k];
+    for (int v = 0; v < f->nvars; v++) {
+        if (start[v] < 0) continue;
+        by_end[bucket[end[v]]++] = v;
+        nmem++;
+    }
+
+    // the variables never hold a register and are never a victim, so they stay
+    // out of active and give their slots back in order of end
+    int *active = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int active_count = 0;
+    int mem_done = 0;
+    char *slot_busy = (char *)xmalloc((size_t)n + 1);
+    memset(slot_busy, 0, (size_t)n + 1);
+    for (int i = 0; i < count; i++) {
+        int v = order[i];
+        while (mem_done < nmem && end[by_end[mem_done]] < start[v]) slot_busy[f->vreg_slot[by_end[mem_done++]]] = 0;
+        int o = 0;
+        for (int k = 0; k < active_count; k++) {
+            int a = active[k];
+            if (end[a] < start[v]) {
+                if (f->vreg_reg[a] != REG_NONE) busy[f->vreg_reg[a]] = 0;
+                else slot_busy[f->vreg_slot[a]] = 0;
+            } else {
+                active[o++] = a;
+            }
+        }
+        active_count = o;
+
+        Reg r = REG_NONE;
+        int var = v < f->nvars;
+        if (!crosses[v] && !var) r = take_reg(scratch_regs, sizeof(scratch_regs) / sizeof(scratch_regs[0]), busy);
+        if (r == REG_NONE && !var) r = take_reg(saved, saved_count, busy);
+        if (r == REG_NONE && !var) {
+            // out of registers: a colder interval that is still live gives up its own,
+            // so loop counters and whatever was hoisted in front of a loop stay put
+            int victim = -1;
+            for (int k = 0; k < active_count; k++) {
+                int a = active[k];
+                if (f->vreg_reg[a] == REG_NONE || weight[a] >= weight[v]) continue;
+                if (crosses[v] && !is_saved(f->vreg_reg[a], saved, saved_count)) continue;
+                if (victim < 0 || weight[a] < weight[victim]) victim = a;
+            }
+            if (victim >= 0) {
+                r = f->vreg_reg[victim];
+                f->vreg_reg[victim] = REG_NONE;
+                // a slot nobody has used yet, earlier intervals may overlap the victim
+                f->vreg_slot[victim] = f->spill_slots++;
+                slot_busy[f->vreg_slot[victim]] = 1;
+            }
+        }
+        f->vreg_reg[v] = r;
+        if (r == REG_NONE) {
+            int s = 0;
+            while (slot_busy[s]) s++;
+            slot_busy[s] = 1;
+            f->vreg_slot[v] = s;
+            if (s + 1 > f->spill_slots) f->spill_slots = s + 1;
+        }
+        if (!var) active[active_count++] = v;
+    }
+
+    free(start);
+    free(end);
+    free(crosses);
+    free(weight);
+    free(depth);
+    free(live);
+    free(tpos);
+    free(order);
+    free(by_end);
+    free(bucket);
+    free(active);
+    free(slot_busy);
+}
+
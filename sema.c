@@ -1,9 +1,35 @@
 ﻿#include "common.h"
 
-void sym_add(SymTab *st, const char *name, TypeKind type) {
+// slot for name: either the one holding it or the empty one where it would go
+static size_t sym_slot(SymTab *st, const char *name) {
+    size_t mask = st->hash_cap - 1;
+    size_t i = str_hash(name, strlen(name)) & mask;
+    while (st->hash[i]) {
+        // names come interned from the lexer, strcmp only for anything built elsewhere
+        const char *n = st->items[st->hash[i] - 1].name;
+        if (n == name || strcmp(n, name) == 0) return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+
+static void sym_rehash(SymTab *st, size_t nc) {
+    free(st->hash);
+    st->hash = (int *)calloc(nc, sizeof(int));
+    if (!st->hash) die("out of memory");
+    st->hash_cap = nc;
     for (size_t i = 0; i < st->count; i++) {
-        if (strcmp(st->items[i].name, name) == 0) die("duplicate variable");
+        st->hash[sym_slot(st, st->items[i].name)] = (int)i + 1;
     }
+}
+
+
+void sym_add(SymTab *st, const char *name, TypeKind type) {
+    // keep the load under 1/2 so probes stay short
+    if ((st->count + 1) * 2 > st->hash_cap) sym_rehash(st, st->hash_cap ? st->hash_cap * 2 : 64);
+    size_t slot = sym_slot(st, name);
+    if (st->hash[slot]) die("duplicate variable");
     if (st->count == st->cap) {
         size_t nc = st->cap ? st->cap * 2 : 32;
         st->items = (Sym *)realloc(st->items, nc * sizeof(Sym));
@@ -13,17 +39,151 @@ void sym_add(SymTab *st, const char *name, TypeKind type) {
     st->items[st->count].name = (char *)name;
     st->items[st->count].index = (int)st->count;
     st->items[st->count].type = type;
+    st->items[st->count].reg = REG_NONE;
+    st->items[st->count].first = st->pos;
+    st->items[st->count].last = st->pos;
+    st->items[st->count].hold = -1;
+    st->items[st->count].slot = (int)st->count;
+    st->items[st->count].closed = 0;
+    st->items[st->count].escaped = 0;
     st->count++;
+    st->hash[slot] = (int)st->count;
 }
 
 int sym_find(SymTab *st, const char *name) {
-    for (size_t i = 0; i < st->count; i++) {
-        if (strcmp(st->items[i].name, name) == 0) return (int)i;
+    if (!st->hash_cap) return -1;
+    return st->hash[sym_slot(st, name)] - 1;
+}
+
+
+// a use at the current statement. one inside a repeat the variable was declared
+// before has to survive the whole repeat, the next round reads it again.
+// a use after the block it was declared in closed may see it never set, so it
+// keeps its own slot from the start and reads what it always did
+static void sym_use(SymTab *st, int idx) {
+    Sym *s = &st->items[idx];
+    if (s->closed) s->escaped = 1;
+    int first = s->escaped ? 0 : s->first;
+    s->last = st->pos;
+    for (int k = 0; k < st->loop_depth; k++) {
+        int id = st->loops[k];
+        if (st->loop_start[id] > first) {
+            s->hold = id;
+            break;
+        }
+    }
+}
+
+
+static void sym_close(SymTab *st, size_t mark) {
+    for (size_t i = mark; i < st->count; i++) st->items[i].closed = 1;
+}
+
+
+static void loop_open(SymTab *st) {
+    if (st->loop_count == st->loop_cap) {
+        st->loop_cap = st->loop_cap ? st->loop_cap * 2 : 16;
+        st->loop_start = (int *)realloc(st->loop_start, (size_t)st->loop_cap * sizeof(int));
+        st->loop_end = (int *)realloc(st->loop_end, (size_t)st->loop_cap * sizeof(int));
+        if (!st->loop_start || !st->loop_end) die("out of memory");
+    }
+    if (st->loop_depth == st->loop_depth_cap) {
+        st->loop_depth_cap = st->loop_depth_cap ? st->loop_depth_cap * 2 : 8;
+        st->loops = (int *)realloc(st->loops, (size_t)st->loop_depth_cap * sizeof(int));
+        if (!st->loops) die("out of memory");
+    }
+    st->loop_start[st->loop_count] = st->pos;
+    st->loop_end[st->loop_count] = st->pos;
+    st->loops[st->loop_depth++] = st->loop_count++;
+}
+
+
+static void loop_close(SymTab *st) {
+    st->loop_end[st->loops[--st->loop_depth]] = st->pos;
+}
+
+
+// give every variable a frame slot, sharing them between variables whose live
+// ranges dont overlap. linear scan in order of first use, a slot that frees up
+// goes to the next one that needs it so the hot part of the frame stays small.
+// returns how many slots the frame needs
+int sym_pack(SymTab *st) {
+    int n = (int)st->count;
+    int *start = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int *end = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int *order = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int *by_end = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int *free_slots = (int *)xmalloc((size_t)n * sizeof(int) + sizeof(int));
+    int *bucket = (int *)xmalloc((size_t)(st->pos + 2) * sizeof(int));
+    memset(bucket, 0, (size_t)(st->pos + 2) * sizeof(int));
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        Sym *s = &st->items[i];
+        start[i] = s->escaped ? 0 : s->first;
+        end[i] = s->last;
+        if (s->hold >= 0 && st->loop_end[s->hold] > end[i]) end[i] = st->loop_end[s->hold];
+        bucket[end[i] + 1]++;
+        // declared in order, so only the escaped ones are out of place
+        if (s->escaped) order[count++] = i;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!st->items[i].escaped) order[count++] = i;
+    }
+    for (int k = 0; k <= st->pos; k++) bucket[k + 1] += bucket[k];
+    for (int i = 0; i < n; i++) by_end[bucket[end[i]]++] = i;
+
+    int nslots = 0, nfree = 0, done = 0;
+    for (int k = 0; k < n; k++) {
+        int v = order[k];
+        while (done < n && end[by_end[done]] < start[v]) free_slots[nfree++] = st->items[by_end[done++]].slot;
+        st->items[v].slot = nfree ? free_slots[--nfree] : nslots++;
+    }
+    free(start);
+    free(end);
+    free(order);
+    free(by_end);
+    free(free_slots);
+    free(bucket);
+    return nslots;
+}
+
+static const char *builtin_names[BI_COUNT] = {
+    "создать.лист.цифр",
+    "создать.массив.цифр",
+    "сколько.внутри",
+    "дай.по.индексу",
+    "сунь.по.индексу",
+    "впихни.в.лист",
+    "достань.последний",
+    "диапазон.от.0.до",
+    "зарезервировать",
+    "переделай.каждый",
+    "оставь.если",
+    "сверни.в.одно",
+    "для.каждого"
+};
+
+Builtin builtin_find(const char *name) {
+    for (int i = 0; i < BI_COUNT; i++) {
+        if (strcmp(builtin_names[i], name) == 0) return (Builtin)i;
+    }
+    return BI_NONE;
+}
+
+const char *builtin_name(Builtin b) {
+    return builtin_names[b];
+}
+
+
+// innermost first, so a parameter hides anything outside with the same name
+int param_find(const Params *ps, const char *name) {
+    for (int i = ps->count - 1; i >= 0; i--) {
+        if (ps->name[i] && strcmp(ps->name[i], name) == 0) return i;
     }
     return -1;
 }
 
-static TypeKind type_expr_inner(Expr *e, SymTab *st, const char *param);
+static TypeKind type_expr_inner(Expr *e, SymTab *st, Params *ps);
 static TypeKind type_expr(Expr *e, SymTab *st);
 
 static int expr_depth(Expr *e) {
@@ -49,9 +209,22 @@ static int expr_depth(Expr *e) {
             }
         }
         case EX_CALL: {
+            Builtin fn = builtin_find(e->v.call.name);
+            if (fn >= BI_MAP) {
+                // the list, its length, the result and whatever did not get a
+                // register sit on the vstack under the body
+                Expr **args = e->v.call.args;
+                Expr *lam = args[e->v.call.argc - 1];
+                int d = expr_depth(args[0]);
+                int under = (fn == BI_MAP || fn == BI_FILTER ? 3 : 2) + (int)lam->v.lambda.nparams + 1;
+                if (fn == BI_REDUCE && 1 + expr_depth(args[1]) > d) d = 1 + expr_depth(args[1]);
+                if (under + expr_depth(lam->v.lambda.body) > d) d = under + expr_depth(lam->v.lambda.body);
+                return d;
+            }
             int d = 0;
             for (size_t i = 0; i < e->v.call.argc; i++) {
-                int a = expr_depth(e->v.call.args[i]);
+                // set keeps both of its first args on the vstack when the last one calls
+                int a = expr_depth(e->v.call.args[i]) + (int)i;
                 if (a > d) d = a;
             }
             return d;
@@ -62,7 +235,20 @@ static int expr_depth(Expr *e) {
     return 0;
 }
 
-static TypeKind type_expr_inner(Expr *e, SymTab *st, const char *param) {
+// the type of the body with the parameters in scope, TY_INVALID when e is not a
+// lambda taking nparams. one more slot goes to the loop index the call runs it in
+static TypeKind type_lambda(Expr *e, SymTab *st, Params *ps, size_t nparams) {
+    if (e->kind != EX_LAMBDA || e->v.lambda.nparams != nparams) return TY_INVALID;
+    Params inner;
+    if (ps) inner = *ps;
+    else inner.count = 0;
+    if (inner.count + (int)nparams + 1 > LAMBDA_PARAMS) die("lambdas nested too deep");
+    for (size_t i = 0; i < nparams; i++) inner.name[inner.count++] = e->v.lambda.params[i];
+    inner.name[inner.count++] = 0;
+    return type_expr_inner(e->v.lambda.body, st, &inner);
+}
+
+static TypeKind type_expr_inner(Expr *e, SymTab *st, Params *ps) {
     if (!e) return TY_INVALID;
     switch (e->kind) {
         case EX_NUM:
@@ -71,27 +257,27 @@ static TypeKind type_expr_inner(Expr *e, SymTab *st, const char *param) {
         case EX_STR:
             return TY_INVALID;
         case EX_VAR: {
-            if (param && strcmp(e->v.var, param) == 0) return TY_INT;
+            if (ps && param_find(ps, e->v.var) >= 0) return TY_INT;
             int idx = sym_find(st, e->v.var);
             if (idx < 0) die("unknown variable");
+            sym_use(st, idx);
             return st->items[idx].type;
         }
         case EX_UNARY: {
-            TypeKind t = type_expr_inner(e->v.un.expr, st, param);
+            TypeKind t = type_expr_inner(e->v.un.expr, st, ps);
             if (t != TY_INT) die("bad unary");
             return TY_INT;
         }
         case EX_BIN: {
-            TypeKind a = type_expr_inner(e->v.bin.left, st, param);
-            TypeKind b = type_expr_inner(e->v.bin.right, st, param);
+            TypeKind a = type_expr_inner(e->v.bin.left, st, ps);
+            TypeKind b = type_expr_inner(e->v.bin.right, st, ps);
             if (a != TY_INT || b != TY_INT) die("bad binary");
             return TY_INT;
         }
-        case EX_LAMBDA: {
-            TypeKind t = type_expr_inner(e->v.lambda.body, st, e->v.lambda.param);
-            if (t != TY_INT) die("lambda returns non-int");
+        case EX_LAMBDA:
+            // only the list builtins take one, anywhere else it is an error further up
+            if (type_lambda(e, st, ps, e->v.lambda.nparams) != TY_INT) die("lambda returns non-int");
             return TY_LAMBDA;
-        }
         case EX_CALL: {
             const char *name = e->v.call.name;
             size_t argc = e->v.call.argc;
@@ -99,51 +285,89 @@ static TypeKind type_expr_inner(Expr *e, SymTab *st, const char *param) {
             // builtin calls are hardcoded, keep it dumb
             if (strcmp(name, "создать.лист.цифр") == 0) {
                 if (argc == 0) return TY_LIST;
-                if (argc == 1 && type_expr_inner(args[0], st, param) == TY_INT) return TY_LIST;
+                if (argc == 1 && type_expr_inner(args[0], st, ps) == TY_INT) return TY_LIST;
                 die("создать.лист.цифр(args)");
             }
             if (strcmp(name, "создать.массив.цифр") == 0) {
-                if (argc == 1 && type_expr_inner(args[0], st, param) == TY_INT) return TY_ARRAY;
+                if (argc == 1 && type_expr_inner(args[0], st, ps) == TY_INT) return TY_ARRAY;
                 die("создать.массив.цифр(n)");
             }
             if (strcmp(name, "сколько.внутри") == 0) {
                 if (argc == 1) {
-                    TypeKind t = type_expr_inner(args[0], st, param);
+                    TypeKind t = type_expr_inner(args[0], st, ps);
                     if (t == TY_LIST || t == TY_ARRAY) return TY_INT;
                 }
                 die("сколько.внутри(x)");
             }
             if (strcmp(name, "впихни.в.лист") == 0) {
                 if (argc == 2) {
-                    TypeKind t = type_expr_inner(args[0], st, param);
-                    if (t == TY_LIST && type_expr_inner(args[1], st, param) == TY_INT) return TY_LIST;
+                    TypeKind t = type_expr_inner(args[0], st, ps);
+                    if (t == TY_LIST && type_expr_inner(args[1], st, ps) == TY_INT) return TY_LIST;
                 }
                 die("впихни.в.лист(list, value)");
             }
             if (strcmp(name, "достань.последний") == 0) {
-                if (argc == 1 && type_expr_inner(args[0], st, param) == TY_LIST) return TY_INT;
+                if (argc == 1 && type_expr_inner(args[0], st, ps) == TY_LIST) return TY_INT;
                 die("достань.последний(list)");
             }
             if (strcmp(name, "дай.по.индексу") == 0) {
                 if (argc == 2) {
-                    TypeKind t = type_expr_inner(args[0], st, param);
-                    if ((t == TY_LIST || t == TY_ARRAY) && type_expr_inner(args[1], st, param) == TY_INT) return TY_INT;
+                    TypeKind t = type_expr_inner(args[0], st, ps);
+                    if ((t == TY_LIST || t == TY_ARRAY) && type_expr_inner(args[1], st, ps) == TY_INT) return TY_INT;
                 }
                 die("дай.по.индексу(list, i)");
             }
             if (strcmp(name, "сунь.по.индексу") == 0) {
                 if (argc == 3) {
-                    TypeKind t = type_expr_inner(args[0], st, param);
+                    TypeKind t = type_expr_inner(args[0], st, ps);
                     if ((t == TY_LIST || t == TY_ARRAY) &&
-                        type_expr_inner(args[1], st, param) == TY_INT &&
-                        type_expr_inner(args[2], st, param) == TY_INT) return TY_INT;
+                        type_expr_inner(args[1], st, ps) == TY_INT &&
+                        type_expr_inner(args[2], st, ps) == TY_INT) return TY_INT;
                 }
                 die("сунь.по.индексу(list, i, v)");
             }
             if (strcmp(name, "диапазон.от.0.до") == 0) {
-                if (argc == 1 && type_expr_inner(args[0], st, param) == TY_INT) return TY_LIST;
+                if (argc == 1 && type_expr_inner(args[0], st, ps) == TY_INT) return TY_LIST;
                 die("диапазон.от.0.до(n)");
             }
+            if (strcmp(name, "зарезервировать") == 0) {
+                if (argc == 2 &&
+                    type_expr_inner(args[0], st, ps) == TY_LIST &&
+                    type_expr_inner(args[1], st, ps) == TY_INT) return TY_LIST;
+                die("зарезервировать(list, n)");
+            }
+            if (strcmp(name, "переделай.каждый") == 0) {
+                if (argc == 2) {
+                    TypeKind t = type_expr_inner(args[0], st, ps);
+                    if ((t == TY_LIST || t == TY_ARRAY) && type_lambda(args[1], st, ps, 1) == TY_INT) return TY_LIST;
+                }
+                die("переделай.каждый(list, (x) => v)");
+            }
+            if (strcmp(name, "оставь.если") == 0) {
+                if (argc == 2) {
+                    TypeKind t = type_expr_inner(args[0], st, ps);
+                    if ((t == TY_LIST || t == TY_ARRAY) && type_lambda(args[1], st, ps, 1) == TY_INT) return TY_LIST;
+                }
+                die("оставь.если(list, (x) => cond)");
+            }
+            if (strcmp(name, "сверни.в.одно") == 0) {
+                if (argc == 3) {
+                    TypeKind t = type_expr_inner(args[0], st, ps);
+                    if ((t == TY_LIST || t == TY_ARRAY) &&
+                        type_expr_inner(args[1], st, ps) == TY_INT &&
+                        type_lambda(args[2], st, ps, 2) == TY_INT) return TY_INT;
+                }
+                die("сверни.в.одно(list, init, (acc, x) => v)");
+            }
+            if (strcmp(name, "для.каждого") == 0) {
+                // the body is only run for what it does, so it can be a push as well
+                if (argc == 2) {
+                    TypeKind t = type_expr_inner(args[0], st, ps);
+                    TypeKind b = type_lambda(args[1], st, ps, 1);
+                    if ((t == TY_LIST || t == TY_ARRAY) && b != TY_INVALID && b != TY_LAMBDA) return t;
+                }
+                die("для.каждого(list, (x) => expr)");
+            }
             die("unknown call");
         }
     }
@@ -162,6 +386,7 @@ void sem_stmt(Stmt *s, SymTab *st, int *max_stack, int *max_repeat, int repeat_d
         }
         return;
     }
+    st->pos++;
     if (s->kind == ST_PRINT) {
         TypeKind t = type_expr(s->v.print.expr, st);
         if (s->v.print.expr->kind == EX_STR || t == TY_INT) {
@@ -182,6 +407,7 @@ void sem_stmt(Stmt *s, SymTab *st, int *max_stack, int *max_repeat, int repeat_d
     if (s->kind == ST_SET) {
         int idx = sym_find(st, s->v.set.name);
         if (idx < 0) die("unknown variable");
+        sym_use(st, idx);
         TypeKind t = type_expr(s->v.set.expr, st);
         if (t != st->items[idx].type) die("type mismatch");
         int d = expr_depth(s->v.set.expr);
@@ -192,8 +418,12 @@ void sem_stmt(Stmt *s, SymTab *st, int *max_stack, int *max_repeat, int repeat_d
         if (type_expr(s->v.ifs.cond, st) != TY_INT) die("bad if");
         int d = expr_depth(s->v.ifs.cond);
         if (d > *max_stack) *max_stack = d;
+        size_t mark = st->count;
         sem_stmt(s->v.ifs.thenb, st, max_stack, max_repeat, repeat_depth);
+        sym_close(st, mark);
+        mark = st->count;
         sem_stmt(s->v.ifs.elseb, st, max_stack, max_repeat, repeat_depth);
+        sym_close(st, mark);
         return;
     }
     if (s->kind == ST_REPEAT) {
@@ -202,7 +432,11 @@ void sem_stmt(Stmt *s, SymTab *st, int *max_stack, int *max_repeat, int repeat_d
         if (d > *max_stack) *max_stack = d;
         int nd = repeat_depth + 1;
         if (nd > *max_repeat) *max_repeat = nd;
+        size_t mark = st->count;
+        loop_open(st);
         sem_stmt(s->v.repeat.body, st, max_stack, max_repeat, nd);
+        loop_close(st);
+        sym_close(st, mark);
         return;
     }
     if (s->kind == ST_EXPR) {
@@ -212,4 +446,4 @@ void sem_stmt(Stmt *s, SymTab *st, int *max_stack, int *max_repeat, int repeat_d
         if (d > *max_stack) *max_stack = d;
         return;
     }
-}
+}
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+# regression programs: each tests/*.1c is compiled plain and with -O, run, and
+# compared against what --run prints for it.
+#
+#   python tests/run.py [--cc PATH]
+
+import argparse
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+
+
+def default_cc():
+    for name in ("1cotlinc.exe", "1cotlinc"):
+        p = os.path.join(ROOT, name)
+        if os.path.exists(p):
+            return p
+    return os.path.join(ROOT, "1cotlinc")
+
+
+def run(cmd):
+    r = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    return r.returncode, r.stdout
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--cc", default=default_cc())
+    args = ap.parse_args()
+
+    host = platform.system()
+    target = [] if host == "Windows" else ["--target=linux-x86_64"]
+    can_run = platform.machine().lower() in ("x86_64", "amd64")
+    work = tempfile.mkdtemp(prefix="1cotlin-tests-")
+    srcs = sorted(f for f in os.listdir(HERE) if f.endswith(".1c"))
+    bad = 0
+    for f in srcs:
+        src = os.path.join(HERE, f)
+        rc, want = run([args.cc, "--run", src])
+        if rc != 0:
+            print("%-20s --run failed" % f)
+            bad += 1
+            continue
+        for flags in ([], ["-O"]):
+            exe = os.path.join(work, "t.exe" if host == "Windows" else "t")
+            name = "%s %s" % (f, " ".join(flags))
+            rc, _ = run([args.cc] + flags + target + [src, exe])
+            if rc != 0:
+                print("%-20s compile failed" % name)
+                bad += 1
+                continue
+            if not can_run:
+                continue
+            rc, got = run([exe])
+            if rc != 0 or got != want:
+                print("%-20s wrong output" % name)
+                bad += 1
+    print("%d programs, %d failures" % (len(srcs), bad))
+    sys.exit(1 if bad else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,4 +1,18 @@
 ﻿#include "common.h"
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 void die(const char *msg) {
     fprintf(stderr, "%s\n", msg);
@@ -21,13 +35,179 @@ char *xstrndup(const char *s, size_t n) {
 }
 
 
+// front-end memory: tokens, names, ast, code buffers. bump allocated out of
+// REGION_BLOCK sized blocks, zeroed, and all released together by region_free
+static void *region_take(Region *rg, size_t n, size_t align) {
+    uintptr_t p = ((uintptr_t)rg->ptr + align - 1) & ~(uintptr_t)(align - 1);
+    if (!rg->ptr || p + n > (uintptr_t)rg->end) {
+        // big requests get a block of their own so the current one keeps going
+        if (n > REGION_BLOCK / 4) {
+            RegionBlock *b = (RegionBlock *)calloc(1, sizeof(RegionBlock) + n);
+            if (!b) die("out of memory");
+            b->own = 1;
+            b->next = rg->blocks;
+            rg->blocks = b;
+            return b + 1;
+        }
+        RegionBlock *b = (RegionBlock *)calloc(1, sizeof(RegionBlock) + REGION_BLOCK);
+        if (!b) die("out of memory");
+        b->next = rg->blocks;
+        rg->blocks = b;
+        rg->ptr = (char *)(b + 1);
+        rg->end = rg->ptr + REGION_BLOCK;
+        p = ((uintptr_t)rg->ptr + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    rg->ptr = (char *)(p + n);
+    return (void *)p;
+}
+
+
+void *region_alloc(Region *rg, size_t n) {
+    return region_take(rg, n, 16);
+}
+
+
+char *region_strndup(Region *rg, const char *s, size_t n) {
+    char *p = (char *)region_take(rg, n + 1, 1);
+    memcpy(p, s, n);
+    return p;
+}
+
+
+// realloc for growable arrays. the newest allocation grows in place when the
+// block has room, an array that already has a block of its own is realloc'd,
+// anything else is copied and the old copy just stays put
+void *region_grow(Region *rg, void *old, size_t old_n, size_t new_n) {
+    if (old && (char *)old + old_n == rg->ptr && (size_t)(rg->end - (char *)old) >= new_n) {
+        rg->ptr = (char *)old + new_n;
+        return old;
+    }
+    if (old && old_n > REGION_BLOCK / 4) {
+        for (RegionBlock **pb = &rg->blocks; *pb; pb = &(*pb)->next) {
+            if (!(*pb)->own || (void *)(*pb + 1) != old) continue;
+            RegionBlock *b = (RegionBlock *)realloc(*pb, sizeof(RegionBlock) + new_n);
+            if (!b) die("out of memory");
+            memset((char *)(b + 1) + old_n, 0, new_n - old_n);
+            *pb = b;
+            return b + 1;
+        }
+    }
+    void *p = region_alloc(rg, new_n);
+    if (old) memcpy(p, old, old_n);
+    return p;
+}
+
+
+// drop everything but the current block and hand that one out again from
+// the start. only the part that was used needs zeroing
+void region_reset(Region *rg) {
+    RegionBlock *keep = 0;
+    RegionBlock *b = rg->blocks;
+    while (b) {
+        RegionBlock *next = b->next;
+        if (!keep && rg->end == (char *)(b + 1) + REGION_BLOCK) keep = b;
+        else free(b);
+        b = next;
+    }
+    rg->blocks = keep;
+    if (!keep) {
+        rg->ptr = 0;
+        rg->end = 0;
+        return;
+    }
+    keep->next = 0;
+    memset(keep + 1, 0, (size_t)(rg->ptr - (char *)(keep + 1)));
+    rg->ptr = (char *)(keep + 1);
+}
+
+
+void region_free(Region *rg) {
+    RegionBlock *b = rg->blocks;
+    while (b) {
+        RegionBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    rg->blocks = 0;
+    rg->ptr = 0;
+    rg->end = 0;
+}
+
+
+// fnv-1a, shared by the string pool and the symbol table
+uint32_t str_hash(const char *s, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) h = (h ^ (uint8_t)s[i]) * 16777619u;
+    return h;
+}
+
+
+static void pool_grow(StrPool *sp) {
+    size_t nc = sp->cap ? sp->cap * 2 : 1024;
+    char **slots = (char **)region_alloc(sp->rg, nc * sizeof(char *));
+    uint32_t *hashes = (uint32_t *)region_alloc(sp->rg, nc * sizeof(uint32_t));
+    for (size_t i = 0; i < sp->cap; i++) {
+        if (!sp->slots[i]) continue;
+        size_t j = sp->hashes[i] & (nc - 1);
+        while (slots[j]) j = (j + 1) & (nc - 1);
+        slots[j] = sp->slots[i];
+        hashes[j] = sp->hashes[i];
+    }
+    sp->slots = slots;
+    sp->hashes = hashes;
+    sp->cap = nc;
+}
+
+
+char *str_intern(StrPool *sp, const char *s, size_t n) {
+    if ((sp->count + 1) * 2 > sp->cap) pool_grow(sp);
+    uint32_t h = str_hash(s, n);
+    size_t mask = sp->cap - 1;
+    size_t i = h & mask;
+    while (sp->slots[i]) {
+        if (sp->hashes[i] == h && strncmp(sp->slots[i], s, n) == 0 && sp->slots[i][n] == 0) return sp->slots[i];
+        i = (i + 1) & mask;
+    }
+    sp->slots[i] = region_strndup(sp->rg, s, n);
+    sp->hashes[i] = h;
+    sp->count++;
+    return sp->slots[i];
+}
+
+
 size_t align_up(size_t v, size_t a) {
     return (v + a - 1) & ~(a - 1);
 }
 
+
+// wall clock for --time, milliseconds from some arbitrary start
+double now_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+// 8 utf-16 units at a time while they are all ascii: check the high 9 bits are
+// clear, then pack the low bytes. returns how many input bytes it ate
+static size_t utf16_ascii_run(const uint8_t *raw, size_t n, char *out) {
+    const __m128i hi = _mm_set1_epi16((short)0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(raw + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, hi), zero)) != 0xFFFF) break;
+        _mm_storel_epi64((__m128i *)(out + i / 2), _mm_packus_epi16(v, v));
+        i += 16;
+    }
+    return i;
+}
+#endif
+
+// one pass straight over the mapped bytes, no intermediate copy. every utf-16
+// unit is at most 3 utf-8 bytes (a pair is 4 for 4), so the output is sized once
 static char *utf16le_to_utf8(const uint8_t *raw, size_t n, size_t *out_len) {
-    size_t cap = n * 2 + 1;
-    char *out = (char *)xmalloc(cap);
+    char *out = (char *)xmalloc(n / 2 * 3 + 1);
     size_t o = 0;
     size_t i = 0;
     if (n >= 2 && raw[0] == 0xFF && raw[1] == 0xFE) {
@@ -35,6 +215,15 @@ static char *utf16le_to_utf8(const uint8_t *raw, size_t n, size_t *out_len) {
     }
     while (i + 1 < n) {
         uint16_t w1 = (uint16_t)(raw[i] | (raw[i + 1] << 8));
+#if defined(__SSE2__) || defined(_M_X64)
+        if (w1 < 0x80) {
+            size_t k = utf16_ascii_run(raw + i, n - i, out + o);
+            i += k;
+            o += k / 2;
+            if (i + 1 >= n) break;
+            w1 = (uint16_t)(raw[i] | (raw[i + 1] << 8));
+        }
+#endif
         i += 2;
         uint32_t cp = w1;
         if (w1 >= 0xD800 && w1 <= 0xDBFF) {
@@ -67,53 +256,132 @@ static char *utf16le_to_utf8(const uint8_t *raw, size_t n, size_t *out_len) {
     return out;
 }
 
-char *read_file(const char *path, size_t *out_len) {
+
+#ifdef _WIN32
+static bool map_file(const char *path, SourceFile *sf) {
+    HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (f == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(f, &size) || size.QuadPart == 0) {
+        CloseHandle(f);
+        return false;
+    }
+    HANDLE m = CreateFileMappingA(f, 0, PAGE_READONLY, 0, 0, 0);
+    CloseHandle(f);
+    if (!m) return false;
+    void *p = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(m);
+    if (!p) return false;
+    sf->map = p;
+    sf->map_len = (size_t)size.QuadPart;
+    return true;
+}
+
+
+static void unmap_file(SourceFile *sf) {
+    UnmapViewOfFile(sf->map);
+}
+
+#else
+
+static bool map_file(const char *path, SourceFile *sf) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return false;
+#ifdef MADV_SEQUENTIAL
+    madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    sf->map = p;
+    sf->map_len = (size_t)st.st_size;
+    return true;
+}
+
+
+static void unmap_file(SourceFile *sf) {
+    munmap(sf->map, sf->map_len);
+}
+
+#endif
+
+
+// pipes, empty files and anything else that wont map
+static bool slurp_file(const char *path, SourceFile *sf) {
     FILE *f = fopen(path, "rb");
-    if (!f) return 0;
-    fseek(f, 0, SEEK_END);
-    long n = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    uint8_t *raw = (uint8_t *)xmalloc((size_t)n);
-    if (fread(raw, 1, (size_t)n, f) != (size_t)n) {
-        fclose(f);
-        free(raw);
-        return 0;
+    if (!f) return false;
+    size_t cap = 1 << 16, n = 0;
+    char *buf = (char *)xmalloc(cap);
+    size_t got;
+    while ((got = fread(buf + n, 1, cap - n, f)) > 0) {
+        n += got;
+        if (n == cap) {
+            cap *= 2;
+            buf = (char *)realloc(buf, cap);
+            if (!buf) die("out of memory");
+        }
     }
     fclose(f);
+    sf->buf = buf;
+    sf->data = buf;
+    sf->len = n;
+    return true;
+}
 
-    if ((size_t)n >= 2 && raw[0] == 0xFF && raw[1] == 0xFE) {
-        char *out = utf16le_to_utf8(raw, (size_t)n, out_len);
-        free(raw);
-        return out;
+
+// the lexer only ever looks at data[0..len), nothing needs a terminator
+bool read_file(const char *path, SourceFile *sf) {
+    memset(sf, 0, sizeof(*sf));
+    if (map_file(path, sf)) {
+        sf->data = (const char *)sf->map;
+        sf->len = sf->map_len;
+    } else if (!slurp_file(path, sf)) {
+        return false;
     }
-    if ((size_t)n >= 3 && raw[0] == 0xEF && raw[1] == 0xBB && raw[2] == 0xBF) {
-        size_t len = (size_t)n - 3;
-        char *out = (char *)xmalloc(len + 1);
-        memcpy(out, raw + 3, len);
-        out[len] = 0;
-        if (out_len) *out_len = len;
-        free(raw);
-        return out;
+
+    const uint8_t *raw = (const uint8_t *)sf->data;
+    size_t n = sf->len;
+    if (n >= 2 && raw[0] == 0xFF && raw[1] == 0xFE) {
+        size_t len = 0;
+        char *out = utf16le_to_utf8(raw, n, &len);
+        // the raw bytes are done with, only the transcoded copy is lexed
+        close_file(sf);
+        sf->buf = out;
+        sf->data = out;
+        sf->len = len;
+        return true;
+    }
+    if (n >= 3 && raw[0] == 0xEF && raw[1] == 0xBB && raw[2] == 0xBF) {
+        sf->data += 3;
+        sf->len -= 3;
     }
+    return true;
+}
+
 
-    char *buf = (char *)xmalloc((size_t)n + 1);
-    memcpy(buf, raw, (size_t)n);
-    buf[n] = 0;
-    if (out_len) *out_len = (size_t)n;
-    free(raw);
-    return buf;
+void close_file(SourceFile *sf) {
+    if (sf->map) unmap_file(sf);
+    free(sf->buf);
+    memset(sf, 0, sizeof(*sf));
 }
 
 
-char *default_output(const char *in) {
+// ext is ".exe" for windows and "" for linux, where a bare name would overwrite the source
+char *default_output(const char *in, const char *ext) {
     size_t n = strlen(in);
     char *out = (char *)xmalloc(n + 5);
     memcpy(out, in, n);
+    out[n] = 0;
     char *dot = strrchr(out, '.');
     if (dot) {
-        strcpy(dot, ".exe");
+        strcpy(dot, ext);
     } else {
-        strcat(out, ".exe");
+        strcat(out, *ext ? ext : ".out");
     }
     return out;
 }
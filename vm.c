@@ -0,0 +1,550 @@
+﻿#include "common.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+// register bytecode for --run. same ast, same sema, no exe.
+// one list for the opcodes so the enum and the goto table cant drift apart
+#define VM_OPS(X) \
+    X(LOADI) X(LOADK) X(MOV) \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(EQ) X(NE) X(LT) X(GT) X(LE) X(GE) \
+    X(SHL) X(NEG) X(NOT) X(BOOL) \
+    X(JMP) X(JZ) X(JNZ) X(JLE0) X(LOOP) \
+    X(PRINT) X(PRINTS) \
+    X(NEWLIST) X(NEWARRAY) X(LEN) X(GET) X(SET) X(PUSH) X(POP) X(RANGE) X(RESERVE) \
+    X(HALT)
+
+#define VM_ENUM(n) VM_##n,
+typedef enum {
+    VM_OPS(VM_ENUM)
+    VM_OP_COUNT
+} VmOp;
+
+// same layout as the native header, [len, cap, data]
+typedef struct {
+    int64_t len;
+    int64_t cap;
+    int64_t *data;
+} VmList;
+
+typedef struct {
+    VmProg *p;
+    SymTab *st;
+    int top;
+    Params params;
+} VmBuilder;
+
+static size_t emit_op(VmProg *p, VmOp op, int32_t a, int32_t b, int32_t c) {
+    if (p->count == p->cap) {
+        size_t nc = p->cap ? p->cap * 2 : 256;
+        p->code = (VmInst *)realloc(p->code, nc * sizeof(VmInst));
+        if (!p->code) die("out of memory");
+        p->cap = nc;
+    }
+    VmInst *in = &p->code[p->count];
+    in->op = op;
+    in->a = a;
+    in->b = b;
+    in->c = c;
+    return p->count++;
+}
+
+
+static int32_t add_const(VmProg *p, int64_t v) {
+    if (p->consts_count == p->consts_cap) {
+        size_t nc = p->consts_cap ? p->consts_cap * 2 : 16;
+        p->consts = (int64_t *)realloc(p->consts, nc * sizeof(int64_t));
+        if (!p->consts) die("out of memory");
+        p->consts_cap = nc;
+    }
+    p->consts[p->consts_count] = v;
+    return (int32_t)p->consts_count++;
+}
+
+
+static int32_t add_str(VmProg *p, StringLit *s) {
+    if (p->strs_count == p->strs_cap) {
+        size_t nc = p->strs_cap ? p->strs_cap * 2 : 16;
+        p->strs = (StringLit **)realloc(p->strs, nc * sizeof(StringLit *));
+        if (!p->strs) die("out of memory");
+        p->strs_cap = nc;
+    }
+    p->strs[p->strs_count] = s;
+    return (int32_t)p->strs_count++;
+}
+
+
+static int new_reg(VmBuilder *b) {
+    int r = b->top++;
+    if (b->top > b->p->nregs) b->p->nregs = b->top;
+    return r;
+}
+
+
+static void emit_mov(VmBuilder *b, int dst, int src) {
+    if (dst != src) emit_op(b->p, VM_MOV, dst, src, 0);
+}
+
+
+static void emit_load_imm(VmBuilder *b, int dst, int64_t v) {
+    if (v >= INT32_MIN && v <= INT32_MAX) emit_op(b->p, VM_LOADI, dst, (int32_t)v, 0);
+    else emit_op(b->p, VM_LOADK, dst, add_const(b->p, v), 0);
+}
+
+
+static void patch_to_here(VmBuilder *b, size_t at) {
+    VmInst *in = &b->p->code[at];
+    // jumps keep the target in the last operand they use
+    if (in->op == VM_JMP) in->a = (int32_t)b->p->count;
+    else in->b = (int32_t)b->p->count;
+}
+
+
+static int var_reg(VmBuilder *b, const char *name) {
+    int k = param_find(&b->params, name);
+    if (k >= 0) return b->params.at[k];
+    int idx = sym_find(b->st, name);
+    if (idx < 0) die("unknown variable");
+    return idx;
+}
+
+
+static void gen_into(VmBuilder *b, Expr *e, int dst);
+
+// variables are read in place, anything else lands in a fresh temp
+static int gen_operand(VmBuilder *b, Expr *e) {
+    if (e->kind == EX_VAR) return var_reg(b, e->v.var);
+    int r = new_reg(b);
+    gen_into(b, e, r);
+    return r;
+}
+
+
+// map / filter / reduce / for-each over the length taken up front, the
+// parameters are plain registers the body reads like variables
+static void gen_lambda_loop(VmBuilder *b, Expr *e, Builtin fn, int dst) {
+    Expr *lam = e->v.call.args[e->v.call.argc - 1];
+    Params outer = b->params;
+    int src = gen_operand(b, e->v.call.args[0]);
+    int acc = -1;
+    if (fn == BI_REDUCE) {
+        acc = new_reg(b);
+        gen_into(b, e->v.call.args[1], acc);
+        b->params.name[b->params.count] = lam->v.lambda.params[0];
+        b->params.at[b->params.count++] = acc;
+    }
+    int n = new_reg(b);
+    emit_op(b->p, VM_LEN, n, src, 0);
+    int out = -1;
+    if (fn == BI_MAP || fn == BI_FILTER) {
+        out = new_reg(b);
+        emit_op(b->p, fn == BI_MAP ? VM_NEWARRAY : VM_NEWLIST, out, n, 0);
+    }
+    int i = new_reg(b);
+    int one = new_reg(b);
+    int x = new_reg(b);
+    int t = new_reg(b);
+    emit_load_imm(b, i, 0);
+    emit_load_imm(b, one, 1);
+    b->params.name[b->params.count] = lam->v.lambda.params[lam->v.lambda.nparams - 1];
+    b->params.at[b->params.count++] = x;
+    size_t j_test = emit_op(b->p, VM_JMP, 0, 0, 0);
+    size_t top = b->p->count;
+    emit_op(b->p, VM_GET, x, src, i);
+    if (fn == BI_FILTER) {
+        int c = gen_operand(b, lam->v.lambda.body);
+        size_t j_skip = emit_op(b->p, VM_JZ, c, 0, 0);
+        emit_op(b->p, VM_PUSH, out, x, 0);
+        patch_to_here(b, j_skip);
+    } else if (fn == BI_MAP) {
+        gen_into(b, lam->v.lambda.body, t);
+        emit_op(b->p, VM_SET, out, i, t);
+    } else {
+        gen_into(b, lam->v.lambda.body, fn == BI_REDUCE ? acc : t);
+    }
+    emit_op(b->p, VM_ADD, i, i, one);
+    patch_to_here(b, j_test);
+    emit_op(b->p, VM_LT, t, i, n);
+    emit_op(b->p, VM_JNZ, t, (int32_t)top, 0);
+    b->params = outer;
+    emit_mov(b, dst, fn == BI_REDUCE ? acc : (fn == BI_EACH ? src : out));
+}
+
+
+static void gen_call(VmBuilder *b, Expr *e, int dst) {
+    size_t argc = e->v.call.argc;
+    Expr **args = e->v.call.args;
+    Builtin fn = builtin_find(e->v.call.name);
+    if (fn >= BI_MAP) {
+        gen_lambda_loop(b, e, fn, dst);
+        return;
+    }
+    int a0 = -1;
+    int a1 = -1;
+    int a2 = -1;
+    if (argc > 0) a0 = gen_operand(b, args[0]);
+    if (argc > 1) a1 = gen_operand(b, args[1]);
+    if (argc > 2) a2 = gen_operand(b, args[2]);
+    switch (fn) {
+        case BI_LIST_NEW:
+            if (argc == 0) {
+                a0 = new_reg(b);
+                emit_load_imm(b, a0, 8);
+            }
+            emit_op(b->p, VM_NEWLIST, dst, a0, 0);
+            return;
+        case BI_ARRAY_NEW:
+            emit_op(b->p, VM_NEWARRAY, dst, a0, 0);
+            return;
+        case BI_LEN:
+            emit_op(b->p, VM_LEN, dst, a0, 0);
+            return;
+        case BI_GET:
+            emit_op(b->p, VM_GET, dst, a0, a1);
+            return;
+        case BI_SET:
+            emit_op(b->p, VM_SET, a0, a1, a2);
+            emit_mov(b, dst, a2);
+            return;
+        case BI_PUSH:
+            emit_op(b->p, VM_PUSH, a0, a1, 0);
+            emit_mov(b, dst, a0);
+            return;
+        case BI_RESERVE:
+            emit_op(b->p, VM_RESERVE, a0, a1, 0);
+            emit_mov(b, dst, a0);
+            return;
+        case BI_POP:
+            emit_op(b->p, VM_POP, dst, a0, 0);
+            return;
+        case BI_RANGE:
+            emit_op(b->p, VM_RANGE, dst, a0, 0);
+            return;
+        default:
+            die("unknown call");
+    }
+}
+
+
+static void gen_into(VmBuilder *b, Expr *e, int dst) {
+    int saved = b->top;
+    switch (e->kind) {
+        case EX_NUM:
+            emit_load_imm(b, dst, e->v.num);
+            break;
+        case EX_BOOL:
+            emit_load_imm(b, dst, e->v.boolv ? 1 : 0);
+            break;
+        case EX_VAR:
+            emit_mov(b, dst, var_reg(b, e->v.var));
+            break;
+        case EX_STR:
+            die("string in expression");
+            break;
+        case EX_LAMBDA:
+            die("lambda in expression");
+            break;
+        case EX_UNARY: {
+            int r = gen_operand(b, e->v.un.expr);
+            emit_op(b->p, e->v.un.op == OP_NEG ? VM_NEG : VM_NOT, dst, r, 0);
+            break;
+        }
+        case EX_CALL:
+            gen_call(b, e, dst);
+            break;
+        case EX_BIN: {
+            OpKind op = e->v.bin.op;
+            if (op == OP_AND || op == OP_OR) {
+                // dst may be a variable the right side still reads, so go through a temp
+                int t = new_reg(b);
+                gen_into(b, e->v.bin.left, t);
+                size_t j;
+                if (op == OP_AND) {
+                    j = emit_op(b->p, VM_JZ, t, 0, 0);
+                } else {
+                    emit_op(b->p, VM_BOOL, t, t, 0);
+                    j = emit_op(b->p, VM_JNZ, t, 0, 0);
+                }
+                gen_into(b, e->v.bin.right, t);
+                emit_op(b->p, VM_BOOL, t, t, 0);
+                patch_to_here(b, j);
+                emit_mov(b, dst, t);
+                break;
+            }
+            int l = gen_operand(b, e->v.bin.left);
+            if (op == OP_SHL) {
+                emit_op(b->p, VM_SHL, dst, l, (int32_t)e->v.bin.right->v.num);
+                break;
+            }
+            int r;
+            if (op == OP_DIV_POW2) {
+                r = new_reg(b);
+                emit_load_imm(b, r, (int64_t)1 << e->v.bin.right->v.num);
+            } else {
+                r = gen_operand(b, e->v.bin.right);
+            }
+            if (op == OP_DIV_POW2 || op == OP_DIV_CONST) op = OP_DIV;
+            emit_op(b->p, (VmOp)(VM_ADD + (op - OP_ADD)), dst, l, r);
+            break;
+        }
+    }
+    b->top = saved;
+}
+
+
+static void gen_stmt_vm(VmBuilder *b, Stmt *s) {
+    if (!s) return;
+    int saved = b->top;
+    switch (s->kind) {
+        case ST_BLOCK:
+            for (size_t i = 0; i < s->v.block.count; i++) gen_stmt_vm(b, s->v.block.items[i]);
+            break;
+        case ST_PRINT:
+            if (s->v.print.expr->kind == EX_STR) {
+                emit_op(b->p, VM_PRINTS, add_str(b->p, s->v.print.expr->v.str), 0, 0);
+            } else {
+                emit_op(b->p, VM_PRINT, gen_operand(b, s->v.print.expr), 0, 0);
+            }
+            break;
+        case ST_LET:
+            gen_into(b, s->v.let.expr, var_reg(b, s->v.let.name));
+            break;
+        case ST_SET:
+            gen_into(b, s->v.set.expr, var_reg(b, s->v.set.name));
+            break;
+        case ST_IF: {
+            int c = gen_operand(b, s->v.ifs.cond);
+            size_t j_else = emit_op(b->p, VM_JZ, c, 0, 0);
+            gen_stmt_vm(b, s->v.ifs.thenb);
+            if (s->v.ifs.elseb) {
+                size_t j_end = emit_op(b->p, VM_JMP, 0, 0, 0);
+                patch_to_here(b, j_else);
+                gen_stmt_vm(b, s->v.ifs.elseb);
+                patch_to_here(b, j_end);
+            } else {
+                patch_to_here(b, j_else);
+            }
+            break;
+        }
+        case ST_REPEAT: {
+            // the counter register stays reserved for the whole body
+            int c = new_reg(b);
+            gen_into(b, s->v.repeat.count, c);
+            size_t j_skip = emit_op(b->p, VM_JLE0, c, 0, 0);
+            size_t start = b->p->count;
+            gen_stmt_vm(b, s->v.repeat.body);
+            emit_op(b->p, VM_LOOP, c, (int32_t)start, 0);
+            patch_to_here(b, j_skip);
+            break;
+        }
+        case ST_EXPR:
+            gen_into(b, s->v.expr.expr, new_reg(b));
+            break;
+    }
+    b->top = saved;
+}
+
+
+VmProg *vm_compile(Stmt *prog, SymTab *st) {
+    VmProg *p = (VmProg *)xmalloc(sizeof(VmProg));
+    memset(p, 0, sizeof(VmProg));
+    VmBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.p = p;
+    b.st = st;
+    b.top = (int)st->count;
+    p->nregs = b.top;
+    gen_stmt_vm(&b, prog);
+    emit_op(p, VM_HALT, 0, 0, 0);
+    return p;
+}
+
+
+/* ---- runtime ---- */
+
+typedef struct {
+    char *buf;
+    size_t pos;
+} VmOut;
+
+static void out_flush(VmOut *o) {
+    if (o->pos) fwrite(o->buf, 1, o->pos, stdout);
+    o->pos = 0;
+}
+
+
+static void out_write(VmOut *o, const char *s, size_t n) {
+    if (o->pos + n > OUTBUF_SIZE) {
+        out_flush(o);
+        if (n > OUTBUF_SIZE) {
+            fwrite(s, 1, n, stdout);
+            return;
+        }
+    }
+    memcpy(o->buf + o->pos, s, n);
+    o->pos += n;
+}
+
+
+static void out_int(VmOut *o, int64_t v) {
+    char tmp[32];
+    char *q = tmp + sizeof(tmp);
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    *--q = '\n';
+    do {
+        *--q = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) *--q = '-';
+    out_write(o, q, (size_t)(tmp + sizeof(tmp) - q));
+}
+
+
+static VmList *list_new(int64_t len, int64_t cap) {
+    if (cap < 0) die("bad list size");
+    VmList *l = (VmList *)xmalloc(sizeof(VmList));
+    l->len = len;
+    l->cap = cap;
+    l->data = cap ? (int64_t *)calloc((size_t)cap, sizeof(int64_t)) : 0;
+    if (cap && !l->data) die("out of memory");
+    return l;
+}
+
+
+// same policy as the native grow routine: max(2*cap, need, 4)
+static void list_grow(VmList *l, int64_t need) {
+    int64_t nc = l->cap * 2;
+    if (nc < need) nc = need;
+    if (nc < 4) nc = 4;
+    l->data = (int64_t *)realloc(l->data, (size_t)nc * sizeof(int64_t));
+    if (!l->data) die("out of memory");
+    l->cap = nc;
+}
+
+
+// a list declared in a branch that never ran is still 0
+static VmList *as_list(int64_t lv) {
+    VmList *l = (VmList *)(intptr_t)lv;
+    if (!l) die("list is not created");
+    return l;
+}
+
+
+static int64_t *list_at(int64_t lv, int64_t i) {
+    VmList *l = as_list(lv);
+    if (i < 0 || i >= l->len) die("index out of range");
+    return &l->data[i];
+}
+
+
+#define FROM_LIST(l) ((int64_t)(intptr_t)(l))
+#define WRAP(x) ((int64_t)(x))
+
+void vm_run(VmProg *p, int line_buffered) {
+    int64_t *r = (int64_t *)calloc(p->nregs ? (size_t)p->nregs : 1, sizeof(int64_t));
+    if (!r) die("out of memory");
+    VmOut out = {(char *)xmalloc(OUTBUF_SIZE), 0};
+    VmInst *code = p->code;
+    VmInst *pc = code;
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+#if defined(__GNUC__)
+#define VM_LABEL(n) &&op_##n,
+    static void *dispatch[VM_OP_COUNT] = { VM_OPS(VM_LABEL) };
+#define CASE(n) op_##n:
+#define NEXT() goto *dispatch[pc->op]
+    NEXT();
+#else
+    // no computed goto on msvc, a plain switch does the same job slower
+#define CASE(n) case VM_##n:
+#define NEXT() continue
+    for (;;) switch (pc->op) {
+#endif
+    CASE(LOADI) r[pc->a] = pc->b; pc++; NEXT();
+    CASE(LOADK) r[pc->a] = p->consts[pc->b]; pc++; NEXT();
+    CASE(MOV) r[pc->a] = r[pc->b]; pc++; NEXT();
+    CASE(ADD) r[pc->a] = WRAP((uint64_t)r[pc->b] + (uint64_t)r[pc->c]); pc++; NEXT();
+    CASE(SUB) r[pc->a] = WRAP((uint64_t)r[pc->b] - (uint64_t)r[pc->c]); pc++; NEXT();
+    CASE(MUL) r[pc->a] = WRAP((uint64_t)r[pc->b] * (uint64_t)r[pc->c]); pc++; NEXT();
+    CASE(DIV) {
+        int64_t d = r[pc->c];
+        if (d == 0) die("division by zero");
+        r[pc->a] = d == -1 ? WRAP(0 - (uint64_t)r[pc->b]) : r[pc->b] / d;
+        pc++;
+        NEXT();
+    }
+    CASE(EQ) r[pc->a] = r[pc->b] == r[pc->c]; pc++; NEXT();
+    CASE(NE) r[pc->a] = r[pc->b] != r[pc->c]; pc++; NEXT();
+    CASE(LT) r[pc->a] = r[pc->b] < r[pc->c]; pc++; NEXT();
+    CASE(GT) r[pc->a] = r[pc->b] > r[pc->c]; pc++; NEXT();
+    CASE(LE) r[pc->a] = r[pc->b] <= r[pc->c]; pc++; NEXT();
+    CASE(GE) r[pc->a] = r[pc->b] >= r[pc->c]; pc++; NEXT();
+    CASE(SHL) r[pc->a] = WRAP((uint64_t)r[pc->b] << pc->c); pc++; NEXT();
+    CASE(NEG) r[pc->a] = WRAP(0 - (uint64_t)r[pc->b]); pc++; NEXT();
+    CASE(NOT) r[pc->a] = r[pc->b] == 0; pc++; NEXT();
+    CASE(BOOL) r[pc->a] = r[pc->b] != 0; pc++; NEXT();
+    CASE(JMP) pc = code + pc->a; NEXT();
+    CASE(JZ) pc = r[pc->a] == 0 ? code + pc->b : pc + 1; NEXT();
+    CASE(JNZ) pc = r[pc->a] != 0 ? code + pc->b : pc + 1; NEXT();
+    CASE(JLE0) pc = r[pc->a] <= 0 ? code + pc->b : pc + 1; NEXT();
+    CASE(LOOP) pc = --r[pc->a] > 0 ? code + pc->b : pc + 1; NEXT();
+    CASE(PRINT) {
+        out_int(&out, r[pc->a]);
+        if (line_buffered) out_flush(&out);
+        pc++;
+        NEXT();
+    }
+    CASE(PRINTS) {
+        StringLit *s = p->strs[pc->a];
+        out_write(&out, s->data, s->len);
+        out_write(&out, "\n", 1);
+        if (line_buffered) out_flush(&out);
+        pc++;
+        NEXT();
+    }
+    CASE(NEWLIST) r[pc->a] = FROM_LIST(list_new(0, r[pc->b])); pc++; NEXT();
+    CASE(NEWARRAY) r[pc->a] = FROM_LIST(list_new(r[pc->b], r[pc->b])); pc++; NEXT();
+    CASE(LEN) r[pc->a] = as_list(r[pc->b])->len; pc++; NEXT();
+    CASE(GET) r[pc->a] = *list_at(r[pc->b], r[pc->c]); pc++; NEXT();
+    CASE(SET) *list_at(r[pc->a], r[pc->b]) = r[pc->c]; pc++; NEXT();
+    CASE(PUSH) {
+        VmList *l = as_list(r[pc->a]);
+        if (l->len >= l->cap) list_grow(l, l->len + 1);
+        l->data[l->len++] = r[pc->b];
+        pc++;
+        NEXT();
+    }
+    CASE(POP) {
+        VmList *l = as_list(r[pc->b]);
+        r[pc->a] = l->len ? l->data[--l->len] : 0;
+        pc++;
+        NEXT();
+    }
+    CASE(RANGE) {
+        VmList *l = list_new(r[pc->b], r[pc->b]);
+        for (int64_t i = 0; i < l->len; i++) l->data[i] = i;
+        r[pc->a] = FROM_LIST(l);
+        pc++;
+        NEXT();
+    }
+    CASE(RESERVE) {
+        VmList *l = as_list(r[pc->a]);
+        if (r[pc->b] > l->cap) list_grow(l, r[pc->b]);
+        pc++;
+        NEXT();
+    }
+    CASE(HALT) goto done;
+#if !defined(__GNUC__)
+    }
+#endif
+done:
+    out_flush(&out);
+    fflush(stdout);
+#undef CASE
+#undef NEXT
+}
+